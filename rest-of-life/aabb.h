@@ -3,6 +3,26 @@
 
 #include "rtweekend.h"
 
+#include "render_stats.h"
+
+// Branchless slab test against a box given as per-axis min/max. The sign bits pick the near
+// and far planes, so there is no swap, and min/max are written as comparisons that keep the
+// current interval when t is NaN. On a hit, tnear is the entry distance.
+inline bool slab_hit(const double lo[3], const double hi[3], const precomputed_ray &r,
+                     interval ray_t, double &tnear)
+{
+    RT_STATS_COUNT(stat_box_tests);
+    for (int a = 0; a < 3; a++)
+    {
+        auto t0 = (r.sign[a] ? hi[a] : lo[a]) * r.inv_dir[a] - r.origin_inv[a];
+        auto t1 = (r.sign[a] ? lo[a] : hi[a]) * r.inv_dir[a] - r.origin_inv[a];
+        ray_t.min = t0 > ray_t.min ? t0 : ray_t.min;
+        ray_t.max = t1 < ray_t.max ? t1 : ray_t.max;
+    }
+    tnear = ray_t.min;
+    return ray_t.min < ray_t.max;
+}
+
 class aabb
 {
 public:
@@ -46,8 +66,22 @@ public:
         return x;
     }
 
+    point3 center() const
+    {
+        return point3(0.5 * (x.min + x.max), 0.5 * (y.min + y.max), 0.5 * (z.min + z.max));
+    }
+
+    double surface_area() const
+    {
+        // Surface area of the box, used by the SAH builders. An empty box has zero area.
+        if (x.size() < 0 || y.size() < 0 || z.size() < 0)
+            return 0;
+        return 2 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+    }
+
     bool hit(const ray &r, interval ray_t) const
     {
+        RT_STATS_COUNT(stat_box_tests);
         for (int a = 0; a < 3; a++)
         {
             auto invD = 1 / r.direction()[a];
@@ -69,6 +103,14 @@ public:
         }
         return true;
     }
+
+    bool hit(const precomputed_ray &r, interval ray_t) const
+    {
+        double lo[3] = {x.min, y.min, z.min};
+        double hi[3] = {x.max, y.max, z.max};
+        double tnear;
+        return slab_hit(lo, hi, r, ray_t, tnear);
+    }
 };
 aabb operator+(const aabb &bbox, const vec3 &offset)
 {
@@ -0,0 +1,1681 @@
+#include "rtweekend.h"
+
+#include "box.h"
+#include "bvh.h"
+#include "bvh_build.h"
+#include "bvh_cache.h"
+#include "frozen_scene.h"
+#include "grid.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "lazy_bvh.h"
+#include "linear_bvh.h"
+#include "material_table.h"
+#include "mesh_io.h"
+#include "motion_bvh.h"
+#include "quad.h"
+#include "quantized_bvh.h"
+#include "sbvh.h"
+#include "scene_arena.h"
+#include "scenes.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Acceleration structure benchmarks. Usage:
+//
+//   ./benchmark build [cloud_size]    builder quality vs build time (median, sah, lbvh)
+//   ./benchmark refit [cloud_size]    frame sequence: rebuild vs refit vs refit + monitor
+//   ./benchmark instancing [per_side] box floor as separate quad lists vs unit-box instances
+//   ./benchmark shadow [cloud_size]   shadow-ray throughput: closest hit() vs occluded()
+//   ./benchmark compressed [cloud]    node memory and throughput: bvh_node, linear, quantized
+//   ./benchmark cache [cloud_size]    time to first ray: build + store vs mmap'd cache load
+//   ./benchmark sbvh                  object-split SAH vs spatial splits on quad-heavy scenes
+//   ./benchmark leaves [cloud_size]   linear_bvh leaf size cap: 1, 2, 4, 8 primitives
+//   ./benchmark boxes [box_count]     ray-box tests per second: per-box division vs precomputed
+//   ./benchmark motion [cloud_size]   moving spheres: shutter-union bounds vs motion_bvh
+//   ./benchmark layout [cloud_size]   node order: allocation, depth-first, treelets; cache misses
+//   ./benchmark grid [cloud_size]     BVH vs uniform and two-level grids, per-subtree choice
+//   ./benchmark lazy [cloud_size]     full build vs lazy subtrees for frames that see a corner
+//   ./benchmark mesh [triangles]      triangle_mesh vs one hittable per triangle; watertightness
+//   ./benchmark load [triangles]      PLY and OBJ load throughput against a plain read()
+//   ./benchmark box                   cornell_box and final_scene: six-quad boxes vs aligned_box
+//   ./benchmark spheres [cloud_size]  sphere_set (SoA, AVX leaves) vs one hittable per sphere
+//   ./benchmark threads [max_threads] cornell_box paths with material scattering, 1..max threads
+//   ./benchmark dispatch [cloud_size] scene as authored vs frozen, with virtual vs switch leaves
+//   ./benchmark materials             shading: virtual material calls vs material_table switch
+//   ./benchmark arena [objects]       scene objects from make_shared vs a scene_arena
+//
+// Rays are generated from a fixed seed, so numbers are comparable between runs.
+
+class bench_timer
+{
+public:
+    bench_timer() : start(std::chrono::high_resolution_clock::now()) {}
+
+    double elapsed_ms() const
+    {
+        auto now = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(now - start).count();
+    }
+
+private:
+    std::chrono::high_resolution_clock::time_point start;
+};
+
+// Hardware cache misses of the calling thread in user space, from perf_event_open. Counts
+// read as -1 where the kernel, the machine or the platform does not provide them.
+class cache_counters
+{
+public:
+    cache_counters()
+    {
+#ifdef __linux__
+        l1_fd = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                                                     PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                                                     PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        llc_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    ~cache_counters()
+    {
+#ifdef __linux__
+        if (l1_fd >= 0)
+            close(l1_fd);
+        if (llc_fd >= 0)
+            close(llc_fd);
+#endif
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        for (int fd : {l1_fd, llc_fd})
+        {
+            if (fd >= 0)
+            {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    void stop()
+    {
+#ifdef __linux__
+        for (int fd : {l1_fd, llc_fd})
+        {
+            if (fd >= 0)
+                ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+#endif
+    }
+
+    long long l1_misses() const { return read_counter(l1_fd); }
+    long long llc_misses() const { return read_counter(llc_fd); }
+
+private:
+    int l1_fd = -1;
+    int llc_fd = -1;
+
+#ifdef __linux__
+    static int open_counter(uint32_t type, uint64_t config)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    static long long read_counter(int fd)
+    {
+#ifdef __linux__
+        long long value;
+        if (fd >= 0 && read(fd, &value, sizeof(value)) == sizeof(value))
+            return value;
+#endif
+        return -1;
+    }
+};
+
+struct bench_scene
+{
+    std::string name;
+    hittable_list world;
+    aabb ray_region; // ray origins are drawn from this box
+};
+
+// Closest-hit throughput in millions of rays per second.
+double trace_mrays(const hittable &world, const std::vector<ray> &rays, size_t &hits)
+{
+    hits = 0;
+    bench_timer timer;
+    for (const auto &r : rays)
+    {
+        hit_record rec;
+        if (world.hit(r, interval(0.001, infinity), rec))
+            hits++;
+    }
+    return rays.size() / (timer.elapsed_ms() * 1000.0);
+}
+
+std::vector<bench_scene> standard_scenes(int cloud_size)
+{
+    std::vector<bench_scene> scenes;
+    scenes.push_back({"random_spheres", random_spheres_world(),
+                      aabb(point3(-11, 0, -11), point3(11, 2, 11))});
+    scenes.push_back({"final_scene", final_scene_world(),
+                      aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000))});
+    auto cloud = sphere_cloud_world(cloud_size);
+    auto region = cloud.bounding_box();
+    scenes.push_back({"sphere_cloud_" + std::to_string(cloud_size), cloud, region});
+    return scenes;
+}
+
+void bench_build(int cloud_size)
+{
+    const bvh_build_method methods[] = {bvh_build_method::median, bvh_build_method::sah,
+                                        bvh_build_method::lbvh};
+
+    std::cout << std::left << std::setw(22) << "scene" << std::setw(8) << "builder"
+              << std::right << std::setw(12) << "build ms" << std::setw(12) << "SAH cost"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (auto &scene : standard_scenes(cloud_size))
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+        for (auto method : methods)
+        {
+            // The median builder copies the object array at every node, which is quadratic.
+            if (method == bvh_build_method::median && scene.world.objects.size() > 20000)
+                continue;
+
+            bench_timer timer;
+            auto root = build_bvh(scene.world, method);
+            auto build_ms = timer.elapsed_ms();
+
+            size_t hits;
+            auto mrays = trace_mrays(*root, rays, hits);
+
+            std::cout << std::left << std::setw(22) << scene.name << std::setw(8)
+                      << bvh_build_method_name(method) << std::right << std::fixed
+                      << std::setprecision(2) << std::setw(12) << build_ms << std::setw(12)
+                      << bvh_sah_cost(*root) << std::setw(12) << mrays << std::setw(10) << hits
+                      << '\n';
+        }
+    }
+}
+
+void bench_refit(int cloud_size)
+{
+    // Every sphere drifts with its own velocity, so the refitted tree slowly degrades as the
+    // spheres swap places. Each strategy replays the same frames from the same start.
+    const int frames = 30;
+    auto world = sphere_cloud_world(cloud_size);
+    auto extent = world.bounding_box().x.size();
+
+    std::vector<shared_ptr<sphere>> spheres;
+    std::vector<vec3> velocities;
+    std::mt19937 gen(11);
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    for (const auto &object : world.objects)
+    {
+        spheres.push_back(std::dynamic_pointer_cast<sphere>(object));
+        velocities.push_back(0.01 * extent * vec3(unit(gen), unit(gen), unit(gen)));
+    }
+
+    auto rays = random_rays(world.bounding_box(), 20000);
+
+    std::cout << std::left << std::setw(16) << "strategy" << std::right << std::setw(14)
+              << "update ms/f" << std::setw(14) << "trace ms/f" << std::setw(14) << "total ms/f"
+              << std::setw(12) << "final SAH" << std::setw(10) << "rebuilds" << '\n';
+
+    const char *strategies[] = {"rebuild", "refit", "refit+monitor"};
+    for (int strategy = 0; strategy < 3; strategy++)
+    {
+        dynamic_bvh bvh(world, bvh_build_method::sah, strategy == 1 ? infinity : 1.5);
+        double update_ms = 0, trace_ms = 0;
+
+        for (int frame = 0; frame < frames; frame++)
+        {
+            for (size_t i = 0; i < spheres.size(); i++)
+                spheres[i]->move(velocities[i]);
+
+            bench_timer update;
+            if (strategy == 0)
+                bvh.rebuild();
+            else
+                bvh.update();
+            update_ms += update.elapsed_ms();
+
+            size_t hits;
+            bench_timer trace;
+            trace_mrays(bvh.tree(), rays, hits);
+            trace_ms += trace.elapsed_ms();
+        }
+
+        std::cout << std::left << std::setw(16) << strategies[strategy] << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(14) << update_ms / frames
+                  << std::setw(14) << trace_ms / frames << std::setw(14)
+                  << (update_ms + trace_ms) / frames << std::setw(12) << bvh.cost()
+                  << std::setw(10) << bvh.rebuild_count() - 1 << '\n';
+
+        for (size_t i = 0; i < spheres.size(); i++)
+            spheres[i]->move(-frames * velocities[i]);
+    }
+}
+
+struct scene_footprint
+{
+    size_t objects = 0;
+    size_t bytes = 0;
+};
+
+// Unique objects reachable from root and their approximate heap size (object plus the
+// make_shared control block). Shared subtrees are counted once.
+void measure_footprint(const hittable *root, std::unordered_set<const hittable *> &seen,
+                       scene_footprint &fp)
+{
+    if (!root || !seen.insert(root).second)
+        return;
+
+    const size_t control_block = 2 * sizeof(long);
+    fp.objects++;
+    if (auto node = dynamic_cast<const bvh_node *>(root))
+    {
+        fp.bytes += sizeof(bvh_node) + control_block;
+        measure_footprint(node->left_child().get(), seen, fp);
+        measure_footprint(node->right_child().get(), seen, fp);
+    }
+    else if (auto list = dynamic_cast<const hittable_list *>(root))
+    {
+        fp.bytes += sizeof(hittable_list) + control_block +
+                    list->objects.capacity() * sizeof(shared_ptr<hittable>);
+        for (const auto &object : list->objects)
+            measure_footprint(object.get(), seen, fp);
+    }
+    else if (auto inst = dynamic_cast<const instance *>(root))
+    {
+        fp.bytes += sizeof(instance) + control_block;
+        measure_footprint(inst->instanced_object().get(), seen, fp);
+    }
+    else if (dynamic_cast<const quad *>(root))
+        fp.bytes += sizeof(quad) + control_block;
+    else if (dynamic_cast<const sphere *>(root))
+        fp.bytes += sizeof(sphere) + control_block;
+    else
+        fp.bytes += sizeof(hittable) + control_block;
+}
+
+void bench_instancing(int per_side)
+{
+    // The final_scene floor at a configurable size, built both ways.
+    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    std::vector<std::pair<point3, point3>> extents;
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> height(1, 101);
+    for (int i = 0; i < per_side; i++)
+    {
+        for (int j = 0; j < per_side; j++)
+        {
+            auto x0 = -1000.0 + i * 100.0, z0 = -1000.0 + j * 100.0;
+            extents.push_back({point3(x0, 0, z0), point3(x0 + 100, height(gen), z0 + 100)});
+        }
+    }
+
+    std::cout << std::left << std::setw(12) << "layout" << std::right << std::setw(12)
+              << "build ms" << std::setw(12) << "objects" << std::setw(14) << "bytes"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    auto rays = random_rays(aabb(point3(-1000, 0, -1000),
+                                 point3(-1000 + 100.0 * per_side, 150, -1000 + 100.0 * per_side)),
+                            200000);
+
+    for (int instanced = 0; instanced < 2; instanced++)
+    {
+        bench_timer timer;
+        hittable_list boxes;
+        if (instanced)
+        {
+            auto unit_box = build_bvh(*box_quads(point3(0, 0, 0), point3(1, 1, 1), ground),
+                                      bvh_build_method::sah);
+            for (const auto &e : extents)
+                boxes.add(make_shared<instance>(
+                    unit_box, affine_transform::translation(e.first) *
+                                  affine_transform::scaling(e.second - e.first)));
+        }
+        else
+        {
+            for (const auto &e : extents)
+                boxes.add(box_quads(e.first, e.second, ground));
+        }
+        auto root = build_bvh(boxes, bvh_build_method::sah);
+        auto build_ms = timer.elapsed_ms();
+
+        scene_footprint fp;
+        std::unordered_set<const hittable *> seen;
+        measure_footprint(root.get(), seen, fp);
+
+        size_t hits;
+        auto mrays = trace_mrays(*root, rays, hits);
+
+        std::cout << std::left << std::setw(12) << (instanced ? "instanced" : "box lists")
+                  << std::right << std::fixed << std::setprecision(2) << std::setw(12)
+                  << build_ms << std::setw(12) << fp.objects << std::setw(14) << fp.bytes
+                  << std::setw(12) << mrays << std::setw(10) << hits << '\n';
+    }
+}
+
+void bench_shadow(int cloud_size)
+{
+    // Shadow segments between two random points of the scene; a segment is blocked if
+    // anything lies strictly between its end points.
+    std::vector<bench_scene> scenes;
+    scenes.push_back({"cornell_box", cornell_box_world(),
+                      aabb(point3(1, 1, 1), point3(554, 554, 554))});
+    scenes.push_back({"random_spheres", random_spheres_world(),
+                      aabb(point3(-11, 0, -11), point3(11, 2, 11))});
+    auto cloud = sphere_cloud_world(cloud_size);
+    auto region = cloud.bounding_box();
+    scenes.push_back({"sphere_cloud_" + std::to_string(cloud_size), cloud, region});
+
+    std::cout << std::left << std::setw(22) << "scene" << std::right << std::setw(14)
+              << "hit Mrays/s" << std::setw(16) << "occl Mrays/s" << std::setw(10) << "speedup"
+              << std::setw(10) << "blocked" << std::setw(10) << "differ" << '\n';
+
+    for (auto &scene : scenes)
+    {
+        auto root = build_bvh(scene.world, bvh_build_method::sah);
+        auto starts = random_rays(scene.ray_region, 200000, 5);
+        auto ends = random_rays(scene.ray_region, 200000, 6);
+        std::vector<ray> segments;
+        for (size_t i = 0; i < starts.size(); i++)
+            segments.push_back(ray(starts[i].origin(), ends[i].origin() - starts[i].origin()));
+
+        const interval segment_t(0.001, 0.999);
+        std::vector<char> by_hit(segments.size()), by_occluded(segments.size());
+
+        bench_timer hit_timer;
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            hit_record rec;
+            by_hit[i] = root->hit(segments[i], segment_t, rec);
+        }
+        auto hit_ms = hit_timer.elapsed_ms();
+
+        bench_timer occluded_timer;
+        for (size_t i = 0; i < segments.size(); i++)
+            by_occluded[i] = root->occluded(segments[i], segment_t);
+        auto occluded_ms = occluded_timer.elapsed_ms();
+
+        size_t blocked = 0, differ = 0;
+        for (size_t i = 0; i < segments.size(); i++)
+        {
+            blocked += by_occluded[i];
+            differ += by_hit[i] != by_occluded[i];
+        }
+
+        std::cout << std::left << std::setw(22) << scene.name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(14) << segments.size() / (hit_ms * 1000)
+                  << std::setw(16) << segments.size() / (occluded_ms * 1000) << std::setw(10)
+                  << hit_ms / occluded_ms << std::setw(10) << blocked << std::setw(10) << differ
+                  << '\n';
+    }
+}
+
+size_t bvh_node_bytes(const hittable &root)
+{
+    // Heap bytes of the bvh_node objects of a tree (plus their make_shared control blocks).
+    auto node = dynamic_cast<const bvh_node *>(&root);
+    if (!node)
+        return 0;
+    auto bytes = sizeof(bvh_node) + 2 * sizeof(long) + bvh_node_bytes(*node->left_child());
+    if (node->right_child() != node->left_child())
+        bytes += bvh_node_bytes(*node->right_child());
+    return bytes;
+}
+
+void bench_compressed(int cloud_size)
+{
+    std::vector<bench_scene> scenes;
+    scenes.push_back({"random_spheres", random_spheres_world(),
+                      aabb(point3(-11, 0, -11), point3(11, 2, 11))});
+    auto cloud = sphere_cloud_world(cloud_size);
+    auto region = cloud.bounding_box();
+    scenes.push_back({"sphere_cloud_" + std::to_string(cloud_size), cloud, region});
+
+    std::cout << std::left << std::setw(22) << "scene" << std::setw(11) << "nodes"
+              << std::right << std::setw(14) << "node bytes" << std::setw(12) << "bytes/prim"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (auto &scene : scenes)
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+        auto tree = build_bvh(scene.world, bvh_build_method::sah);
+        linear_bvh linear(*tree);
+        quantized_bvh quantized(*tree);
+        auto prims = static_cast<double>(scene.world.objects.size());
+
+        struct variant
+        {
+            const char *name;
+            const hittable *root;
+            size_t bytes;
+        } variants[] = {
+            {"bvh_node", tree.get(), bvh_node_bytes(*tree)},
+            {"linear", &linear, linear.node_count() * sizeof(linear_bvh_node)},
+            {"quantized", &quantized, quantized.node_array().size() * sizeof(quantized_bvh_node)},
+        };
+
+        for (const auto &v : variants)
+        {
+            size_t hits;
+            auto mrays = trace_mrays(*v.root, rays, hits);
+            std::cout << std::left << std::setw(22) << scene.name << std::setw(11) << v.name
+                      << std::right << std::fixed << std::setprecision(2) << std::setw(14)
+                      << v.bytes << std::setw(12) << v.bytes / prims << std::setw(12) << mrays
+                      << std::setw(10) << hits << '\n';
+        }
+    }
+}
+
+void bench_cache(int cloud_size)
+{
+    auto world = sphere_cloud_world(cloud_size);
+    auto rays = random_rays(world.bounding_box(), 200000);
+    bvh_cache cache("bvh_cache_bench");
+
+    // Start cold: drop any file a previous run left for this exact scene.
+    std::remove(cache.path_for(world, bvh_build_method::sah).c_str());
+
+    std::cout << std::left << std::setw(10) << "run" << std::setw(8) << "cache" << std::right
+              << std::setw(16) << "first ray ms" << std::setw(12) << "Mrays/s" << std::setw(10)
+              << "hits" << '\n';
+
+    size_t first_hits = 0;
+    for (int run = 0; run < 2; run++)
+    {
+        bench_timer timer;
+        auto bvh = cache.load_or_build(world);
+        hit_record rec;
+        bvh->hit(rays[0], interval(0.001, infinity), rec);
+        auto first_ray_ms = timer.elapsed_ms();
+
+        size_t hits;
+        auto mrays = trace_mrays(*bvh, rays, hits);
+        if (run == 0)
+            first_hits = hits;
+
+        std::cout << std::left << std::setw(10) << (run == 0 ? "cold" : "warm") << std::setw(8)
+                  << (cache.last_was_hit() ? "hit" : "miss") << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(16) << first_ray_ms << std::setw(12)
+                  << mrays << std::setw(10) << hits << '\n';
+
+        if (run == 1 && hits != first_hits)
+            std::cout << "  mismatch: cached tree finds " << hits << " hits, built tree "
+                      << first_hits << '\n';
+    }
+}
+
+void bench_sbvh()
+{
+    std::vector<bench_scene> scenes;
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+
+    scenes.push_back({"cornell_box", cornell_box_world(),
+                      aabb(point3(0, 0, 0), point3(555, 555, 555))});
+
+    // The same room with both boxes as loose quads, so the walls compete with them directly.
+    auto cornell_quads = cornell_box_world();
+    cornell_quads.objects.resize(6);
+    auto box1 = box_quads(point3(265, 0, 295), point3(430, 330, 460), white);
+    auto box2 = box_quads(point3(130, 0, 65), point3(295, 165, 230), white);
+    for (const auto &side : box1->objects)
+        cornell_quads.add(side);
+    for (const auto &side : box2->objects)
+        cornell_quads.add(side);
+    scenes.push_back({"cornell_quads", cornell_quads,
+                      aabb(point3(0, 0, 0), point3(555, 555, 555))});
+
+    // The walls around a cloud of small spheres: every wall box overlaps the whole cloud.
+    auto cornell_spheres = cornell_box_world();
+    cornell_spheres.objects.resize(6);
+    for (int i = 0; i < 2000; i++)
+        cornell_spheres.add(make_shared<sphere>(point3::random(20, 535), 5, white));
+    scenes.push_back({"cornell_spheres", cornell_spheres,
+                      aabb(point3(0, 0, 0), point3(555, 555, 555))});
+
+    scenes.push_back({"final_scene", final_scene_world(),
+                      aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000))});
+
+    // The final_scene floor as the book originally built it: 400 box lists of quads.
+    hittable_list floor;
+    for (int i = 0; i < 20; i++)
+    {
+        for (int j = 0; j < 20; j++)
+        {
+            point3 p0(-1000 + i * 100.0, 0, -1000 + j * 100.0);
+            auto sides = box_quads(p0, p0 + vec3(100, random_double(1, 101), 100), white);
+            for (const auto &side : sides->objects)
+                floor.add(side);
+        }
+    }
+    scenes.push_back({"floor_quads", floor,
+                      aabb(point3(-1000, 0, -1000), point3(1000, 200, 1000))});
+
+    std::cout << std::left << std::setw(17) << "scene" << std::setw(18) << "structure"
+              << std::right << std::setw(8) << "refs" << std::setw(8) << "nodes"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (auto &scene : scenes)
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+
+        sbvh_builder mailboxed, plain;
+        plain.mailboxing = false;
+        auto sbvh = mailboxed.build(scene.world);
+        auto sbvh_plain = plain.build(scene.world);
+        linear_bvh sah(scene.world, bvh_build_method::sah);
+
+        struct variant
+        {
+            const char *name;
+            const linear_bvh *bvh;
+        } variants[] = {
+            {"sah", &sah},
+            {"sbvh", sbvh.get()},
+            {"sbvh no mailbox", sbvh_plain.get()},
+        };
+
+        for (const auto &v : variants)
+        {
+            size_t hits;
+            auto mrays = trace_mrays(*v.bvh, rays, hits);
+            std::cout << std::left << std::setw(17) << scene.name << std::setw(18) << v.name
+                      << std::right << std::setw(8) << v.bvh->primitive_count() << std::setw(8)
+                      << v.bvh->node_count() << std::fixed << std::setprecision(2)
+                      << std::setw(12) << mrays << std::setw(10) << hits << '\n';
+        }
+    }
+}
+
+void bench_leaves(int cloud_size)
+{
+    std::cout << std::left << std::setw(22) << "scene" << std::right << std::setw(10)
+              << "max leaf" << std::setw(10) << "nodes" << std::setw(12) << "mean leaf"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (auto &scene : standard_scenes(cloud_size))
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+        for (int max_leaf : {1, 2, 4, 8})
+        {
+            linear_bvh bvh(scene.world, bvh_build_method::sah, max_leaf);
+            size_t leaves = 0;
+            for (size_t i = 0; i < bvh.node_count(); i++)
+                leaves += bvh.node_data()[i].count > 0;
+
+            size_t hits;
+            auto mrays = trace_mrays(bvh, rays, hits);
+            std::cout << std::left << std::setw(22) << scene.name << std::right << std::setw(10)
+                      << max_leaf << std::setw(10) << bvh.node_count() << std::fixed
+                      << std::setprecision(2) << std::setw(12)
+                      << static_cast<double>(bvh.primitive_count()) / leaves << std::setw(12)
+                      << mrays << std::setw(10) << hits << '\n';
+        }
+    }
+}
+
+void bench_boxes(int box_count)
+{
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<aabb> boxes;
+    for (int i = 0; i < box_count; i++)
+    {
+        point3 a(20 * unit(gen) - 10, 20 * unit(gen) - 10, 20 * unit(gen) - 10);
+        boxes.push_back(aabb(a, a + vec3(4 * unit(gen), 4 * unit(gen), 4 * unit(gen))));
+    }
+
+    // A fifth of the rays run exactly along an axis, to exercise zero direction components.
+    auto rays = random_rays(aabb(point3(-10, -10, -10), point3(10, 10, 10)), 4096);
+    for (size_t i = 0; i < rays.size(); i += 5)
+        rays[i] = ray(rays[i].origin(), vec3(0, 0, rays[i].direction().z() < 0 ? -1 : 1));
+
+    auto tests = static_cast<double>(boxes.size()) * rays.size();
+    interval ray_t(0.001, infinity);
+
+    size_t divided_hits = 0;
+    bench_timer divided_timer;
+    for (const auto &r : rays)
+    {
+        for (const auto &b : boxes)
+            divided_hits += b.hit(r, ray_t);
+    }
+    auto divided_ms = divided_timer.elapsed_ms();
+
+    size_t precomputed_hits = 0;
+    bench_timer precomputed_timer;
+    for (const auto &r : rays)
+    {
+        precomputed_ray pr(r);
+        for (const auto &b : boxes)
+            precomputed_hits += b.hit(pr, ray_t);
+    }
+    auto precomputed_ms = precomputed_timer.elapsed_ms();
+
+    std::cout << std::left << std::setw(14) << "slab test" << std::right << std::setw(14)
+              << "Mtests/s" << std::setw(12) << "hits" << '\n' << std::fixed
+              << std::setprecision(1);
+    std::cout << std::left << std::setw(14) << "divide" << std::right << std::setw(14)
+              << tests / (divided_ms * 1000) << std::setw(12) << divided_hits << '\n';
+    std::cout << std::left << std::setw(14) << "precomputed" << std::right << std::setw(14)
+              << tests / (precomputed_ms * 1000) << std::setw(12) << precomputed_hits << '\n';
+}
+
+void bench_motion(int cloud_size)
+{
+    // random_spheres moves its small diffuse spheres up by at most half a unit; the cloud
+    // moves every sphere by up to ten times its radius in a random direction.
+    std::vector<bench_scene> scenes;
+    scenes.push_back({"random_spheres", random_spheres_world(),
+                      aabb(point3(-11, 0, -11), point3(11, 2, 11))});
+
+    hittable_list cloud;
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto extent = 10.0 * std::cbrt(static_cast<double>(cloud_size));
+    for (int i = 0; i < cloud_size; i++)
+    {
+        auto center = point3::random(0, extent);
+        auto radius = random_double(0.5, 2.0);
+        auto travel = 10 * radius * random_unit_vector();
+        cloud.add(make_shared<sphere>(center, center + travel, radius, white));
+    }
+    scenes.push_back({"moving_cloud_" + std::to_string(cloud_size), cloud,
+                      cloud.bounding_box()});
+
+    std::cout << std::left << std::setw(22) << "scene" << std::setw(14) << "structure"
+              << std::right << std::setw(10) << "nodes" << std::setw(12) << "build ms"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (const auto &scene : scenes)
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+
+        bench_timer static_timer;
+        linear_bvh static_bvh(scene.world);
+        auto static_ms = static_timer.elapsed_ms();
+
+        bench_timer motion_timer;
+        motion_bvh moving_bvh(scene.world);
+        auto motion_ms = motion_timer.elapsed_ms();
+
+        size_t static_hits, motion_hits;
+        auto static_mrays = trace_mrays(static_bvh, rays, static_hits);
+        auto motion_mrays = trace_mrays(moving_bvh, rays, motion_hits);
+
+        std::cout << std::left << std::setw(22) << scene.name << std::setw(14) << "linear_bvh"
+                  << std::right << std::setw(10) << static_bvh.node_count() << std::fixed
+                  << std::setprecision(2) << std::setw(12) << static_ms << std::setw(12)
+                  << static_mrays << std::setw(10) << static_hits << '\n';
+        std::cout << std::left << std::setw(22) << scene.name << std::setw(14) << "motion_bvh"
+                  << std::right << std::setw(10) << moving_bvh.node_array().size()
+                  << std::setw(12) << motion_ms << std::setw(12) << motion_mrays
+                  << std::setw(10) << motion_hits << '\n';
+    }
+}
+
+void bench_layout(int cloud_size)
+{
+    auto world = sphere_cloud_world(cloud_size);
+    auto rays = random_rays(world.bounding_box(), 200000);
+
+    std::cout << "sphere_cloud_" << cloud_size << ", " << rays.size() << " rays\n\n"
+              << std::left << std::setw(20) << "layout" << std::right << std::setw(12)
+              << "Mrays/s" << std::setw(14) << "L1D miss/ray" << std::setw(14) << "LLC miss/ray"
+              << std::setw(10) << "hits" << '\n';
+
+    cache_counters counters;
+    auto report = [&](const char *name, const hittable &bvh) {
+        size_t hits;
+        trace_mrays(bvh, rays, hits); // warm up
+        counters.start();
+        auto mrays = trace_mrays(bvh, rays, hits);
+        counters.stop();
+
+        std::cout << std::left << std::setw(20) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(12) << mrays;
+        for (auto misses : {counters.l1_misses(), counters.llc_misses()})
+        {
+            if (misses < 0)
+                std::cout << std::setw(14) << "n/a";
+            else
+                std::cout << std::setw(14) << static_cast<double>(misses) / rays.size();
+        }
+        std::cout << std::setw(10) << hits << '\n';
+    };
+
+    {
+        // Nodes wherever make_shared<bvh_node> put them.
+        auto root = build_bvh(world, bvh_build_method::sah);
+        report("bvh_node", *root);
+    }
+
+    linear_bvh bvh(world);
+    report("depth-first", bvh);
+    bvh.reorder_treelets(2);
+    report("treelets 64 B", bvh);
+    bvh.reorder_treelets(linear_bvh::default_treelet_nodes);
+    report("treelets 4 KiB", bvh);
+    bvh.reorder_treelets(2 * 1024 * 1024 / sizeof(linear_bvh_node));
+    report("treelets 2 MiB", bvh);
+}
+
+// The primitives below a bvh_node tree, in tree order.
+void collect_leaves(const shared_ptr<hittable> &object, hittable_list &out)
+{
+    if (auto node = dynamic_cast<const bvh_node *>(object.get()))
+    {
+        collect_leaves(node->left_child(), out);
+        if (node->right_child() != node->left_child())
+            collect_leaves(node->right_child(), out);
+    }
+    else
+        out.add(object);
+}
+
+// Candidate structures over one list of primitives.
+std::vector<std::pair<std::string, shared_ptr<hittable>>> grid_candidates(
+    const hittable_list &list, std::vector<double> *build_ms = nullptr)
+{
+    std::vector<std::pair<std::string, shared_ptr<hittable>>> candidates;
+    for (int kind = 0; kind < 3; kind++)
+    {
+        bench_timer timer;
+        shared_ptr<hittable> structure;
+        if (kind == 0)
+            structure = make_shared<linear_bvh>(list);
+        else if (kind == 1)
+            structure = make_shared<uniform_grid>(list);
+        else
+            structure = make_shared<two_level_grid>(list);
+        if (build_ms)
+            build_ms->push_back(timer.elapsed_ms());
+        candidates.push_back({kind == 0 ? "linear_bvh" : kind == 1 ? "uniform_grid"
+                                                                    : "two_level_grid",
+                              structure});
+    }
+    return candidates;
+}
+
+// Replaces a bvh_node subtree (possibly under an instance) by whichever candidate structure
+// traces a probe set of rays through its bounds fastest. Anything else is kept as is.
+shared_ptr<hittable> pick_structure(const shared_ptr<hittable> &object, std::string &choice)
+{
+    choice = "kept";
+    if (auto inst = dynamic_cast<const instance *>(object.get()))
+    {
+        auto inner = pick_structure(inst->instanced_object(), choice);
+        return inner == inst->instanced_object() ? object
+                                                 : make_shared<instance>(inner, inst->transform());
+    }
+    if (!dynamic_cast<const bvh_node *>(object.get()))
+        return object;
+
+    hittable_list primitives;
+    collect_leaves(object, primitives);
+    auto probes = random_rays(primitives.bounding_box(), 20000, 11);
+
+    double best = 0;
+    shared_ptr<hittable> picked;
+    for (const auto &candidate : grid_candidates(primitives))
+    {
+        size_t hits;
+        auto mrays = trace_mrays(*candidate.second, probes, hits);
+        if (mrays > best)
+        {
+            best = mrays;
+            picked = candidate.second;
+            choice = candidate.first;
+        }
+    }
+    return picked;
+}
+
+void bench_grid(int cloud_size)
+{
+    auto final_world = final_scene_world();
+    hittable_list floor, cluster;
+    collect_leaves(final_world.objects.front(), floor);
+    // The cluster is a sphere_set in final_scene_world; the structures compared here take its
+    // spheres one hittable each.
+    auto cluster_instance = dynamic_cast<const instance *>(final_world.objects.back().get());
+    auto cluster_set = dynamic_cast<const sphere_set *>(cluster_instance->instanced_object().get());
+    for (const auto &s : cluster_set->sphere_array())
+        cluster.add(make_shared<sphere>(s.center, s.radius, s.mat));
+    auto cluster_transform = cluster_instance->transform();
+
+    // The sphere cloud is uniform; the clumps put a quarter of it into eight dense balls.
+    auto uniform_cloud = sphere_cloud_world(cloud_size);
+    hittable_list clumped_cloud;
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto extent = 10.0 * std::cbrt(static_cast<double>(cloud_size));
+    for (int i = 0; i < cloud_size; i++)
+    {
+        auto center = i % 4 == 0 ? point3::random(0, extent)
+                                 : point3(extent / 4 + extent / 2 * (i % 2),
+                                          extent / 4 + extent / 2 * (i / 2 % 2),
+                                          extent / 4 + extent / 2 * (i / 4 % 2)) +
+                                       extent / 16 * random_in_unit_sphere();
+        clumped_cloud.add(make_shared<sphere>(center, random_double(0.5, 2.0), white));
+    }
+
+    std::vector<bench_scene> scenes;
+    scenes.push_back({"final_floor", floor, floor.bounding_box()});
+    scenes.push_back({"final_cluster", cluster, cluster.bounding_box()});
+    scenes.push_back({"random_spheres", random_spheres_world(),
+                      aabb(point3(-11, 0, -11), point3(11, 2, 11))});
+    scenes.push_back({"sphere_cloud_" + std::to_string(cloud_size), uniform_cloud,
+                      uniform_cloud.bounding_box()});
+    scenes.push_back({"clumped_cloud_" + std::to_string(cloud_size), clumped_cloud,
+                      clumped_cloud.bounding_box()});
+
+    std::cout << std::left << std::setw(22) << "scene" << std::setw(16) << "structure"
+              << std::right << std::setw(12) << "build ms" << std::setw(12) << "refs"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n';
+
+    for (const auto &scene : scenes)
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+        std::vector<double> build_ms;
+        auto candidates = grid_candidates(scene.world, &build_ms);
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            const auto &structure = *candidates[i].second;
+            // Primitive references of the BVH's leaves or the grid's (top-level) cells.
+            size_t refs;
+            if (auto grid = dynamic_cast<const uniform_grid *>(&structure))
+                refs = grid->reference_count();
+            else
+                refs = static_cast<const linear_bvh &>(structure).primitive_count();
+
+            size_t hits;
+            auto mrays = trace_mrays(structure, rays, hits);
+            std::cout << std::left << std::setw(22) << scene.name << std::setw(16)
+                      << candidates[i].first << std::right << std::fixed << std::setprecision(2)
+                      << std::setw(12) << build_ms[i] << std::setw(12) << refs << std::setw(12)
+                      << mrays << std::setw(10) << hits << '\n';
+        }
+    }
+
+    // Per-subtree choice on final_scene, with the cluster as a bvh_node of its spheres like the
+    // floor. The top level stays a list; only the rays that hit nothing at all differ between
+    // runs, through the stochastic constant media.
+    final_world.objects.back() =
+        make_shared<instance>(make_shared<bvh_node>(cluster), cluster_transform);
+    hittable_list picked_world;
+    std::cout << "\nfinal_scene per-subtree choice:\n";
+    for (size_t i = 0; i < final_world.objects.size(); i++)
+    {
+        std::string choice;
+        picked_world.add(pick_structure(final_world.objects[i], choice));
+        if (choice != "kept")
+            std::cout << "  object " << i << ": " << choice << '\n';
+    }
+
+    auto rays = random_rays(aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000)), 200000);
+    size_t bvh_hits, picked_hits;
+    auto bvh_mrays = trace_mrays(final_world, rays, bvh_hits);
+    auto picked_mrays = trace_mrays(picked_world, rays, picked_hits);
+    std::cout << std::fixed << std::setprecision(2) << "  bvh_node subtrees  " << std::setw(8)
+              << bvh_mrays << " Mrays/s, " << bvh_hits << " hits\n"
+              << "  picked subtrees    " << std::setw(8) << picked_mrays << " Mrays/s, "
+              << picked_hits << " hits\n";
+}
+
+// Pinhole camera rays, width x height of them, from origin through a square window of the
+// given field of view around the direction to target.
+std::vector<ray> frame_rays(const point3 &origin, const point3 &target, double vfov, int width,
+                            int height)
+{
+    auto w = unit_vector(origin - target);
+    auto u = unit_vector(cross(vec3(0, 1, 0), w));
+    auto v = cross(w, u);
+    auto half = std::tan(degrees_to_radians(vfov) / 2);
+
+    std::vector<ray> rays;
+    rays.reserve(static_cast<size_t>(width) * height);
+    for (int j = 0; j < height; j++)
+    {
+        for (int i = 0; i < width; i++)
+        {
+            auto x = (2 * (i + 0.5) / width - 1) * half;
+            auto y = (1 - 2 * (j + 0.5) / height) * half;
+            rays.push_back(ray(origin, x * u + y * v - w));
+        }
+    }
+    return rays;
+}
+
+// A frame's rays traced on all threads; returns milliseconds.
+double trace_frame(const hittable &world, const std::vector<ray> &rays, size_t &hits)
+{
+    size_t count = 0;
+    bench_timer timer;
+    #pragma omp parallel for schedule(dynamic, 1024) reduction(+ : count)
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        hit_record rec;
+        if (world.hit(rays[i], interval(0.001, infinity), rec))
+            count++;
+    }
+    hits = count;
+    return timer.elapsed_ms();
+}
+
+void bench_lazy(int cloud_size)
+{
+    auto world = sphere_cloud_world(cloud_size);
+    auto extent = 10.0 * std::cbrt(static_cast<double>(cloud_size));
+
+    // Two frames from outside the cloud, each looking at a different corner with a narrow
+    // field of view; the spheres in front hide everything behind them.
+    auto eye = point3(-0.5 * extent, 0.5 * extent, -0.5 * extent);
+    std::vector<std::vector<ray>> frames = {
+        frame_rays(eye, point3(0.1 * extent, 0.1 * extent, 0.1 * extent), 12, 400, 400),
+        frame_rays(eye, point3(0.1 * extent, 0.9 * extent, 0.1 * extent), 12, 400, 400),
+    };
+
+    std::cout << "sphere_cloud_" << cloud_size << ", " << frames.size() << " frames of "
+              << frames[0].size() << " rays\n\n"
+              << std::left << std::setw(14) << "structure" << std::right << std::setw(12)
+              << "build ms" << std::setw(12) << "frame 1 ms" << std::setw(10) << "built"
+              << std::setw(12) << "frame 2 ms" << std::setw(10) << "built" << std::setw(10)
+              << "hits" << '\n'
+              << std::fixed << std::setprecision(1);
+
+    {
+        bench_timer timer;
+        auto bvh = build_bvh(world, bvh_build_method::sah);
+        auto build_ms = timer.elapsed_ms();
+
+        std::cout << std::left << std::setw(14) << "sah" << std::right << std::setw(12)
+                  << build_ms;
+        size_t hits = 0;
+        for (const auto &rays : frames)
+            std::cout << std::setw(12) << trace_frame(*bvh, rays, hits) << std::setw(10)
+                      << "100%";
+        std::cout << std::setw(10) << hits << '\n';
+    }
+
+    {
+        bench_timer timer;
+        lazy_bvh bvh(world);
+        auto build_ms = timer.elapsed_ms();
+
+        std::cout << std::left << std::setw(14) << "lazy" << std::right << std::setw(12)
+                  << build_ms;
+        size_t hits = 0;
+        for (const auto &rays : frames)
+        {
+            auto frame_ms = trace_frame(bvh, rays, hits);
+            std::cout << std::setw(12) << frame_ms << std::setw(9) << 100 * bvh.built_fraction()
+                      << '%';
+        }
+        std::cout << std::setw(10) << hits << "\n\n"
+                  << "lazy subtrees built: " << bvh.built_subtrees() << " of "
+                  << bvh.lazy_subtrees() << '\n';
+    }
+}
+
+// A triangle as a heap object of its own, the layout triangle_mesh avoids.
+class single_triangle : public hittable
+{
+public:
+    single_triangle(const point3 &a, const point3 &b, const point3 &c, shared_ptr<material> m)
+        : p0(a), p1(b), p2(c), mat(m), bbox(aabb(aabb(a, b), aabb(c, c)).pad()) {}
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        double weight[3];
+        if (!intersect_triangle(watertight_ray(r), p0, p1, p2, ray_t, rec.t, weight))
+            return false;
+        rec.p = r.at(rec.t);
+        rec.mat = mat.get();
+        rec.set_face_normal(r, unit_vector(cross(p1 - p0, p2 - p0)));
+        rec.u = weight[1];
+        rec.v = weight[2];
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+private:
+    point3 p0, p1, p2;
+    shared_ptr<material> mat;
+    aabb bbox;
+};
+
+void bench_mesh(int triangles)
+{
+    const int rings = 8;
+    const int per_sphere = 4 * rings * (rings - 1);
+    auto spheres = std::max(1, triangles / per_sphere);
+    auto buffers = sphere_mesh_cloud(spheres, rings);
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto count = static_cast<double>(buffers->triangle_count());
+
+    auto region = aabb(point3(0, 0, 0), point3(1, 1, 1) * 10.0 * std::cbrt(spheres));
+    auto rays = random_rays(region, 200000);
+
+    std::cout << spheres << " tessellated spheres, " << buffers->triangle_count()
+              << " triangles, " << buffers->positions.size() << " vertices\n\n"
+              << std::left << std::setw(22) << "layout" << std::right << std::setw(12)
+              << "build ms" << std::setw(14) << "MiB" << std::setw(12) << "bytes/tri"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    {
+        bench_timer timer;
+        triangle_mesh mesh(buffers, white);
+        auto build_ms = timer.elapsed_ms();
+        auto bytes = buffers->memory_bytes() + mesh.memory_bytes();
+        size_t hits;
+        auto mrays = trace_mrays(mesh, rays, hits);
+        std::cout << std::left << std::setw(22) << "triangle_mesh" << std::right
+                  << std::setw(12) << build_ms << std::setw(14) << bytes / 1048576.0
+                  << std::setw(12) << bytes / count << std::setw(12) << mrays << std::setw(10)
+                  << hits << '\n';
+    }
+
+    {
+        bench_timer timer;
+        hittable_list list;
+        const auto &p = buffers->positions;
+        const auto &index = buffers->indices;
+        for (size_t i = 0; i < index.size(); i += 3)
+            list.add(make_shared<single_triangle>(p[index[i]], p[index[i + 1]],
+                                                  p[index[i + 2]], white));
+        linear_bvh bvh(list);
+        auto build_ms = timer.elapsed_ms();
+        // Each object plus its make_shared control block, and the BVH with its object array.
+        auto bytes = list.objects.size() * (sizeof(single_triangle) + 2 * sizeof(long)) +
+                     bvh.memory_bytes();
+        size_t hits;
+        auto mrays = trace_mrays(bvh, rays, hits);
+        std::cout << std::left << std::setw(22) << "hittable per triangle" << std::right
+                  << std::setw(12) << build_ms << std::setw(14) << bytes / 1048576.0
+                  << std::setw(12) << bytes / count << std::setw(12) << mrays << std::setw(10)
+                  << hits << '\n';
+    }
+
+    // Rays from the center of one closed sphere mesh straight through its vertices and edge
+    // midpoints, where a non-watertight test lets rays slip between triangles.
+    auto sphere = make_shared<mesh_buffers>();
+    sphere->positions.assign(buffers->positions.begin(),
+                             buffers->positions.begin() + (rings + 1) * (2 * rings + 1));
+    sphere->indices.assign(buffers->indices.begin(), buffers->indices.begin() + 3 * per_sphere);
+    triangle_mesh closed(sphere, white);
+    auto center = closed.bounding_box().center();
+
+    size_t probes = 0, misses = 0;
+    for (size_t i = 0; i < sphere->indices.size(); i += 3)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            const auto &a = sphere->positions[sphere->indices[i + k]];
+            const auto &b = sphere->positions[sphere->indices[i + (k + 1) % 3]];
+            for (auto target : {a, 0.5 * (a + b)})
+            {
+                hit_record rec;
+                probes++;
+                if (!closed.hit(ray(center, target - center), interval(0.001, infinity), rec))
+                    misses++;
+            }
+        }
+    }
+    std::cout << "\nwatertightness: " << misses << " of " << probes
+              << " rays through vertices and edges of a closed mesh missed\n";
+}
+
+// Reads a whole file with read() into a reused buffer: the bandwidth a loader can reach.
+double read_file_ms(const std::string &path, size_t &bytes)
+{
+    bench_timer timer;
+    bytes = 0;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    std::vector<char> buffer(8 << 20);
+    ssize_t n;
+    while ((n = read(fd, buffer.data(), buffer.size())) > 0)
+        bytes += n;
+    close(fd);
+    return timer.elapsed_ms();
+}
+
+void bench_load(int triangles)
+{
+    const int rings = 8;
+    auto spheres = std::max(1, triangles / (4 * rings * (rings - 1)));
+    auto mesh = sphere_mesh_cloud(spheres, rings);
+
+    const std::string ply_path = "bench_mesh.ply", obj_path = "bench_mesh.obj";
+    if (!save_ply(ply_path, *mesh) || !save_obj(obj_path, *mesh))
+    {
+        std::cerr << "cannot write the benchmark meshes\n";
+        return;
+    }
+
+    std::cout << mesh->triangle_count() << " triangles, " << mesh->positions.size()
+              << " vertices with normals and uvs; files in the page cache\n\n"
+              << std::left << std::setw(8) << "format" << std::setw(12) << "reader"
+              << std::right << std::setw(10) << "MB" << std::setw(12) << "ms"
+              << std::setw(12) << "MB/s" << std::setw(12) << "triangles" << '\n'
+              << std::fixed << std::setprecision(1);
+
+    for (const auto &path : {ply_path, obj_path})
+    {
+        auto format = path.substr(path.size() - 3);
+        for (int run = 0; run < 2; run++)
+        {
+            size_t bytes;
+            auto ms = read_file_ms(path, bytes); // also warms the page cache
+            if (run == 1)
+                std::cout << std::left << std::setw(8) << format << std::setw(12) << "read()"
+                          << std::right << std::setw(10) << bytes / 1e6 << std::setw(12) << ms
+                          << std::setw(12) << bytes / (ms * 1000) << '\n';
+        }
+
+        size_t bytes;
+        read_file_ms(path, bytes);
+        bench_timer timer;
+        auto loaded = format == "ply" ? load_ply(path) : load_obj(path);
+        auto ms = timer.elapsed_ms();
+        if (!loaded)
+            continue;
+        std::cout << std::left << std::setw(8) << format << std::setw(12) << "load_" + format
+                  << std::right << std::setw(10) << bytes / 1e6 << std::setw(12) << ms
+                  << std::setw(12) << bytes / (ms * 1000) << std::setw(12)
+                  << loaded->triangle_count() << '\n';
+
+        // Both files store float precision; anything beyond that is a parsing error.
+        double worst = 0;
+        for (size_t i = 0; i < mesh->positions.size(); i++)
+            worst = std::max(worst, (loaded->positions[i] - mesh->positions[i]).length());
+        if (loaded->indices != mesh->indices || loaded->normals.size() != mesh->normals.size() ||
+            loaded->uvs.size() != mesh->uvs.size() || worst > 1e-4)
+            std::cout << "  mismatch with the saved mesh (position error " << worst << ")\n";
+    }
+
+    std::remove(ply_path.c_str());
+    std::remove(obj_path.c_str());
+}
+
+void bench_box()
+{
+    struct variant
+    {
+        std::string scene;
+        const char *boxes;
+        hittable_list world;
+        aabb ray_region;
+    };
+    auto room = aabb(point3(0, 0, 0), point3(555, 555, 555));
+    auto final_region = aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000));
+    std::vector<variant> variants = {
+        {"cornell_box", "six quads", cornell_box_world(true), room},
+        {"cornell_box", "aligned_box", cornell_box_world(), room},
+        {"final_scene", "six quads", final_scene_world(true), final_region},
+        {"final_scene", "aligned_box", final_scene_world(), final_region},
+    };
+
+    std::cout << std::left << std::setw(14) << "scene" << std::setw(14) << "boxes"
+              << std::right << std::setw(12) << "Mrays/s" << std::setw(14) << "shadow Mrays"
+              << std::setw(10) << "hits" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    for (auto &v : variants)
+    {
+        auto rays = random_rays(v.ray_region, 200000);
+        auto root = build_bvh(v.world, bvh_build_method::sah);
+
+        size_t hits;
+        auto mrays = trace_mrays(*root, rays, hits);
+        bench_timer timer;
+        size_t occluded = 0;
+        for (const auto &r : rays)
+            occluded += root->occluded(r, interval(0.001, infinity));
+        auto shadow_mrays = rays.size() / (timer.elapsed_ms() * 1000.0);
+
+        std::cout << std::left << std::setw(14) << v.scene << std::setw(14) << v.boxes
+                  << std::right << std::setw(12) << mrays << std::setw(14) << shadow_mrays
+                  << std::setw(10) << hits << '\n';
+    }
+}
+
+void bench_spheres(int cloud_size)
+{
+    auto spheres = sphere_cloud_spheres(cloud_size);
+    auto count = static_cast<double>(spheres.size());
+    auto region = aabb(point3(0, 0, 0), point3(1, 1, 1) * 10.0 * std::cbrt(cloud_size));
+    auto rays = random_rays(region, 200000);
+
+#ifdef __AVX__
+    const char *leaf_test = "AVX, 4 lanes";
+#else
+    const char *leaf_test = "scalar";
+#endif
+    std::cout << "sphere_cloud_" << cloud_size << ", " << rays.size()
+              << " rays, sphere_set leaves " << leaf_test << "\n\n"
+              << std::left << std::setw(22) << "layout" << std::right << std::setw(12)
+              << "build ms" << std::setw(12) << "MiB" << std::setw(14) << "bytes/sphere"
+              << std::setw(12) << "Mrays/s" << std::setw(14) << "shadow Mrays" << std::setw(10)
+              << "hits" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    auto report = [&](const char *name, const hittable &world, double build_ms, size_t bytes) {
+        size_t hits;
+        auto mrays = trace_mrays(world, rays, hits);
+        bench_timer timer;
+        size_t occluded = 0;
+        for (const auto &r : rays)
+            occluded += world.occluded(r, interval(0.001, infinity));
+        auto shadow_mrays = rays.size() / (timer.elapsed_ms() * 1000.0);
+        std::cout << std::left << std::setw(22) << name << std::right << std::setw(12)
+                  << build_ms << std::setw(12) << bytes / 1048576.0 << std::setw(14)
+                  << bytes / count << std::setw(12) << mrays << std::setw(14) << shadow_mrays
+                  << std::setw(10) << hits << '\n';
+    };
+
+    {
+        bench_timer timer;
+        sphere_set set(spheres);
+        report("sphere_set", set, timer.elapsed_ms(), set.memory_bytes());
+    }
+
+    {
+        bench_timer timer;
+        hittable_list list;
+        for (const auto &s : spheres)
+            list.add(make_shared<sphere>(s.center, s.radius, s.mat));
+        linear_bvh bvh(list);
+        auto build_ms = timer.elapsed_ms();
+        // Each object plus its make_shared control block, and the BVH with its object array.
+        auto bytes = list.objects.size() * (sizeof(sphere) + 2 * sizeof(long)) +
+                     bvh.memory_bytes();
+        report("hittable per sphere", bvh, build_ms, bytes);
+    }
+}
+
+void bench_threads(int max_threads)
+{
+    // Paths of up to five bounces through cornell_box, scattered by the materials that were
+    // hit, so every hit reads hit_record::mat. Most of the room is the one white material.
+    auto world = build_bvh(cornell_box_world(), bvh_build_method::sah);
+    auto starts = random_rays(aabb(point3(1, 1, 1), point3(554, 554, 554)), 200000);
+    const int max_bounces = 5;
+#ifdef _OPENMP
+    auto cores = omp_get_num_procs();
+#else
+    auto cores = 1;
+    max_threads = 1;
+#endif
+
+    std::cout << "cornell_box, " << starts.size() << " paths, " << cores << " cores\n\n"
+              << std::right << std::setw(8) << "threads" << std::setw(12) << "Mrays/s"
+              << std::setw(12) << "speedup" << std::setw(12) << "rays" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    double single = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        bench_timer timer;
+        long long traced = 0;
+        #pragma omp parallel for num_threads(threads) schedule(dynamic, 1024) reduction(+ : traced)
+        for (long long i = 0; i < static_cast<long long>(starts.size()); i++)
+        {
+            auto r = starts[i];
+            for (int bounce = 0; bounce < max_bounces; bounce++)
+            {
+                hit_record rec;
+                traced++;
+                if (!world->hit(r, interval(0.001, infinity), rec))
+                    break;
+                color attenuation;
+                ray scattered;
+                double pdf;
+                if (!rec.mat->scatter(r, rec, attenuation, scattered, pdf))
+                    break;
+                r = scattered;
+            }
+        }
+        auto mrays = traced / (timer.elapsed_ms() * 1000.0);
+        if (threads == 1)
+            single = mrays;
+        std::cout << std::setw(8) << threads << std::setw(12) << mrays << std::setw(12)
+                  << mrays / single << std::setw(12) << traced << '\n';
+    }
+}
+
+// A T that linear_bvh does not store by type (it matches exact types only), so the leaf loop
+// reaches it through a virtual call, as it would any primitive under the OO API.
+template <class T>
+class virtual_dispatch : public T
+{
+public:
+    explicit virtual_dispatch(const T &primitive) : T(primitive) {}
+};
+
+void bench_dispatch(int cloud_size)
+{
+    auto scenes = standard_scenes(cloud_size);
+    scenes.insert(scenes.begin(), {"cornell_box", cornell_box_world(),
+                                   aabb(point3(0, 0, 0), point3(555, 555, 555))});
+
+    std::cout << std::left << std::setw(22) << "scene" << std::setw(22) << "structure"
+              << std::right << std::setw(12) << "primitives" << std::setw(10) << "typed"
+              << std::setw(12) << "Mrays/s" << std::setw(10) << "hits" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    for (auto &scene : scenes)
+    {
+        auto rays = random_rays(scene.ray_region, 200000);
+        auto frozen = freeze_scene(scene.world);
+        const auto &primitives = frozen->object_array();
+        hittable_list untyped;
+
+        size_t typed = 0;
+        for (const auto &object : primitives)
+        {
+            const auto &type = typeid(*object);
+            if (type == typeid(sphere))
+                untyped.add(make_shared<virtual_dispatch<sphere>>(
+                    static_cast<const sphere &>(*object)));
+            else if (type == typeid(quad))
+                untyped.add(make_shared<virtual_dispatch<quad>>(static_cast<const quad &>(*object)));
+            else if (type == typeid(aligned_box))
+                untyped.add(make_shared<virtual_dispatch<aligned_box>>(
+                    static_cast<const aligned_box &>(*object)));
+            else
+            {
+                untyped.add(object);
+                continue;
+            }
+            typed++;
+        }
+
+        struct variant
+        {
+            const char *name;
+            shared_ptr<hittable> world;
+            size_t primitives, typed;
+        };
+        variant variants[] = {
+            {"as authored, bvh_node", build_bvh(scene.world, bvh_build_method::sah),
+             scene.world.objects.size(), 0},
+            {"frozen, virtual", make_shared<linear_bvh>(untyped), untyped.objects.size(), 0},
+            {"frozen, switch", frozen, primitives.size(), typed},
+        };
+        for (const auto &v : variants)
+        {
+            size_t hits;
+            auto mrays = trace_mrays(*v.world, rays, hits);
+            std::cout << std::left << std::setw(22) << scene.name << std::setw(22) << v.name
+                      << std::right << std::setw(12) << v.primitives << std::setw(10) << v.typed
+                      << std::setw(12) << mrays << std::setw(10) << hits << '\n';
+        }
+    }
+}
+
+void bench_materials()
+{
+    std::vector<bench_scene> scenes = {
+        {"cornell_box", cornell_box_world(), aabb(point3(0, 0, 0), point3(555, 555, 555))},
+        {"random_spheres", random_spheres_world(), aabb(point3(-11, 0, -11), point3(11, 2, 11))},
+        {"final_scene", final_scene_world(),
+         aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000))},
+    };
+    const int passes = 10;
+
+    std::cout << std::left << std::setw(16) << "scene" << std::setw(22) << "shading"
+              << std::right << std::setw(10) << "hits" << std::setw(11) << "materials"
+              << std::setw(14) << "Mshades/s" << std::setw(12) << "mismatches" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    for (auto &scene : scenes)
+    {
+        // The shading inputs: closest hits of random rays, with the material of each.
+        auto world = build_bvh(scene.world, bvh_build_method::sah);
+        std::vector<ray> rays;
+        std::vector<hit_record> hits;
+        for (const auto &r : random_rays(scene.ray_region, 200000))
+        {
+            hit_record rec;
+            if (!world->hit(r, interval(0.001, infinity), rec))
+                continue;
+            rays.push_back(r);
+            hits.push_back(rec);
+        }
+        material_table table;
+        std::vector<uint32_t> ids;
+        for (const auto &rec : hits)
+            ids.push_back(table.add(rec.mat));
+
+        // Hits in order of material, so each run of the switch takes one branch.
+        std::vector<uint32_t> by_material(hits.size());
+        for (size_t i = 0; i < hits.size(); i++)
+            by_material[i] = static_cast<uint32_t>(i);
+        std::stable_sort(by_material.begin(), by_material.end(),
+                         [&ids](uint32_t a, uint32_t b) { return ids[a] < ids[b]; });
+
+        // Emission plus scattering with its pdf, as camera::ray_color needs them.
+        auto shade_virtual = [&](size_t i) {
+            const auto &rec = hits[i];
+            color attenuation;
+            ray scattered;
+            double pdf;
+            auto c = rec.mat->emitted(rays[i], rec, rec.u, rec.v, rec.p);
+            if (rec.mat->scatter(rays[i], rec, attenuation, scattered, pdf))
+                c += attenuation * rec.mat->scattering_pdf(rays[i], rec, scattered);
+            return c;
+        };
+        auto shade_table = [&](size_t i) {
+            const auto &rec = hits[i];
+            color attenuation;
+            ray scattered;
+            double pdf;
+            auto c = table.emitted(ids[i], rays[i], rec);
+            if (table.scatter(ids[i], rays[i], rec, attenuation, scattered, pdf))
+                c += attenuation * table.scattering_pdf(ids[i], rays[i], rec, scattered);
+            return c;
+        };
+
+        // Emission and the pdf of a fixed direction draw no random numbers, so both forms
+        // must agree on them exactly.
+        size_t mismatches = 0;
+        for (size_t i = 0; i < hits.size(); i++)
+        {
+            const auto &rec = hits[i];
+            ray normal_ray(rec.p, rec.normal, rays[i].time());
+            auto e0 = rec.mat->emitted(rays[i], rec, rec.u, rec.v, rec.p);
+            auto e1 = table.emitted(ids[i], rays[i], rec);
+            if ((e0 - e1).length_squared() != 0 ||
+                rec.mat->scattering_pdf(rays[i], rec, normal_ray) !=
+                    table.scattering_pdf(ids[i], rays[i], rec, normal_ray))
+                mismatches++;
+        }
+
+        auto run = [&](const char *name, bool use_table, bool sorted) {
+            bench_timer timer;
+            color sum(0, 0, 0);
+            for (int pass = 0; pass < passes; pass++)
+            {
+                for (size_t k = 0; k < hits.size(); k++)
+                {
+                    auto i = sorted ? by_material[k] : k;
+                    sum += use_table ? shade_table(i) : shade_virtual(i);
+                }
+            }
+            auto mshades = passes * hits.size() / (timer.elapsed_ms() * 1000.0);
+            // Keeps the shading from being optimized away.
+            volatile double sink = sum.x() + sum.y() + sum.z();
+            (void)sink;
+            std::cout << std::left << std::setw(16) << scene.name << std::setw(22) << name
+                      << std::right << std::setw(10) << hits.size() << std::setw(11)
+                      << table.size() << std::setw(14) << mshades << std::setw(12)
+                      << (use_table ? mismatches : 0) << '\n';
+        };
+        run("virtual", false, false);
+        run("table", true, false);
+        run("table, by material", true, true);
+    }
+}
+
+void bench_arena(int count)
+{
+    // count spheres, each with a material and a texture of its own, under a tree of bvh_nodes:
+    // about four scene objects per sphere. Built once with every object from make_shared and once
+    // with every object from a scene_arena; same placements, so the same hits.
+    struct placement
+    {
+        point3 center;
+        double radius;
+        color albedo;
+    };
+    std::vector<placement> placements(count);
+    auto extent = 10.0 * std::cbrt(static_cast<double>(count));
+    for (auto &p : placements)
+        p = {point3::random(0, extent), random_double(0.5, 2.0), color::random()};
+    auto rays = random_rays(aabb(point3(0, 0, 0), point3(extent, extent, extent)), 200000);
+
+    auto build = [&]() -> shared_ptr<hittable> {
+        hittable_list world;
+        for (const auto &p : placements)
+        {
+            auto albedo = make_scene_object<solid_color>(p.albedo);
+            auto mat = make_scene_object<lambertian>(albedo);
+            world.add(make_scene_object<sphere>(p.center, p.radius, mat));
+        }
+        return build_bvh(world, bvh_build_method::sah);
+    };
+
+    std::cout << std::left << std::setw(12) << "allocation" << std::right << std::setw(12)
+              << "build ms" << std::setw(12) << "Mrays/s" << std::setw(10) << "hits"
+              << std::setw(14) << "teardown ms" << '\n'
+              << std::fixed << std::setprecision(2);
+
+    for (int use_arena = 0; use_arena < 2; use_arena++)
+    {
+        std::unique_ptr<scene_arena> arena;
+        shared_ptr<hittable> world;
+        bench_timer build_time;
+        if (use_arena)
+        {
+            arena.reset(new scene_arena);
+            scene_arena::scope scope(*arena);
+            world = build();
+        }
+        else
+            world = build();
+        auto build_ms = build_time.elapsed_ms();
+
+        size_t hits;
+        auto mrays = trace_mrays(*world, rays, hits);
+
+        bench_timer teardown_time;
+        world.reset();
+        arena.reset();
+        auto teardown_ms = teardown_time.elapsed_ms();
+
+        std::cout << std::left << std::setw(12) << (use_arena ? "arena" : "make_shared")
+                  << std::right << std::setw(12) << build_ms << std::setw(12) << mrays
+                  << std::setw(10) << hits << std::setw(14) << teardown_ms << '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    std::string mode = argc > 1 ? argv[1] : "build";
+
+    if (mode == "build")
+        bench_build(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "refit")
+        bench_refit(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "instancing")
+        bench_instancing(argc > 2 ? std::atoi(argv[2]) : 20);
+    else if (mode == "shadow")
+        bench_shadow(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "compressed")
+        bench_compressed(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "cache")
+        bench_cache(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "sbvh")
+        bench_sbvh();
+    else if (mode == "leaves")
+        bench_leaves(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "boxes")
+        bench_boxes(argc > 2 ? std::atoi(argv[2]) : 1024);
+    else if (mode == "motion")
+        bench_motion(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "layout")
+        bench_layout(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else if (mode == "grid")
+        bench_grid(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "lazy")
+        bench_lazy(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else if (mode == "mesh")
+        bench_mesh(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else if (mode == "load")
+        bench_load(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else if (mode == "box")
+        bench_box();
+    else if (mode == "spheres")
+        bench_spheres(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else if (mode == "threads")
+        bench_threads(argc > 2 ? std::atoi(argv[2]) : 32);
+    else if (mode == "dispatch")
+        bench_dispatch(argc > 2 ? std::atoi(argv[2]) : 100000);
+    else if (mode == "materials")
+        bench_materials();
+    else if (mode == "arena")
+        bench_arena(argc > 2 ? std::atoi(argv[2]) : 1000000);
+    else
+    {
+        std::cerr << "Usage: " << argv[0]
+                  << " build|refit|instancing|shadow|compressed|cache|sbvh|leaves|boxes|motion"
+                     "|layout|grid|lazy|mesh|load|box|spheres|threads|dispatch|materials|arena"
+                     " [size]\n";
+        return 1;
+    }
+    return 0;
+}
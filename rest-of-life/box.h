@@ -0,0 +1,177 @@
+#ifndef BOX_H
+#define BOX_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "quad.h"
+#include "scene_arena.h"
+
+#include <utility>
+
+// Axis-aligned box as a single primitive. One slab test gives the entry and exit distances
+// and the faces they lie on; normal and uv then follow from the face index (2 * axis, plus one
+// for the upper face). The uvs match those of the six quads of box_quads(). Rotated or moved
+// boxes go through instance (or rotate_y and translate), which freeze_scene() bakes into
+// boxes or quads. From inside the box the exit face is hit, so it also works as a
+// constant_medium boundary.
+class aligned_box : public hittable
+{
+public:
+    aligned_box(const point3 &a, const point3 &b, shared_ptr<material> m)
+        : bbox(aabb(a, b)), mat(m) {}
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        double t;
+        int face;
+        if (!intersect(r, ray_t, t, face))
+            return false;
+
+        RT_STATS_COUNT(stat_candidates);
+        cand.t = t;
+        cand.object = this;
+        cand.primitive = face;
+        return true;
+    }
+
+    void surface(const ray &r, const hit_candidate &cand, hit_record &rec) const override
+    {
+        RT_STATS_COUNT(stat_surfaces);
+        auto face = static_cast<int>(cand.primitive);
+        rec.t = cand.t;
+        rec.p = r.at(cand.t);
+        rec.mat = mat.get();
+
+        auto axis = face >> 1;
+        vec3 outward_normal(0, 0, 0);
+        outward_normal[axis] = face & 1 ? 1 : -1;
+        rec.set_face_normal(r, outward_normal);
+
+        const auto &layout = face_layout::of(face);
+        rec.u = face_coordinate(rec.p, layout.u_axis, layout.u_flipped);
+        rec.v = face_coordinate(rec.p, layout.v_axis, layout.v_flipped);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double t;
+        int face;
+        return intersect(r, ray_t, t, face);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    shared_ptr<hittable> transformed(const affine_transform &t) const
+    {
+        // This box placed by t: still an aligned_box if t only scales it (by positive
+        // factors, which keep the uvs) and moves it, otherwise its six faces as quads; nullptr
+        // if t mirrors it.
+        vec3 scale;
+        auto min = point3(bbox.x.min, bbox.y.min, bbox.z.min);
+        auto max = point3(bbox.x.max, bbox.y.max, bbox.z.max);
+        if (t.axis_scaling(scale) && scale.x() > 0 && scale.y() > 0 && scale.z() > 0)
+            return make_shared<aligned_box>(t.point(min), t.point(max), mat);
+        if (t.determinant() <= 0)
+            return nullptr;
+
+        auto sides = box_quads(min, max, mat);
+        for (auto &side : sides->objects)
+            side = static_cast<const quad &>(*side).transformed(t);
+        return sides;
+    }
+
+private:
+    aabb bbox;
+    shared_ptr<material> mat;
+
+    // The axes along which u and v run on each face, and whether they run from the upper end.
+    struct face_layout
+    {
+        int u_axis;
+        bool u_flipped;
+        int v_axis;
+        bool v_flipped;
+
+        static const face_layout &of(int face)
+        {
+            static const face_layout layouts[6] = {
+                {2, false, 1, false}, // x min (left)
+                {2, true, 1, false},  // x max (right)
+                {0, false, 2, false}, // y min (bottom)
+                {0, false, 2, true},  // y max (top)
+                {0, true, 1, false},  // z min (back)
+                {0, false, 1, false}, // z max (front)
+            };
+            return layouts[face];
+        }
+    };
+
+    double face_coordinate(const point3 &p, int axis, bool flipped) const
+    {
+        const auto &extent = bbox.axis(axis);
+        auto x = (p[axis] - extent.min) / extent.size();
+        return flipped ? 1 - x : x;
+    }
+
+    bool intersect(const ray &r, interval ray_t, double &t, int &face) const
+    {
+        RT_STATS_COUNT(stat_other_tests);
+        const auto &origin = r.origin();
+        const auto &direction = r.direction();
+
+        double t_enter = -infinity, t_exit = infinity;
+        int enter_face = 0, exit_face = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            auto inv = 1 / direction[a];
+            auto t0 = (bbox.axis(a).min - origin[a]) * inv;
+            auto t1 = (bbox.axis(a).max - origin[a]) * inv;
+            // A ray along -a enters through the upper face.
+            int near_face = 2 * a + (inv < 0);
+            if (inv < 0)
+                std::swap(t0, t1);
+            if (t0 > t_enter)
+            {
+                t_enter = t0;
+                enter_face = near_face;
+            }
+            if (t1 < t_exit)
+            {
+                t_exit = t1;
+                exit_face = near_face ^ 1;
+            }
+        }
+        if (t_enter > t_exit)
+            return false;
+
+        if (ray_t.surrounds(t_enter))
+        {
+            t = t_enter;
+            face = enter_face;
+            return true;
+        }
+        if (ray_t.surrounds(t_exit))
+        {
+            t = t_exit;
+            face = exit_face;
+            return true;
+        }
+        return false;
+    }
+};
+
+inline shared_ptr<aligned_box> box(const point3 &a, const point3 &b, shared_ptr<material> mat)
+{
+    // Returns the 3D box that contains the two opposite vertices a & b.
+    return make_scene_object<aligned_box>(a, b, mat);
+}
+
+#endif
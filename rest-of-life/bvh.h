@@ -5,6 +5,7 @@
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "scene_arena.h"
 #include <algorithm>
 
 class bvh_node : public hittable
@@ -45,31 +46,113 @@ public:
             std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
             auto mid = start + object_span / 2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            left = make_scene_object<bvh_node>(objects, start, mid);
+            right = make_scene_object<bvh_node>(objects, mid, end);
         }
 
         bbox = aabb(left->bounding_box(), right->bounding_box());
+        classify_children();
+    }
+
+    // Inner node over two already built subtrees (or primitives), used by the builders in
+    // bvh_build.h.
+    bvh_node(shared_ptr<hittable> _left, shared_ptr<hittable> _right) : left(_left), right(_right)
+    {
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+        classify_children();
     }
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        if (!bbox.hit(r, ray_t))
-            return false;
+        return resolve_hit(r, ray_t, rec);
+    }
 
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return hit_node(r, precomputed_ray(r), ray_t, cand);
+    }
 
-        return hit_left || hit_right;
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return occluded_node(r, precomputed_ray(r), ray_t);
     }
 
     aabb bounding_box() const override { return bbox; }
 
+    void refit()
+    {
+        // Recomputes the bounds bottom-up over the existing topology, after primitives have
+        // moved. Nested bvh_nodes are refitted as well; any other child (including translate
+        // and rotate_y, which cache their bounds) is asked for its current bounding_box().
+        if (auto node = dynamic_cast<bvh_node *>(left.get()))
+            node->refit();
+        if (right != left)
+        {
+            if (auto node = dynamic_cast<bvh_node *>(right.get()))
+                node->refit();
+        }
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+    }
+
+    const shared_ptr<hittable> &left_child() const { return left; }
+    const shared_ptr<hittable> &right_child() const { return right; }
+
 private:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb bbox;
 
+    // Children that are bvh_nodes themselves are recursed into directly, handing down the
+    // ray constants computed once at the root.
+    bool left_is_node = false;
+    bool right_is_node = false;
+
+    void classify_children()
+    {
+        left_is_node = dynamic_cast<const bvh_node *>(left.get()) != nullptr;
+        right_is_node = dynamic_cast<const bvh_node *>(right.get()) != nullptr;
+    }
+
+    bool hit_node(const ray &r, const precomputed_ray &pr, interval ray_t,
+                  hit_candidate &cand) const
+    {
+        RT_STATS_COUNT(stat_nodes);
+        if (!bbox.hit(pr, ray_t))
+            return false;
+
+        bool hit_left = hit_child(left, left_is_node, r, pr, ray_t, cand);
+        bool hit_right = hit_child(right, right_is_node, r, pr,
+                                   interval(ray_t.min, hit_left ? cand.t : ray_t.max), cand);
+
+        return hit_left || hit_right;
+    }
+
+    bool occluded_node(const ray &r, const precomputed_ray &pr, interval ray_t) const
+    {
+        RT_STATS_COUNT(stat_nodes);
+        if (!bbox.hit(pr, ray_t))
+            return false;
+
+        return occluded_child(left, left_is_node, r, pr, ray_t) ||
+               (right != left && occluded_child(right, right_is_node, r, pr, ray_t));
+    }
+
+    static bool hit_child(const shared_ptr<hittable> &child, bool is_node, const ray &r,
+                          const precomputed_ray &pr, interval ray_t, hit_candidate &cand)
+    {
+        if (is_node)
+            return static_cast<const bvh_node *>(child.get())->hit_node(r, pr, ray_t, cand);
+        return child->intersect(r, ray_t, cand);
+    }
+
+    static bool occluded_child(const shared_ptr<hittable> &child, bool is_node, const ray &r,
+                               const precomputed_ray &pr, interval ray_t)
+    {
+        if (is_node)
+            return static_cast<const bvh_node *>(child.get())->occluded_node(r, pr, ray_t);
+        return child->occluded(r, ray_t);
+    }
+
     static bool box_compare(
         const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index)
     {
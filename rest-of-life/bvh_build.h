@@ -0,0 +1,571 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "hittable_list.h"
+#include "scene_arena.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Parallel BVH builders. They produce an ordinary bvh_node tree, so the result can be used
+// anywhere bvh_node(list) is used today.
+//
+//   sah  - binned surface area heuristic. Subtrees above task_threshold primitives are built
+//          as OpenMP tasks, and the binning passes of the large top-level splits are split
+//          into tasks as well, so the first splits do not serialize the build.
+//   lbvh - Morton codes of the primitive centroids, a parallel radix sort, then each range is
+//          split at the highest bit in which its codes differ. Fastest to rebuild, but the
+//          tree is noticeably worse than sah for uneven scenes.
+//
+// Without -fopenmp the pragmas are ignored and both builders run serially.
+
+enum class bvh_build_method
+{
+    median, // the original bvh_node(list): random axis, split at the median
+    sah,
+    lbvh
+};
+
+struct bvh_build_primitive
+{
+    aabb box;
+    point3 centroid;
+    shared_ptr<hittable> object;
+};
+
+inline std::vector<bvh_build_primitive> make_build_primitives(
+    const std::vector<shared_ptr<hittable>> &objects)
+{
+    std::vector<bvh_build_primitive> prims(objects.size());
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < static_cast<long>(objects.size()); i++)
+    {
+        prims[i].box = objects[i]->bounding_box();
+        prims[i].centroid = prims[i].box.center();
+        prims[i].object = objects[i];
+    }
+    return prims;
+}
+
+// The tree of an empty list: one node with an empty hittable_list on both sides, which nothing
+// hits.
+inline shared_ptr<bvh_node> make_empty_bvh_node()
+{
+    auto nothing = make_scene_object<hittable_list>();
+    return make_scene_object<bvh_node>(nothing, nothing);
+}
+
+// Runs f(chunk, begin, end) over [start, end) in chunk_size pieces, one task per piece.
+template <typename F>
+void bvh_for_each_chunk(size_t start, size_t end, size_t chunk_size, F &f)
+{
+    size_t chunks = (end - start + chunk_size - 1) / chunk_size;
+    for (size_t c = 0; c < chunks; c++)
+    {
+        size_t b = start + c * chunk_size;
+        size_t e = std::min(end, b + chunk_size);
+        #pragma omp task firstprivate(c, b, e) shared(f) if (chunks > 1)
+        f(c, b, e);
+    }
+    #pragma omp taskwait
+}
+
+class sah_bvh_builder
+{
+public:
+    static const int bin_count = 16;
+    static const size_t task_threshold = 4096;         // smaller subtrees are built inline
+    static const size_t parallel_bin_threshold = 65536; // larger ranges bin in parallel chunks
+
+    shared_ptr<bvh_node> build(const std::vector<shared_ptr<hittable>> &objects)
+    {
+        if (objects.empty())
+            return make_empty_bvh_node();
+        prims = make_build_primitives(objects);
+
+        shared_ptr<hittable> root;
+        #pragma omp parallel
+        #pragma omp single
+        root = build_range(0, prims.size());
+
+        prims.clear();
+        auto node = std::dynamic_pointer_cast<bvh_node>(root);
+        return node ? node : make_scene_object<bvh_node>(root, root);
+    }
+
+private:
+    struct bin
+    {
+        aabb box;
+        size_t count = 0;
+    };
+
+    struct bin_set
+    {
+        bin bins[3][bin_count];
+    };
+
+    std::vector<bvh_build_primitive> prims;
+
+    aabb centroid_bounds(size_t start, size_t end) const
+    {
+        aabb bounds;
+        if (end - start < parallel_bin_threshold)
+        {
+            for (size_t i = start; i < end; i++)
+                bounds = aabb(bounds, aabb(prims[i].centroid, prims[i].centroid));
+            return bounds;
+        }
+
+        std::vector<aabb> partial((end - start + parallel_bin_threshold / 4 - 1) /
+                                  (parallel_bin_threshold / 4));
+        auto f = [&](size_t c, size_t b, size_t e) {
+            for (size_t i = b; i < e; i++)
+                partial[c] = aabb(partial[c], aabb(prims[i].centroid, prims[i].centroid));
+        };
+        bvh_for_each_chunk(start, end, parallel_bin_threshold / 4, f);
+
+        for (const auto &p : partial)
+            bounds = aabb(bounds, p);
+        return bounds;
+    }
+
+    int bin_index(const point3 &c, const aabb &cb, int axis) const
+    {
+        auto extent = cb.axis(axis).size();
+        int b = static_cast<int>(bin_count * (c[axis] - cb.axis(axis).min) / extent);
+        return std::min(std::max(b, 0), bin_count - 1);
+    }
+
+    void fill_bins(size_t start, size_t end, const aabb &cb, bin_set &set) const
+    {
+        for (size_t i = start; i < end; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (cb.axis(axis).size() <= 0)
+                    continue;
+                auto &b = set.bins[axis][bin_index(prims[i].centroid, cb, axis)];
+                b.box = aabb(b.box, prims[i].box);
+                b.count++;
+            }
+        }
+    }
+
+    bin_set binned(size_t start, size_t end, const aabb &cb) const
+    {
+        bin_set set;
+        if (end - start < parallel_bin_threshold)
+        {
+            fill_bins(start, end, cb, set);
+            return set;
+        }
+
+        std::vector<bin_set> partial((end - start + parallel_bin_threshold / 4 - 1) /
+                                     (parallel_bin_threshold / 4));
+        auto f = [&](size_t c, size_t b, size_t e) { fill_bins(b, e, cb, partial[c]); };
+        bvh_for_each_chunk(start, end, parallel_bin_threshold / 4, f);
+
+        for (const auto &p : partial)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int i = 0; i < bin_count; i++)
+                {
+                    set.bins[axis][i].box = aabb(set.bins[axis][i].box, p.bins[axis][i].box);
+                    set.bins[axis][i].count += p.bins[axis][i].count;
+                }
+            }
+        }
+        return set;
+    }
+
+    size_t split(size_t start, size_t end)
+    {
+        auto cb = centroid_bounds(start, end);
+        auto set = binned(start, end, cb);
+
+        // Sweep the bins of every axis and keep the cheapest boundary.
+        int best_axis = -1, best_bin = 0;
+        double best_cost = infinity;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (cb.axis(axis).size() <= 0)
+                continue;
+
+            double right_area[bin_count];
+            size_t right_count[bin_count];
+            aabb acc;
+            size_t count = 0;
+            for (int i = bin_count - 1; i > 0; i--)
+            {
+                acc = aabb(acc, set.bins[axis][i].box);
+                count += set.bins[axis][i].count;
+                right_area[i] = acc.surface_area();
+                right_count[i] = count;
+            }
+
+            acc = aabb();
+            count = 0;
+            for (int i = 1; i < bin_count; i++)
+            {
+                acc = aabb(acc, set.bins[axis][i - 1].box);
+                count += set.bins[axis][i - 1].count;
+                if (count == 0 || right_count[i] == 0)
+                    continue;
+                auto cost = count * acc.surface_area() + right_count[i] * right_area[i];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        size_t mid = start + (end - start) / 2;
+        if (best_axis < 0)
+        {
+            // All centroids coincide (or binning could not separate them): split by count.
+            int axis = cb.x.size() >= cb.y.size() ? (cb.x.size() >= cb.z.size() ? 0 : 2)
+                                                  : (cb.y.size() >= cb.z.size() ? 1 : 2);
+            std::nth_element(prims.begin() + start, prims.begin() + mid, prims.begin() + end,
+                             [axis](const bvh_build_primitive &a, const bvh_build_primitive &b) {
+                                 return a.centroid[axis] < b.centroid[axis];
+                             });
+            return mid;
+        }
+
+        auto it = std::partition(prims.begin() + start, prims.begin() + end,
+                                 [&](const bvh_build_primitive &p) {
+                                     return bin_index(p.centroid, cb, best_axis) < best_bin;
+                                 });
+        return static_cast<size_t>(it - prims.begin());
+    }
+
+    shared_ptr<hittable> build_range(size_t start, size_t end)
+    {
+        size_t count = end - start;
+        if (count == 1)
+            return prims[start].object;
+        if (count == 2)
+            return make_scene_object<bvh_node>(prims[start].object, prims[start + 1].object);
+
+        size_t mid = split(start, end);
+
+        shared_ptr<hittable> left, right;
+        if (count > task_threshold)
+        {
+            #pragma omp task shared(left)
+            left = build_range(start, mid);
+            right = build_range(mid, end);
+            #pragma omp taskwait
+        }
+        else
+        {
+            left = build_range(start, mid);
+            right = build_range(mid, end);
+        }
+        return make_scene_object<bvh_node>(left, right);
+    }
+};
+
+class lbvh_builder
+{
+public:
+    static const size_t task_threshold = 4096;
+
+    shared_ptr<bvh_node> build(const std::vector<shared_ptr<hittable>> &objects)
+    {
+        if (objects.empty())
+            return make_empty_bvh_node();
+        auto n = static_cast<long>(objects.size());
+        prims = make_build_primitives(objects);
+
+        double lo[3] = {infinity, infinity, infinity};
+        double hi[3] = {-infinity, -infinity, -infinity};
+        double lo0 = lo[0], lo1 = lo[1], lo2 = lo[2], hi0 = hi[0], hi1 = hi[1], hi2 = hi[2];
+        #pragma omp parallel for reduction(min : lo0, lo1, lo2) reduction(max : hi0, hi1, hi2)
+        for (long i = 0; i < n; i++)
+        {
+            const auto &c = prims[i].centroid;
+            lo0 = fmin(lo0, c[0]), lo1 = fmin(lo1, c[1]), lo2 = fmin(lo2, c[2]);
+            hi0 = fmax(hi0, c[0]), hi1 = fmax(hi1, c[1]), hi2 = fmax(hi2, c[2]);
+        }
+        lo[0] = lo0, lo[1] = lo1, lo[2] = lo2;
+        hi[0] = hi0, hi[1] = hi1, hi[2] = hi2;
+
+        codes.resize(n);
+        order.resize(n);
+        #pragma omp parallel for schedule(static)
+        for (long i = 0; i < n; i++)
+        {
+            uint32_t q[3];
+            for (int a = 0; a < 3; a++)
+            {
+                auto extent = hi[a] - lo[a];
+                auto t = extent > 0 ? (prims[i].centroid[a] - lo[a]) / extent : 0.5;
+                q[a] = static_cast<uint32_t>(std::min(std::max(t * 1024.0, 0.0), 1023.0));
+            }
+            codes[i] = (expand_bits(q[0]) << 2) | (expand_bits(q[1]) << 1) | expand_bits(q[2]);
+            order[i] = static_cast<uint32_t>(i);
+        }
+
+        radix_sort(codes, order);
+
+        shared_ptr<hittable> root;
+        #pragma omp parallel
+        #pragma omp single
+        root = emit(0, prims.size());
+
+        prims.clear();
+        codes.clear();
+        order.clear();
+        auto node = std::dynamic_pointer_cast<bvh_node>(root);
+        return node ? node : make_scene_object<bvh_node>(root, root);
+    }
+
+    static uint32_t expand_bits(uint32_t v)
+    {
+        // Spreads the low 10 bits of v so that there are two zero bits between each of them.
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    static void radix_sort(std::vector<uint32_t> &keys, std::vector<uint32_t> &values)
+    {
+        // LSD radix sort on 8-bit digits. Each pass histograms fixed blocks in parallel, takes
+        // a prefix sum ordered by (digit, block) and scatters the blocks in parallel, which
+        // keeps every pass stable.
+        auto n = keys.size();
+        std::vector<uint32_t> keys_tmp(n), values_tmp(n);
+
+        int blocks = 1;
+#ifdef _OPENMP
+        blocks = omp_get_max_threads();
+#endif
+        size_t block_size = (n + blocks - 1) / blocks;
+        std::vector<size_t> offsets(blocks * 256);
+
+        for (int shift = 0; shift < 32; shift += 8)
+        {
+            std::fill(offsets.begin(), offsets.end(), 0);
+
+            #pragma omp parallel for schedule(static)
+            for (int b = 0; b < blocks; b++)
+            {
+                size_t end = std::min(n, (b + 1) * block_size);
+                for (size_t i = b * block_size; i < end; i++)
+                    offsets[b * 256 + ((keys[i] >> shift) & 0xFF)]++;
+            }
+
+            size_t sum = 0;
+            for (int d = 0; d < 256; d++)
+            {
+                for (int b = 0; b < blocks; b++)
+                {
+                    auto count = offsets[b * 256 + d];
+                    offsets[b * 256 + d] = sum;
+                    sum += count;
+                }
+            }
+
+            #pragma omp parallel for schedule(static)
+            for (int b = 0; b < blocks; b++)
+            {
+                size_t end = std::min(n, (b + 1) * block_size);
+                for (size_t i = b * block_size; i < end; i++)
+                {
+                    auto dst = offsets[b * 256 + ((keys[i] >> shift) & 0xFF)]++;
+                    keys_tmp[dst] = keys[i];
+                    values_tmp[dst] = values[i];
+                }
+            }
+
+            keys.swap(keys_tmp);
+            values.swap(values_tmp);
+        }
+    }
+
+private:
+    std::vector<bvh_build_primitive> prims;
+    std::vector<uint32_t> codes;
+    std::vector<uint32_t> order;
+
+    size_t find_split(size_t first, size_t last) const
+    {
+        // Returns the last index of the left half of the sorted range [first, last].
+        auto first_code = codes[first];
+        auto last_code = codes[last];
+        if (first_code == last_code)
+            return (first + last) / 2;
+
+        int common_prefix = __builtin_clz(first_code ^ last_code);
+
+        // Binary search for the highest object that shares more than common_prefix bits
+        // with the first one.
+        size_t split = first;
+        size_t step = last - first;
+        do
+        {
+            step = (step + 1) >> 1;
+            size_t new_split = split + step;
+            if (new_split < last)
+            {
+                if (__builtin_clz(first_code ^ codes[new_split]) > common_prefix)
+                    split = new_split;
+            }
+        } while (step > 1);
+
+        return split;
+    }
+
+    shared_ptr<hittable> emit(size_t start, size_t end)
+    {
+        size_t count = end - start;
+        if (count == 1)
+            return prims[order[start]].object;
+        if (count == 2)
+            return make_scene_object<bvh_node>(prims[order[start]].object,
+                                               prims[order[start + 1]].object);
+
+        size_t mid = find_split(start, end - 1) + 1;
+
+        shared_ptr<hittable> left, right;
+        if (count > task_threshold)
+        {
+            #pragma omp task shared(left)
+            left = emit(start, mid);
+            right = emit(mid, end);
+            #pragma omp taskwait
+        }
+        else
+        {
+            left = emit(start, mid);
+            right = emit(mid, end);
+        }
+        return make_scene_object<bvh_node>(left, right);
+    }
+};
+
+inline shared_ptr<bvh_node> build_bvh(const hittable_list &list, bvh_build_method method)
+{
+    switch (method)
+    {
+    case bvh_build_method::sah:
+        return sah_bvh_builder().build(list.objects);
+    case bvh_build_method::lbvh:
+        return lbvh_builder().build(list.objects);
+    default:
+        if (list.objects.empty())
+            return make_empty_bvh_node();
+        return make_scene_object<bvh_node>(list);
+    }
+}
+
+inline const char *bvh_build_method_name(bvh_build_method method)
+{
+    switch (method)
+    {
+    case bvh_build_method::sah:
+        return "sah";
+    case bvh_build_method::lbvh:
+        return "lbvh";
+    default:
+        return "median";
+    }
+}
+
+// SAH cost of a built tree, relative to its root box: every bvh_node visit costs one box test
+// plus one intersection per primitive child, weighted by the probability that a random ray
+// through the root also hits the node. Nested bvh_nodes are treated as part of the tree.
+inline double bvh_sah_cost(const hittable &root, double traversal_cost = 1.0,
+                           double intersection_cost = 1.0)
+{
+    auto root_area = root.bounding_box().surface_area();
+    if (root_area <= 0)
+        return 0;
+
+    double cost = 0;
+    std::vector<const bvh_node *> stack;
+    if (auto node = dynamic_cast<const bvh_node *>(&root))
+        stack.push_back(node);
+
+    while (!stack.empty())
+    {
+        auto node = stack.back();
+        stack.pop_back();
+
+        auto probability = node->bounding_box().surface_area() / root_area;
+        cost += probability * traversal_cost;
+        for (auto child : {node->left_child().get(), node->right_child().get()})
+        {
+            if (auto inner = dynamic_cast<const bvh_node *>(child))
+                stack.push_back(inner);
+            else
+                cost += probability * intersection_cost;
+        }
+    }
+    return cost;
+}
+
+// BVH over geometry that moves between frames. update() refits the existing tree and only
+// rebuilds it when the refitted SAH cost has grown past rebuild_threshold times the cost
+// measured right after the last build.
+class dynamic_bvh
+{
+public:
+    dynamic_bvh(const hittable_list &list, bvh_build_method _method = bvh_build_method::sah,
+                double _rebuild_threshold = 1.5)
+        : objects(list), method(_method), rebuild_threshold(_rebuild_threshold)
+    {
+        rebuild();
+    }
+
+    // Call after primitives have moved. Returns true if the tree was rebuilt.
+    bool update()
+    {
+        root->refit();
+        current_cost = bvh_sah_cost(*root);
+        if (current_cost <= rebuild_threshold * built_cost)
+            return false;
+
+        rebuild();
+        return true;
+    }
+
+    void rebuild()
+    {
+        root = build_bvh(objects, method);
+        built_cost = current_cost = bvh_sah_cost(*root);
+        rebuilds++;
+    }
+
+    const bvh_node &tree() const { return *root; }
+    double cost() const { return current_cost; }
+    int rebuild_count() const { return rebuilds; }
+
+private:
+    hittable_list objects;
+    bvh_build_method method;
+    double rebuild_threshold;
+
+    shared_ptr<bvh_node> root;
+    double built_cost = 0;
+    double current_cost = 0;
+    int rebuilds = 0;
+};
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef BVH_CACHE_H
+#define BVH_CACHE_H
+
+#include "rtweekend.h"
+
+#include "bvh_build.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <typeinfo>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Persistent cache of flattened BVHs. A file holds a fixed header followed by the
+// linear_bvh_node array and the primitive index array, exactly as they sit in memory, so a
+// warm load is an mmap plus a header check: the mapped arrays are traversed in place.
+//
+// Files are keyed by a hash of what the tree depends on: the builder and, for every object
+// of the list in order, its dynamic type and bounding box. Any scene edit that could change
+// the tree changes the key, and the stale file is simply never looked up again. A file that
+// fails its checks (truncated, corrupted, or written for a different list) is rebuilt over.
+
+struct bvh_cache_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t node_size; // sizeof(linear_bvh_node) when written, guards against layout changes
+    uint64_t content_hash;
+    uint64_t node_count;
+    uint64_t index_count;
+    uint64_t nodes_offset;
+    uint64_t indices_offset;
+};
+
+inline uint64_t fnv1a_hash(uint64_t hash, const void *data, size_t size)
+{
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+inline uint64_t scene_content_hash(const hittable_list &list, bvh_build_method method)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto m = static_cast<int>(method);
+    uint64_t count = list.objects.size();
+    hash = fnv1a_hash(hash, &m, sizeof(m));
+    hash = fnv1a_hash(hash, &count, sizeof(count));
+
+    for (const auto &object : list.objects)
+    {
+        auto name = typeid(*object).name();
+        hash = fnv1a_hash(hash, name, std::strlen(name));
+
+        auto box = object->bounding_box();
+        double bounds[6] = {box.x.min, box.x.max, box.y.min, box.y.max, box.z.min, box.z.max};
+        hash = fnv1a_hash(hash, bounds, sizeof(bounds));
+    }
+    return hash;
+}
+
+class bvh_cache
+{
+public:
+    // 2: linear_bvh_node::flags, treelet node order.
+    static const uint32_t version = 2;
+
+    explicit bvh_cache(const std::string &_directory = "bvh_cache") : directory(_directory) {}
+
+    // Returns the cached tree for list if there is one, otherwise builds it with method and
+    // writes it to the cache. The result refers to list.objects by index.
+    shared_ptr<linear_bvh> load_or_build(const hittable_list &list,
+                                         bvh_build_method method = bvh_build_method::sah)
+    {
+        auto hash = scene_content_hash(list, method);
+        auto path = file_path(hash);
+
+        if (auto cached = load(path, list, hash))
+        {
+            last_hit = true;
+            return cached;
+        }
+
+        last_hit = false;
+        auto bvh = make_shared<linear_bvh>(list, method);
+        store(path, *bvh, hash);
+        return bvh;
+    }
+
+    bool last_was_hit() const { return last_hit; }
+
+    std::string path_for(const hittable_list &list, bvh_build_method method) const
+    {
+        return file_path(scene_content_hash(list, method));
+    }
+
+private:
+    std::string directory;
+    bool last_hit = false;
+
+    std::string file_path(uint64_t hash) const
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.bvh", static_cast<unsigned long long>(hash));
+        return directory + "/" + name;
+    }
+
+    static shared_ptr<linear_bvh> load(const std::string &path, const hittable_list &list,
+                                       uint64_t hash)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(bvh_cache_header)))
+        {
+            close(fd);
+            return nullptr;
+        }
+
+        auto size = static_cast<size_t>(st.st_size);
+        void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED)
+            return nullptr;
+
+        // The mapping stays alive for as long as a linear_bvh uses it.
+        shared_ptr<const void> mapping(base, [size](const void *p) {
+            munmap(const_cast<void *>(p), size);
+        });
+
+        auto header = static_cast<const bvh_cache_header *>(base);
+        if (std::memcmp(header->magic, "RTWBVH\0\0", 8) != 0 || header->version != version ||
+            header->node_size != sizeof(linear_bvh_node) || header->content_hash != hash ||
+            header->node_count == 0 ||
+            !array_fits(header->nodes_offset, header->node_count, sizeof(linear_bvh_node),
+                        alignof(linear_bvh_node), size) ||
+            !array_fits(header->indices_offset, header->index_count, sizeof(uint32_t),
+                        alignof(uint32_t), size))
+            return nullptr;
+
+        auto bytes = static_cast<const char *>(base);
+        auto nodes = reinterpret_cast<const linear_bvh_node *>(bytes + header->nodes_offset);
+        auto indices = reinterpret_cast<const uint32_t *>(bytes + header->indices_offset);
+        if (!valid_tree(nodes, header->node_count, indices, header->index_count,
+                        list.objects.size()))
+            return nullptr;
+        return make_shared<linear_bvh>(list, nodes, header->node_count, indices,
+                                       header->index_count, mapping);
+    }
+
+    // Whether count elements of element_size bytes at offset lie inside a file of size bytes,
+    // aligned for their type. Written so that no product or sum can overflow.
+    static bool array_fits(uint64_t offset, uint64_t count, size_t element_size,
+                           size_t alignment, size_t size)
+    {
+        return offset <= size && offset % alignment == 0 &&
+               count <= (size - offset) / element_size;
+    }
+
+    // Checks the mapped arrays before anything reads through them: one index per object of
+    // the list, each naming one of them; leaf ranges inside the index array; both children of
+    // an inner node after it and inside the node array, so the walk cannot loop; and no path
+    // deeper than the traversal stack of linear_bvh::max_depth entries.
+    static bool valid_tree(const linear_bvh_node *nodes, size_t node_count,
+                           const uint32_t *indices, size_t index_count, size_t object_count)
+    {
+        if (index_count != object_count)
+            return false;
+        for (size_t i = 0; i < index_count; i++)
+        {
+            if (indices[i] >= object_count)
+                return false;
+        }
+
+        // Depth of each node, set by its parent; 0 means no parent has reached it.
+        std::vector<int> depth(node_count, 0);
+        depth[0] = 1;
+        for (size_t i = 0; i < node_count; i++)
+        {
+            const auto &node = nodes[i];
+            if (depth[i] == 0 || depth[i] > linear_bvh::max_depth)
+                return false;
+            if (node.count > 0)
+            {
+                if (node.offset > index_count || node.count > index_count - node.offset)
+                    return false;
+            }
+            else
+            {
+                if (i + 1 >= node_count || node.offset <= i + 1 || node.offset >= node_count)
+                    return false;
+                depth[i + 1] = depth[node.offset] = depth[i] + 1;
+            }
+        }
+        return true;
+    }
+
+    void store(const std::string &path, const linear_bvh &bvh, uint64_t hash) const
+    {
+        mkdir(directory.c_str(), 0755); // fails harmlessly if it already exists
+
+        bvh_cache_header header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, "RTWBVH\0\0", 8);
+        header.version = version;
+        header.node_size = sizeof(linear_bvh_node);
+        header.content_hash = hash;
+        header.node_count = bvh.node_count();
+        header.index_count = bvh.primitive_count();
+        header.nodes_offset = 64; // keeps the node array cache-line aligned in the mapping
+        header.indices_offset = header.nodes_offset + header.node_count * sizeof(linear_bvh_node);
+
+        // Write to a temporary name and rename, so a reader never maps a partial file.
+        auto temp = path + ".tmp";
+        FILE *file = std::fopen(temp.c_str(), "wb");
+        if (file == NULL)
+            return;
+
+        char padding[64] = {};
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  std::fwrite(padding, header.nodes_offset - sizeof(header), 1, file) == 1 &&
+                  std::fwrite(bvh.node_data(), sizeof(linear_bvh_node), header.node_count,
+                              file) == header.node_count &&
+                  std::fwrite(bvh.primitive_indices(), sizeof(uint32_t), header.index_count,
+                              file) == header.index_count;
+        ok = std::fclose(file) == 0 && ok;
+
+        if (ok)
+            std::rename(temp.c_str(), path.c_str());
+        else
+            std::remove(temp.c_str());
+    }
+};
+
+#endif
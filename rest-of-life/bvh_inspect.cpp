@@ -0,0 +1,388 @@
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_build.h"
+#include "frozen_scene.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "sbvh.h"
+#include "scenes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+// BVH quality inspector. Usage:
+//
+//   ./bvh_inspect <scene> [rays]
+//
+// where scene is one of the scenes of main.cpp (random_spheres, two_spheres, earth,
+// two_perlin_spheres, quads, simple_light, cornell_box, cornell_smoke, final_scene) or
+// sphere_cloud. Every builder builds a tree over the scene's top-level objects, which stay
+// primitives even if they contain BVHs of their own, flattened to a linear_bvh. The tree is
+// measured on that layout:
+//
+//   SAH cost       sum of P(inner) * 1 + P(leaf) * primitives, P = area relative to the root
+//   depth, leaves  histogram of leaf depths and of primitives per leaf
+//   overlap        volume shared by sibling boxes, relative to their parent's volume
+//   memory         flattened nodes and primitive indices; the bvh_node form of the same
+//                  tree takes more (see `benchmark compressed`)
+//   per ray        nodes and primitives visited by closest-hit traversal of a fixed ray set,
+//                  and the distinct 64-byte lines and 4 KiB pages of the node array it touches
+//
+// The median builder is quadratic and is skipped above 20000 objects. The last column is the
+// tree of freeze_scene(), over the scene's primitives instead of its top-level objects; the
+// graph it replaces and what became of it are printed first.
+
+struct inspect_scene
+{
+    const char *name;
+    hittable_list (*world)();
+    aabb ray_region;
+};
+
+hittable_list sphere_cloud_10000() { return sphere_cloud_world(10000); }
+
+const inspect_scene inspect_scenes[] = {
+    {"random_spheres", random_spheres_world, aabb(point3(-11, 0, -11), point3(11, 2, 11))},
+    {"two_spheres", two_spheres_world, aabb(point3(-10, -10, -10), point3(10, 10, 10))},
+    {"earth", earth_world, aabb(point3(-4, -4, -4), point3(4, 4, 4))},
+    {"two_perlin_spheres", two_perlin_spheres_world,
+     aabb(point3(-10, 0, -10), point3(10, 4, 10))},
+    {"quads", quads_world, aabb(point3(-3, -3, -3), point3(3, 3, 5))},
+    {"simple_light", simple_light_world, aabb(point3(-10, 0, -10), point3(10, 9, 10))},
+    {"cornell_box", cornell_box_world, aabb(point3(0, 0, 0), point3(555, 555, 555))},
+    {"cornell_smoke", cornell_smoke_world, aabb(point3(0, 0, 0), point3(555, 555, 555))},
+    {"final_scene", final_scene_world, aabb(point3(-1000, 0, -1000), point3(1000, 555, 1000))},
+    {"sphere_cloud", sphere_cloud_10000, aabb(point3(0, 0, 0), point3(215, 215, 215))},
+};
+
+struct tree_stats
+{
+    std::string builder;
+    double build_ms = 0;
+    double sah_cost = 0;
+    size_t inner_nodes = 0;
+    size_t leaves = 0;
+    size_t references = 0;
+    size_t memory = 0;
+    double overlap = 0; // mean over inner nodes
+    double nodes_per_ray = 0;
+    double prims_per_ray = 0;
+    double lines_per_ray = 0;
+    double pages_per_ray = 0;
+    std::map<int, size_t> leaf_depths;
+    std::map<int, size_t> leaf_sizes;
+};
+
+double box_volume(const linear_bvh_node &n)
+{
+    double v = 1;
+    for (int a = 0; a < 3; a++)
+        v *= fmax(0.0, static_cast<double>(n.bounds_max[a]) - n.bounds_min[a]);
+    return v;
+}
+
+double box_area(const linear_bvh_node &n)
+{
+    double e[3];
+    for (int a = 0; a < 3; a++)
+        e[a] = fmax(0.0, static_cast<double>(n.bounds_max[a]) - n.bounds_min[a]);
+    return 2 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+}
+
+double overlap_volume(const linear_bvh_node &a, const linear_bvh_node &b)
+{
+    double v = 1;
+    for (int i = 0; i < 3; i++)
+        v *= fmax(0.0, static_cast<double>(fmin(a.bounds_max[i], b.bounds_max[i])) -
+                           fmax(a.bounds_min[i], b.bounds_min[i]));
+    return v;
+}
+
+void measure_structure(const linear_bvh &bvh, tree_stats &stats)
+{
+    auto nodes = bvh.node_data();
+    auto root_area = box_area(nodes[0]);
+    double overlap_sum = 0;
+
+    std::vector<std::pair<uint32_t, int>> stack = {{0, 0}};
+    while (!stack.empty())
+    {
+        auto index = stack.back().first;
+        auto depth = stack.back().second;
+        stack.pop_back();
+
+        const auto &node = nodes[index];
+        auto probability = root_area > 0 ? box_area(node) / root_area : 1;
+        if (node.count > 0)
+        {
+            stats.leaves++;
+            stats.leaf_depths[depth]++;
+            stats.leaf_sizes[node.count]++;
+            stats.sah_cost += probability * node.count;
+            continue;
+        }
+
+        stats.inner_nodes++;
+        stats.sah_cost += probability;
+        auto volume = box_volume(node);
+        if (volume > 0)
+            overlap_sum += overlap_volume(nodes[index + 1], nodes[node.offset]) / volume;
+
+        stack.push_back({index + 1, depth + 1});
+        stack.push_back({node.offset, depth + 1});
+    }
+
+    stats.overlap = stats.inner_nodes > 0 ? overlap_sum / stats.inner_nodes : 0;
+    stats.references = bvh.primitive_count();
+    stats.memory = bvh.node_count() * sizeof(linear_bvh_node) +
+                   bvh.primitive_count() * sizeof(uint32_t);
+}
+
+// Closest-hit traversal in the same order as linear_bvh::hit, counting the work instead of
+// timing it.
+void count_traversal(const linear_bvh &bvh, const ray &r, size_t &nodes_visited,
+                     size_t &prims_tested, std::vector<size_t> &lines, std::vector<size_t> &pages)
+{
+    auto nodes = bvh.node_data();
+    auto indices = bvh.primitive_indices();
+    const auto &objects = bvh.object_array();
+
+    precomputed_ray pr(r);
+    interval ray_t(0.001, infinity);
+    hit_record rec;
+
+    std::vector<uint32_t> tested;
+    std::vector<uint32_t> stack;
+    uint32_t index = 0;
+    while (true)
+    {
+        const auto &node = nodes[index];
+        double lo[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+        double hi[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+        double tnear;
+        nodes_visited++;
+        lines.push_back(index * sizeof(linear_bvh_node) / 64);
+        pages.push_back(index * sizeof(linear_bvh_node) / 4096);
+
+        if (slab_hit(lo, hi, pr, ray_t, tnear))
+        {
+            if (node.count > 0)
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                {
+                    // Mailboxing is counted as perfect here, the real mailbox may retest.
+                    if (bvh.uses_mailboxing())
+                    {
+                        if (std::find(tested.begin(), tested.end(), indices[i]) != tested.end())
+                            continue;
+                        tested.push_back(indices[i]);
+                    }
+                    prims_tested++;
+                    if (objects[indices[i]]->hit(r, ray_t, rec))
+                        ray_t.max = rec.t;
+                }
+            }
+            else
+            {
+                bool near_second =
+                    pr.sign[node.axis] != ((node.flags & linear_bvh_node::swapped) != 0);
+                stack.push_back(near_second ? index + 1 : node.offset);
+                index = near_second ? node.offset : index + 1;
+                continue;
+            }
+        }
+
+        if (stack.empty())
+            break;
+        index = stack.back();
+        stack.pop_back();
+    }
+}
+
+void measure_traversal(const linear_bvh &bvh, const std::vector<ray> &rays, tree_stats &stats)
+{
+    size_t nodes_visited = 0, prims_tested = 0, lines_touched = 0, pages_touched = 0;
+    std::vector<size_t> lines, pages;
+    for (const auto &r : rays)
+    {
+        lines.clear();
+        pages.clear();
+        count_traversal(bvh, r, nodes_visited, prims_tested, lines, pages);
+        std::sort(lines.begin(), lines.end());
+        std::sort(pages.begin(), pages.end());
+        lines_touched += std::unique(lines.begin(), lines.end()) - lines.begin();
+        pages_touched += std::unique(pages.begin(), pages.end()) - pages.begin();
+    }
+    stats.nodes_per_ray = static_cast<double>(nodes_visited) / rays.size();
+    stats.prims_per_ray = static_cast<double>(prims_tested) / rays.size();
+    stats.lines_per_ray = static_cast<double>(lines_touched) / rays.size();
+    stats.pages_per_ray = static_cast<double>(pages_touched) / rays.size();
+}
+
+void print_histogram(const char *title, const std::vector<tree_stats> &all,
+                     std::map<int, size_t> tree_stats::*field)
+{
+    std::map<int, bool> keys;
+    for (const auto &s : all)
+        for (const auto &entry : s.*field)
+            keys[entry.first] = true;
+
+    std::cout << '\n' << std::left << std::setw(20) << title << std::right;
+    for (const auto &s : all)
+        std::cout << std::setw(12) << s.builder;
+    std::cout << '\n';
+
+    for (const auto &key : keys)
+    {
+        std::cout << std::left << std::setw(20) << key.first << std::right;
+        for (const auto &s : all)
+        {
+            auto found = (s.*field).find(key.first);
+            std::cout << std::setw(12) << (found == (s.*field).end() ? 0 : found->second);
+        }
+        std::cout << '\n';
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const inspect_scene *scene = nullptr;
+    for (const auto &s : inspect_scenes)
+    {
+        if (argc > 1 && std::string(argv[1]) == s.name)
+            scene = &s;
+    }
+    if (!scene)
+    {
+        std::cerr << "Usage: " << argv[0] << " <scene> [rays]\nScenes:";
+        for (const auto &s : inspect_scenes)
+            std::cerr << ' ' << s.name;
+        std::cerr << '\n';
+        return 1;
+    }
+    size_t ray_count = argc > 2 ? std::atoi(argv[2]) : 100000;
+
+    auto world = scene->world();
+    auto rays = random_rays(scene->ray_region, ray_count);
+    std::cout << scene->name << ": " << world.objects.size() << " objects, " << ray_count
+              << " rays\n\n";
+
+    freeze_report report;
+    auto frozen = freeze_scene(world, &report);
+    std::cout << "authored graph      " << report.graph_objects << " objects, depth "
+              << report.graph_depth << "\n"
+              << "frozen              " << report.spheres << " spheres, " << report.quads
+              << " quads, " << report.boxes << " boxes, " << report.others << " others, "
+              << report.nodes << " nodes\n"
+              << "transforms          " << report.baked_transforms << " baked, "
+              << report.instances << " instances\n\n";
+
+    std::vector<tree_stats> all;
+    for (auto method : {bvh_build_method::median, bvh_build_method::sah, bvh_build_method::lbvh})
+    {
+        if (method == bvh_build_method::median && world.objects.size() > 20000)
+            continue;
+
+        tree_stats stats;
+        stats.builder = bvh_build_method_name(method);
+        auto start = std::chrono::high_resolution_clock::now();
+        linear_bvh flat(world, method);
+        stats.build_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start).count();
+
+        measure_structure(flat, stats);
+        measure_traversal(flat, rays, stats);
+        all.push_back(stats);
+    }
+
+    {
+        // The sah tree with its nodes reordered into page-sized treelets.
+        tree_stats stats;
+        stats.builder = "treelets";
+        auto start = std::chrono::high_resolution_clock::now();
+        linear_bvh flat(world, bvh_build_method::sah);
+        flat.reorder_treelets();
+        stats.build_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start).count();
+
+        measure_structure(flat, stats);
+        measure_traversal(flat, rays, stats);
+        all.push_back(stats);
+    }
+
+    {
+        tree_stats stats;
+        stats.builder = "sbvh";
+        auto start = std::chrono::high_resolution_clock::now();
+        sbvh_builder builder;
+        auto flat = builder.build(world);
+        stats.build_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start).count();
+
+        measure_structure(*flat, stats);
+        measure_traversal(*flat, rays, stats);
+        all.push_back(stats);
+    }
+
+    {
+        tree_stats stats;
+        stats.builder = "frozen";
+        auto start = std::chrono::high_resolution_clock::now();
+        frozen = freeze_scene(world);
+        stats.build_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::high_resolution_clock::now() - start).count();
+
+        measure_structure(*frozen, stats);
+        measure_traversal(*frozen, rays, stats);
+        all.push_back(stats);
+    }
+
+    struct row
+    {
+        const char *label;
+        double tree_stats::*value;
+        size_t tree_stats::*count;
+    } rows[] = {
+        {"build ms", &tree_stats::build_ms, nullptr},
+        {"SAH cost", &tree_stats::sah_cost, nullptr},
+        {"inner nodes", nullptr, &tree_stats::inner_nodes},
+        {"leaves", nullptr, &tree_stats::leaves},
+        {"references", nullptr, &tree_stats::references},
+        {"memory bytes", nullptr, &tree_stats::memory},
+        {"sibling overlap", &tree_stats::overlap, nullptr},
+        {"nodes / ray", &tree_stats::nodes_per_ray, nullptr},
+        {"prims / ray", &tree_stats::prims_per_ray, nullptr},
+        {"node lines / ray", &tree_stats::lines_per_ray, nullptr},
+        {"node pages / ray", &tree_stats::pages_per_ray, nullptr},
+    };
+
+    std::cout << std::left << std::setw(20) << "" << std::right;
+    for (const auto &s : all)
+        std::cout << std::setw(12) << s.builder;
+    std::cout << '\n';
+
+    for (const auto &r : rows)
+    {
+        std::cout << std::left << std::setw(20) << r.label << std::right << std::fixed
+                  << std::setprecision(2);
+        for (const auto &s : all)
+        {
+            if (r.value)
+                std::cout << std::setw(12) << s.*r.value;
+            else
+                std::cout << std::setw(12) << s.*r.count;
+        }
+        std::cout << '\n';
+    }
+
+    print_histogram("leaves at depth", all, &tree_stats::leaf_depths);
+    print_histogram("leaves of size", all, &tree_stats::leaf_sizes);
+    return 0;
+}
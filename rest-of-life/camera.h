@@ -8,6 +8,7 @@
 #include "material.h"
 #include "image.h"
 #include "pdf.h"
+#include "render_stats.h"
 #include <iomanip>
 #include <chrono>
 #include <iostream>
@@ -44,6 +45,9 @@ public:
         std::cout << "P3\n"
                   << image_width << ' ' << image_height << "\n255\n";
         auto start_time = std::chrono::high_resolution_clock::now();
+#ifdef RT_STATS
+        render_stats stats(image_width, image_height);
+#endif
         for (int j = 0; j < image_height; ++j)
         {
             for (int i = 0; i < image_width; ++i)
@@ -60,6 +64,9 @@ public:
                             << " Remaining time: " << std::fixed << std::setprecision(0) << remaining_time.count() << "s"
                           << std::flush;
                 
+#ifdef RT_STATS
+                stats.begin_pixel();
+#endif
                 color pixel_color(0, 0, 0);
                 for(int s_j = 0; s_j < sqrt_spp; ++s_j)
                 {
@@ -69,11 +76,18 @@ public:
                         pixel_color += ray_color(r, max_depth, world, lights);
                     }
                 }
+#ifdef RT_STATS
+                stats.end_pixel(i, j);
+#endif
                 write_color(std::cout, pixel_color, samples_per_pixel);
             }
         }
         img->save_bmp(outputfile.c_str());
         std::clog << "\rDone.                 \n";
+#ifdef RT_STATS
+        stats.write_heatmaps(outputfile);
+        stats.print_totals(std::clog, samples_per_pixel);
+#endif
     }
 
 private:
@@ -149,6 +163,7 @@ private:
         // if ray hits nothing
         if (!world.hit(r, interval(1e-3, infinity), rec))
             return background;
+        RT_STATS_COUNT(stat_shading);
 
         ray scattered;
         color color_from_emission = rec.mat->emitted(r, rec, rec.u, rec.v, rec.p);
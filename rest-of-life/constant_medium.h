@@ -18,6 +18,7 @@ class constant_medium : public hittable {
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STATS_COUNT(stat_other_tests);
         // Print occasional samples when debugging. To enable, set enableDebug true.
         const bool enableDebug = false;
         const bool debugging = enableDebug && random_double() < 0.00001;
@@ -59,7 +60,7 @@ class constant_medium : public hittable {
 
         rec.normal = vec3(1,0,0);  // arbitrary
         rec.front_face = true;     // also arbitrary
-        rec.mat = phase_function;
+        rec.mat = phase_function.get();
 
         return true;
     }
@@ -0,0 +1,245 @@
+#ifndef FROZEN_SCENE_H
+#define FROZEN_SCENE_H
+
+#include "rtweekend.h"
+
+#include "box.h"
+#include "bvh.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "linear_bvh.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <typeinfo>
+#include <unordered_map>
+
+// Closed-world form of a scene, for rendering once authoring is done. Scenes are written as
+// nested hittable_lists and BVHs of primitives, some of them under translate, rotate_y or
+// instance, and each level costs a virtual call per ray and each transform a ray
+// transformation. freeze_scene() compiles that graph into one linear_bvh over a flat list of
+// primitives:
+//
+//   - every hittable_list, bvh_node and linear_bvh is expanded into its children, so lists
+//     of one object and single-child nodes disappear with the rest;
+//   - nested transforms are composed into one affine_transform;
+//   - a transformed subtree of up to bake_limit primitives is baked into world space: its
+//     spheres (under uniform scaling), quads and aligned boxes are copied with the transform
+//     applied, a box under rotation becoming six quads. Primitives that cannot be baked get
+//     an instance of their own;
+//   - a larger transformed subtree, usually a model placed several times, is frozen once on
+//     its own and kept as an instance of that, shared by every placement.
+//
+// The top-level BVH then dispatches spheres, quads and aligned boxes through a switch on a type
+// tag, to calls the compiler can inline. constant_medium and the other accelerators
+// (sphere_set, triangle_mesh, ...) are kept whole behind a virtual call. The frozen scene shares
+// the untransformed primitives of the original and copies the typed ones, so the scene must not
+// be edited afterwards; freeze it again instead.
+
+// What one freeze did, for checking that it pays off.
+struct freeze_report
+{
+    // The authored graph: every hittable reached through containers and transforms, and the
+    // longest chain of them from the scene list down to a primitive.
+    size_t graph_objects = 0;
+    int graph_depth = 0;
+
+    // The frozen scene: primitives by kind (those of frozen subtrees included), transforms
+    // baked into primitives, instances kept, and linear_bvh nodes of the top level plus every
+    // distinct frozen subtree.
+    size_t spheres = 0, quads = 0, boxes = 0, others = 0;
+    size_t baked_transforms = 0, instances = 0;
+    size_t nodes = 0;
+};
+
+class scene_freezer
+{
+public:
+    // Baking copies the subtree once per placement, instancing shares it but transforms every
+    // ray that reaches it; this is where the copies start to cost more than they save.
+    static const size_t default_bake_limit = 64;
+
+    explicit scene_freezer(size_t _bake_limit = default_bake_limit) : bake_limit(_bake_limit) {}
+
+    shared_ptr<linear_bvh> freeze(const hittable_list &scene, freeze_report *report = nullptr)
+    {
+        counts = freeze_report();
+        for (const auto &object : scene.objects)
+            count_graph(object, 1);
+
+        hittable_list primitives;
+        for (const auto &object : scene.objects)
+            collect(object, nullptr, primitives);
+        auto frozen = build(primitives);
+
+        frozen_subtrees.clear();
+        if (report)
+            *report = counts;
+        return frozen;
+    }
+
+private:
+    size_t bake_limit;
+    freeze_report counts;
+    std::unordered_map<const hittable *, shared_ptr<linear_bvh>> frozen_subtrees;
+
+    void count_graph(const shared_ptr<hittable> &object, int depth)
+    {
+        counts.graph_objects++;
+        counts.graph_depth = std::max(counts.graph_depth, depth);
+        for_each_child(object, [&](const shared_ptr<hittable> &child) {
+            count_graph(child, depth + 1);
+        });
+    }
+
+    // Calls f on the children of a container or transform; returns false for anything else.
+    template <typename F>
+    static bool for_each_child(const shared_ptr<hittable> &object, F f)
+    {
+        if (auto list = dynamic_cast<const hittable_list *>(object.get()))
+        {
+            for (const auto &child : list->objects)
+                f(child);
+        }
+        else if (auto node = dynamic_cast<const bvh_node *>(object.get()))
+        {
+            f(node->left_child());
+            if (node->right_child() != node->left_child())
+                f(node->right_child());
+        }
+        else if (auto bvh = dynamic_cast<const linear_bvh *>(object.get()))
+        {
+            for (const auto &child : bvh->object_array())
+                f(child);
+        }
+        else if (auto moved = dynamic_cast<const translate *>(object.get()))
+            f(moved->translated_object());
+        else if (auto rotated = dynamic_cast<const rotate_y *>(object.get()))
+            f(rotated->rotated_object());
+        else if (auto placed = dynamic_cast<const instance *>(object.get()))
+            f(placed->instanced_object());
+        else
+            return false;
+        return true;
+    }
+
+    // Primitives under object, counting stopped once past limit.
+    static size_t primitive_count(const shared_ptr<hittable> &object, size_t limit)
+    {
+        size_t count = 0;
+        if (!for_each_child(object, [&](const shared_ptr<hittable> &child) {
+                if (count <= limit)
+                    count += primitive_count(child, limit - count);
+            }))
+            count = 1;
+        return count;
+    }
+
+    // Appends the primitives under object to out, placed by t (nullptr: left where they are).
+    void collect(const shared_ptr<hittable> &object, const affine_transform *t,
+                 hittable_list &out)
+    {
+        if (auto moved = dynamic_cast<const translate *>(object.get()))
+        {
+            collect_transformed(moved->translated_object(),
+                                affine_transform::translation(moved->displacement()), t, out);
+        }
+        else if (auto rotated = dynamic_cast<const rotate_y *>(object.get()))
+        {
+            // The rotation of rotate_y as a matrix (see affine_transform::rotation_y).
+            affine_transform rotation;
+            rotation.m[0][0] = rotation.m[2][2] = rotated->cos_angle();
+            rotation.m[0][2] = rotated->sin_angle();
+            rotation.m[2][0] = -rotated->sin_angle();
+            collect_transformed(rotated->rotated_object(), rotation, t, out);
+        }
+        else if (auto placed = dynamic_cast<const instance *>(object.get()))
+            collect_transformed(placed->instanced_object(), placed->transform(), t, out);
+        else if (!for_each_child(object, [&](const shared_ptr<hittable> &child) {
+                     collect(child, t, out);
+                 }))
+            add_primitive(object, t, out);
+    }
+
+    void add_primitive(const shared_ptr<hittable> &object, const affine_transform *t,
+                       hittable_list &out)
+    {
+        if (!t)
+        {
+            out.add(object);
+            return;
+        }
+        if (auto baked = bake(*object, *t))
+        {
+            collect(baked, nullptr, out);
+            return;
+        }
+        out.add(make_shared<instance>(object, *t));
+        counts.instances++;
+    }
+
+    void collect_transformed(const shared_ptr<hittable> &object, const affine_transform &local,
+                             const affine_transform *parent, hittable_list &out)
+    {
+        auto t = parent ? *parent * local : local;
+        if (primitive_count(object, bake_limit) <= bake_limit)
+        {
+            counts.baked_transforms++;
+            collect(object, &t, out);
+            return;
+        }
+
+        auto &subtree = frozen_subtrees[object.get()];
+        if (!subtree)
+        {
+            hittable_list primitives;
+            collect(object, nullptr, primitives);
+            subtree = build(primitives);
+        }
+        out.add(make_shared<instance>(subtree, t));
+        counts.instances++;
+    }
+
+    // object placed by t as new primitives, or nullptr if it has to stay instanced.
+    static shared_ptr<hittable> bake(const hittable &object, const affine_transform &t)
+    {
+        // Exact types only: a subclass may intersect differently.
+        const auto &type = typeid(object);
+        if (type == typeid(sphere))
+            return static_cast<const sphere &>(object).transformed(t);
+        if (type == typeid(quad))
+            return static_cast<const quad &>(object).transformed(t);
+        if (type == typeid(aligned_box))
+            return static_cast<const aligned_box &>(object).transformed(t);
+        return nullptr;
+    }
+
+    shared_ptr<linear_bvh> build(const hittable_list &primitives)
+    {
+        for (const auto &object : primitives.objects)
+        {
+            const auto &type = typeid(*object);
+            if (type == typeid(sphere))
+                counts.spheres++;
+            else if (type == typeid(quad))
+                counts.quads++;
+            else if (type == typeid(aligned_box))
+                counts.boxes++;
+            else
+                counts.others++;
+        }
+        auto bvh = make_shared<linear_bvh>(primitives);
+        counts.nodes += bvh->node_count();
+        return bvh;
+    }
+};
+
+inline shared_ptr<linear_bvh> freeze_scene(const hittable_list &scene,
+                                           freeze_report *report = nullptr)
+{
+    return scene_freezer().freeze(scene, report);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Uniform grid over a set of objects, traversed with a 3D-DDA: the ray walks the cells it
+// pierces front to back, and stops at the first cell whose exit lies beyond the closest hit
+// found so far. Objects are referenced from every cell their bounding box overlaps, so a
+// small mailbox skips the ones the ray has just tested.
+//
+// The resolution follows the object count: about cells_per_object cells per object, with the
+// cells as close to cubes as the bounds allow (Cleary and Wyvill). Grids suit dense, evenly
+// spread scenes; see two_level_grid for uneven ones.
+class uniform_grid : public hittable
+{
+public:
+    static constexpr double default_cells_per_object = 2;
+    static const int max_resolution = 256;
+    static const int mailbox_size = 8;
+
+    uniform_grid(const hittable_list &list, double cells_per_object = default_cells_per_object)
+        : uniform_grid(list.objects, list.bounding_box(), cells_per_object) {}
+
+    // Grid over the part of region that the objects overlap.
+    uniform_grid(const std::vector<shared_ptr<hittable>> &_objects, const aabb &region,
+                 double cells_per_object)
+        : items(_objects)
+    {
+        aabb bounds;
+        for (const auto &object : items)
+            bounds = aabb(bounds, object->bounding_box());
+        bbox = aabb(interval(bounds.x.min > region.x.min ? bounds.x.min : region.x.min,
+                             bounds.x.max < region.x.max ? bounds.x.max : region.x.max),
+                    interval(bounds.y.min > region.y.min ? bounds.y.min : region.y.min,
+                             bounds.y.max < region.y.max ? bounds.y.max : region.y.max),
+                    interval(bounds.z.min > region.z.min ? bounds.z.min : region.z.min,
+                             bounds.z.max < region.z.max ? bounds.z.max : region.z.max))
+                   .pad();
+
+        choose_resolution(cells_per_object);
+        std::vector<std::vector<uint32_t>> cells(cell_count());
+        for (size_t i = 0; i < items.size(); i++)
+        {
+            int lo[3], hi[3];
+            if (!cell_range(items[i]->bounding_box(), lo, hi))
+                continue;
+            for (int z = lo[2]; z <= hi[2]; z++)
+                for (int y = lo[1]; y <= hi[1]; y++)
+                    for (int x = lo[0]; x <= hi[0]; x++)
+                        cells[cell_index(x, y, z)].push_back(static_cast<uint32_t>(i));
+        }
+        store_cells(cells);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return traverse(r, ray_t, &cand);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return traverse(r, ray_t, nullptr);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    int resolution(int axis) const { return res[axis]; }
+    size_t cell_count() const { return static_cast<size_t>(res[0]) * res[1] * res[2]; }
+    size_t reference_count() const { return cell_items.size(); }
+
+    size_t memory_bytes() const
+    {
+        return cell_start.size() * sizeof(uint32_t) + cell_items.size() * sizeof(uint32_t) +
+               items.size() * sizeof(shared_ptr<hittable>);
+    }
+
+protected:
+    std::vector<shared_ptr<hittable>> items;
+    std::vector<uint32_t> cell_start; // cell c references cell_items[cell_start[c]] onwards
+    std::vector<uint32_t> cell_items;
+    aabb bbox;
+    int res[3];
+    double cell_size[3];
+
+    size_t cell_index(int x, int y, int z) const
+    {
+        return (static_cast<size_t>(z) * res[1] + y) * res[0] + x;
+    }
+
+    aabb cell_box(int x, int y, int z) const
+    {
+        int cell[3] = {x, y, z};
+        interval axes[3];
+        for (int a = 0; a < 3; a++)
+        {
+            auto lo = bbox.axis(a).min + cell[a] * cell_size[a];
+            axes[a] = interval(lo, cell[a] == res[a] - 1 ? bbox.axis(a).max : lo + cell_size[a]);
+        }
+        return aabb(axes[0], axes[1], axes[2]);
+    }
+
+    void store_cells(const std::vector<std::vector<uint32_t>> &cells)
+    {
+        cell_start.assign(1, 0);
+        cell_items.clear();
+        for (const auto &cell : cells)
+        {
+            cell_items.insert(cell_items.end(), cell.begin(), cell.end());
+            cell_start.push_back(static_cast<uint32_t>(cell_items.size()));
+        }
+    }
+
+private:
+    void choose_resolution(double cells_per_object)
+    {
+        double extent[3], largest = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            extent[a] = bbox.axis(a).size();
+            largest = std::max(largest, extent[a]);
+        }
+
+        // Flat bounds (a floor of quads) get one layer of cells instead of a degenerate volume.
+        double volume = 1;
+        for (int a = 0; a < 3; a++)
+            volume *= std::max(extent[a], 1e-3 * largest);
+        auto cells = std::max(1.0, cells_per_object * items.size());
+        auto per_unit = std::cbrt(cells / volume);
+
+        for (int a = 0; a < 3; a++)
+        {
+            auto r = static_cast<int>(std::round(extent[a] * per_unit));
+            res[a] = std::min(std::max(r, 1), max_resolution);
+            cell_size[a] = extent[a] / res[a];
+        }
+    }
+
+    int clamp_cell(double x, int axis) const
+    {
+        auto c = static_cast<int>((x - bbox.axis(axis).min) / cell_size[axis]);
+        return std::min(std::max(c, 0), res[axis] - 1);
+    }
+
+    bool cell_range(const aabb &box, int lo[3], int hi[3]) const
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            if (box.axis(a).max < bbox.axis(a).min || box.axis(a).min > bbox.axis(a).max)
+                return false;
+            lo[a] = clamp_cell(box.axis(a).min, a);
+            hi[a] = clamp_cell(box.axis(a).max, a);
+        }
+        return true;
+    }
+
+    // With cand == nullptr this is an any-hit query and returns on the first intersection.
+    bool traverse(const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        precomputed_ray pr(r);
+
+        // Clip the ray to the grid.
+        RT_STATS_COUNT(stat_box_tests);
+        interval clipped = ray_t;
+        for (int a = 0; a < 3; a++)
+        {
+            const auto &axis = bbox.axis(a);
+            auto t0 = (pr.sign[a] ? axis.max : axis.min) * pr.inv_dir[a] - pr.origin_inv[a];
+            auto t1 = (pr.sign[a] ? axis.min : axis.max) * pr.inv_dir[a] - pr.origin_inv[a];
+            clipped.min = t0 > clipped.min ? t0 : clipped.min;
+            clipped.max = t1 < clipped.max ? t1 : clipped.max;
+        }
+        if (!(clipped.min < clipped.max))
+            return false;
+
+        // Set up the DDA at the entry point.
+        auto entry = r.at(clipped.min);
+        auto direction = r.direction();
+        int cell[3], step[3], end[3];
+        double next_t[3], delta_t[3];
+        for (int a = 0; a < 3; a++)
+        {
+            cell[a] = clamp_cell(entry[a], a);
+            if (direction[a] == 0)
+            {
+                step[a] = 0;
+                end[a] = 0;
+                next_t[a] = infinity;
+                delta_t[a] = infinity;
+                continue;
+            }
+            auto lo = bbox.axis(a).min;
+            step[a] = pr.sign[a] ? -1 : 1;
+            end[a] = pr.sign[a] ? -1 : res[a];
+            auto boundary = lo + (cell[a] + (pr.sign[a] ? 0 : 1)) * cell_size[a];
+            next_t[a] = (boundary - r.origin()[a]) / direction[a];
+            delta_t[a] = cell_size[a] / std::fabs(direction[a]);
+        }
+
+        bool hit_anything = false;
+        uint32_t mailbox[mailbox_size];
+        std::fill(mailbox, mailbox + mailbox_size, UINT32_MAX);
+        int mailbox_next = 0;
+
+        while (true)
+        {
+            RT_STATS_COUNT(stat_nodes);
+            auto c = cell_index(cell[0], cell[1], cell[2]);
+            for (auto i = cell_start[c]; i < cell_start[c + 1]; i++)
+            {
+                auto item = cell_items[i];
+                if (std::find(mailbox, mailbox + mailbox_size, item) != mailbox + mailbox_size)
+                    continue;
+                mailbox[mailbox_next++ % mailbox_size] = item;
+
+                if (!cand)
+                {
+                    if (items[item]->occluded(r, ray_t))
+                        return true;
+                }
+                else if (items[item]->intersect(r, ray_t, *cand))
+                {
+                    hit_anything = true;
+                    ray_t.max = cand->t;
+                }
+            }
+
+            // Step into the neighbour across the nearest cell wall, unless every hit beyond it
+            // would be farther than what has been found or than the grid exit.
+            int axis = next_t[0] < next_t[1] ? (next_t[0] < next_t[2] ? 0 : 2)
+                                             : (next_t[1] < next_t[2] ? 1 : 2);
+            if (next_t[axis] > ray_t.max || next_t[axis] > clipped.max || step[axis] == 0)
+                break;
+            cell[axis] += step[axis];
+            if (cell[axis] == end[axis])
+                break;
+            next_t[axis] += delta_t[axis];
+        }
+        return hit_anything;
+    }
+};
+
+// Two-level grid for uneven object density: a coarse top grid whose crowded cells hold a
+// finer grid of their own over the objects they overlap, each sized to its own count.
+class two_level_grid : public uniform_grid
+{
+public:
+    // Top-level cells per object, and the object count above which a cell gets a subgrid.
+    static constexpr double top_cells_per_object = 1.0 / 8;
+    static const size_t refine_threshold = 32;
+
+    two_level_grid(const hittable_list &list,
+                   double cells_per_object = uniform_grid::default_cells_per_object)
+        : uniform_grid(list.objects, list.bounding_box(), top_cells_per_object)
+    {
+        std::vector<std::vector<uint32_t>> cells(cell_count());
+        for (int z = 0; z < res[2]; z++)
+        {
+            for (int y = 0; y < res[1]; y++)
+            {
+                for (int x = 0; x < res[0]; x++)
+                {
+                    auto c = cell_index(x, y, z);
+                    auto first = cell_items.begin() + cell_start[c];
+                    auto last = cell_items.begin() + cell_start[c + 1];
+                    auto &cell = cells[c];
+                    if (static_cast<size_t>(last - first) <= refine_threshold)
+                    {
+                        cell.assign(first, last);
+                        continue;
+                    }
+
+                    std::vector<shared_ptr<hittable>> objects;
+                    for (auto i = first; i != last; ++i)
+                        objects.push_back(items[*i]);
+                    cell.push_back(static_cast<uint32_t>(items.size()));
+                    items.push_back(make_shared<uniform_grid>(objects, cell_box(x, y, z),
+                                                              cells_per_object));
+                    subgrids++;
+                }
+            }
+        }
+        store_cells(cells);
+    }
+
+    size_t subgrid_count() const { return subgrids; }
+
+private:
+    size_t subgrids = 0;
+};
+
+#endif
@@ -4,14 +4,20 @@
 #include "rtweekend.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 class material;
+class hittable;
 
 class hit_record
 {
 public:
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat;
+    // Owned by the primitive that was hit, so it is valid for as long as the scene is. A plain
+    // pointer keeps hits from touching the material's reference count, a cache line that every
+    // thread hitting the same material would otherwise write to.
+    const material *mat;
     double t;
     double u;
     double v;
@@ -25,6 +31,18 @@ public:
     }
 };
 
+// The closest hit found so far by the first phase of a query (hittable::intersect): its
+// distance, the object that will compute its hit_record, and what that object needs to find
+// the spot again. Objects that resolve their hits right away keep the finished record here.
+struct hit_candidate
+{
+    double t;
+    const hittable *object = nullptr;
+    uint32_t primitive;   // part of object, such as a triangle or the face of a box
+    double b1, b2;        // surface parameters or barycentric weights on the primitive
+    hit_record resolved;
+};
+
 class hittable
 {
 public:
@@ -32,6 +50,40 @@ public:
 
     virtual bool hit(const ray &r, interval ray_t, hit_record &rec) const = 0;
     virtual aabb bounding_box() const = 0;
+
+    // Closest hit in two phases. intersect() only finds the hit and, if it lies in ray_t,
+    // records it in cand; surface() then fills rec for that candidate from the same ray. A
+    // container runs intersect() on its children and surface() once, for the winner, so normals,
+    // uvs and materials are not computed for hits that a closer one replaces. Objects that do
+    // not split their hits (the transforms, constant_medium) resolve them in intersect().
+    virtual bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const
+    {
+        hit_record rec;
+        if (!hit(r, ray_t, rec))
+            return false;
+        cand.t = rec.t;
+        cand.object = this;
+        cand.resolved = rec;
+        return true;
+    }
+
+    virtual void surface(const ray &r, const hit_candidate &cand, hit_record &rec) const
+    {
+        rec = cand.resolved;
+    }
+
+    // Bounds at a single ray time in [0, 1], for motion-aware BVHs. Only moving objects need
+    // to override it; the bounds over the whole shutter interval are always valid.
+    virtual aabb bounding_box_at(double time) const { return bounding_box(); }
+
+    // Any-hit query for shadow and visibility rays: true if anything is hit within ray_t.
+    // Implementations may stop at the first intersection and compute no shading data.
+    virtual bool occluded(const ray &r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
     virtual double pdf_value(const point3 &o, const vec3 &v) const
     {
         return 0.0;
@@ -41,6 +93,17 @@ public:
     {
         return vec3(1, 0, 0);
     }
+
+protected:
+    // hit() for objects that override intersect() and surface().
+    bool resolve_hit(const ray &r, interval ray_t, hit_record &rec) const
+    {
+        hit_candidate cand;
+        if (!intersect(r, ray_t, cand))
+            return false;
+        cand.object->surface(r, cand, rec);
+        return true;
+    }
 };
 class translate : public hittable
 {
@@ -61,7 +124,18 @@ public:
         rec.p += offset;
         return true;
     }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(ray(r.origin() - offset, r.direction(), r.time()), ray_t);
+    }
     aabb bounding_box() const override { return bbox; }
+    aabb bounding_box_at(double time) const override
+    {
+        return object->bounding_box_at(time) + offset;
+    }
+
+    const shared_ptr<hittable> &translated_object() const { return object; }
+    const vec3 &displacement() const { return offset; }
 
 private:
     shared_ptr<hittable> object;
@@ -73,17 +147,7 @@ class rotate_y : public hittable
 public:
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        // Change the ray's origin and direction
-        auto origin = r.origin();
-        auto direction = r.direction();
-
-        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
-
-        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
-
-        ray rotated_r(origin, direction, r.time());
+        ray rotated_r = to_object(r);
 
         if (!object->hit(rotated_r, ray_t, rec))
             return false;
@@ -139,12 +203,35 @@ public:
 
         bbox = aabb(min, max);
     }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(to_object(r), ray_t);
+    }
     aabb bounding_box() const override { return bbox; }
 
+    const shared_ptr<hittable> &rotated_object() const { return object; }
+    double sin_angle() const { return sin_theta; }
+    double cos_angle() const { return cos_theta; }
+
 private:
     shared_ptr<hittable> object;
     double sin_theta;
     double cos_theta;
     aabb bbox;
+
+    ray to_object(const ray &r) const
+    {
+        // Change the ray's origin and direction
+        auto origin = r.origin();
+        auto direction = r.direction();
+
+        origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+        origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+
+        direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+        direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+
+        return ray(origin, direction, r.time());
+    }
 };
 #endif
\ No newline at end of file
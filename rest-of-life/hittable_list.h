@@ -27,22 +27,52 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        hit_record temp_rec;
-        bool hit_anything = false;
-        auto closest_so_far = ray_t.max;
+        return resolve_hit(r, ray_t, rec);
+    }
 
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        // A closer hit overwrites cand in place; nothing is copied per improvement.
+        bool hit_anything = false;
         for (const auto &object : objects)
         {
-            if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec))
+            if (object->intersect(r, ray_t, cand))
             {
                 hit_anything = true;
-                closest_so_far = temp_rec.t;
-                rec = temp_rec;
+                ray_t.max = cand.t;
             }
         }
 
         return hit_anything;
     }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        for (const auto &object : objects)
+        {
+            if (object->occluded(r, ray_t))
+                return true;
+        }
+        return false;
+    }
+
+    double pdf_value(const point3 &o, const vec3 &v) const override
+    {
+        // Light lists are sampled uniformly by object.
+        auto weight = 1.0 / objects.size();
+        auto sum = 0.0;
+
+        for (const auto &object : objects)
+            sum += weight * object->pdf_value(o, v);
+
+        return sum;
+    }
+
+    vec3 random(const vec3 &o) const override
+    {
+        auto int_size = static_cast<int>(objects.size());
+        return objects[random_int(0, int_size - 1)]->random(o);
+    }
     aabb bounding_box() const override { return bbox;}
 private:
     aabb bbox;
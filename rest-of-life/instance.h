@@ -0,0 +1,198 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+
+// Affine 3x4 transform: the upper 3x3 block is the linear part, the last column the
+// translation.
+class affine_transform
+{
+public:
+    double m[3][4];
+
+    affine_transform() : m{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}} {}
+
+    static affine_transform translation(const vec3 &offset)
+    {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][3] = offset[i];
+        return t;
+    }
+
+    static affine_transform scaling(const vec3 &scale)
+    {
+        affine_transform t;
+        for (int i = 0; i < 3; i++)
+            t.m[i][i] = scale[i];
+        return t;
+    }
+
+    static affine_transform rotation_y(double angle)
+    {
+        // Same convention as rotate_y: positive angles turn +x towards -z.
+        auto radians = degrees_to_radians(angle);
+        auto s = sin(radians);
+        auto c = cos(radians);
+        affine_transform t;
+        t.m[0][0] = c, t.m[0][2] = s;
+        t.m[2][0] = -s, t.m[2][2] = c;
+        return t;
+    }
+
+    point3 point(const point3 &p) const
+    {
+        return point3(m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+                      m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+                      m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]);
+    }
+
+    vec3 vector(const vec3 &v) const
+    {
+        return vec3(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                    m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                    m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    vec3 transposed_vector(const vec3 &v) const
+    {
+        // Multiplies by the transpose of the linear part. Called on an inverse transform,
+        // this maps normals.
+        return vec3(m[0][0] * v[0] + m[1][0] * v[1] + m[2][0] * v[2],
+                    m[0][1] * v[0] + m[1][1] * v[1] + m[2][1] * v[2],
+                    m[0][2] * v[0] + m[1][2] * v[1] + m[2][2] * v[2]);
+    }
+
+    double determinant() const
+    {
+        // Of the linear part; negative when the transform mirrors.
+        return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+               m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+               m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+    }
+
+    bool axis_scaling(vec3 &scale) const
+    {
+        // True when the linear part is diagonal, i.e. the transform only scales along the
+        // axes before translating; scale gets the diagonal.
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                if (i != j && m[i][j] != 0)
+                    return false;
+            }
+            scale[i] = m[i][i];
+        }
+        return true;
+    }
+
+    affine_transform inverse() const
+    {
+        // Inverse of the 3x3 block by cofactors, then t' = -inverse(M) * t.
+        affine_transform r;
+        auto inv_det = 1 / determinant();
+
+        r.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * inv_det;
+        r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+        r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+        r.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * inv_det;
+        r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+        r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+        r.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * inv_det;
+        r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+        r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+
+        auto t = r.vector(vec3(m[0][3], m[1][3], m[2][3]));
+        for (int i = 0; i < 3; i++)
+            r.m[i][3] = -t[i];
+        return r;
+    }
+
+    aabb box(const aabb &b) const
+    {
+        // Bounds of the transformed box: each output interval starts at the translation and
+        // adds the smaller/larger product of every matrix entry with the input interval.
+        interval out[3];
+        for (int i = 0; i < 3; i++)
+        {
+            double lo = m[i][3], hi = m[i][3];
+            for (int j = 0; j < 3; j++)
+            {
+                auto a = m[i][j] * b.axis(j).min;
+                auto c = m[i][j] * b.axis(j).max;
+                lo += fmin(a, c);
+                hi += fmax(a, c);
+            }
+            out[i] = interval(lo, hi);
+        }
+        return aabb(out[0], out[1], out[2]);
+    }
+};
+
+// Composition: (a * b) applies b first, then a.
+inline affine_transform operator*(const affine_transform &a, const affine_transform &b)
+{
+    affine_transform r;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            r.m[i][j] = a.m[i][0] * b.m[0][j] + a.m[i][1] * b.m[1][j] + a.m[i][2] * b.m[2][j];
+        }
+        r.m[i][3] += a.m[i][3];
+    }
+    return r;
+}
+
+// One placement of a shared bottom-level structure (usually a bvh_node). Both the transform
+// and its inverse are computed once here, and the ray is mapped into object space a single
+// time at the instance boundary. The object-space direction is not renormalized, so hit
+// distances t are the same in both spaces. A top-level BVH over instances is simply a
+// bvh_node built over a hittable_list of them.
+class instance : public hittable
+{
+public:
+    instance(shared_ptr<hittable> _object, const affine_transform &_object_to_world)
+        : object(_object), object_to_world(_object_to_world),
+          world_to_object(_object_to_world.inverse())
+    {
+        bbox = object_to_world.box(object->bounding_box());
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        ray object_r(world_to_object.point(r.origin()), world_to_object.vector(r.direction()),
+                     r.time());
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        // front_face is unchanged by the transform, so only p and the normal are mapped back.
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+        return true;
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return object->occluded(ray(world_to_object.point(r.origin()),
+                                    world_to_object.vector(r.direction()), r.time()),
+                                ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    const shared_ptr<hittable> &instanced_object() const { return object; }
+    const affine_transform &transform() const { return object_to_world; }
+
+private:
+    shared_ptr<hittable> object;
+    affine_transform object_to_world;
+    affine_transform world_to_object;
+    aabb bbox;
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef LAZY_BVH_H
+#define LAZY_BVH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// BVH whose lower levels are only built when a ray first reaches them, for huge scenes of
+// which a frame sees a small part. The top eager_depth levels are split right away at the
+// object median of the longest axis, which only needs the primitive bounds. Below them every
+// range of primitives stays an unsorted list behind its bounding box; the first ray to enter
+// the box builds the subtree with the sah builder, exactly once even when several threads
+// arrive together, and later rays go straight to it.
+class lazy_bvh : public hittable
+{
+public:
+    // Up to 2^8 lazy subtrees. Ranges of at most eager_leaf_size primitives never wait.
+    static const int default_eager_depth = 8;
+    static const size_t eager_leaf_size = 4;
+
+    lazy_bvh(const hittable_list &list, int eager_depth = default_eager_depth)
+        : stats(make_shared<build_stats>())
+    {
+        if (!list.objects.empty())
+            root = split(list.objects, eager_depth);
+        bbox = list.bounding_box();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return root && root->intersect(r, ray_t, cand);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return root && root->occluded(r, ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t lazy_subtrees() const { return stats->lazy_subtrees; }
+    size_t built_subtrees() const { return stats->built_subtrees; }
+
+    // Share of the primitives below lazy subtrees that have been built so far.
+    double built_fraction() const
+    {
+        auto lazy = stats->lazy_primitives;
+        return lazy > 0 ? static_cast<double>(stats->built_primitives) / lazy : 1;
+    }
+
+private:
+    struct build_stats
+    {
+        size_t lazy_subtrees = 0;
+        size_t lazy_primitives = 0;
+        std::atomic<size_t> built_subtrees{0};
+        std::atomic<size_t> built_primitives{0};
+    };
+
+    class lazy_subtree : public hittable
+    {
+    public:
+        lazy_subtree(const std::vector<shared_ptr<hittable>> &objects,
+                     shared_ptr<build_stats> _stats)
+            : stats(_stats)
+        {
+            for (const auto &object : objects)
+                primitives.add(object);
+            bbox = primitives.bounding_box();
+        }
+
+        bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+        {
+            return resolve_hit(r, ray_t, rec);
+        }
+
+        bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+        {
+            return bbox.hit(r, ray_t) && subtree().intersect(r, ray_t, cand);
+        }
+
+        bool occluded(const ray &r, interval ray_t) const override
+        {
+            return bbox.hit(r, ray_t) && subtree().occluded(r, ray_t);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+    private:
+        mutable std::once_flag once;
+        mutable std::atomic<bool> ready{false};
+        mutable hittable_list primitives; // released once the subtree is built
+        mutable shared_ptr<hittable> tree;
+        shared_ptr<build_stats> stats;
+        aabb bbox;
+
+        const hittable &subtree() const
+        {
+            // The flag keeps the common, already built case down to one acquire load.
+            if (!ready.load(std::memory_order_acquire))
+            {
+                std::call_once(once, [this] {
+                    auto count = primitives.objects.size();
+                    tree = build_bvh(primitives, bvh_build_method::sah);
+                    std::vector<shared_ptr<hittable>>().swap(primitives.objects);
+                    stats->built_subtrees++;
+                    stats->built_primitives += count;
+                    ready.store(true, std::memory_order_release);
+                });
+            }
+            return *tree;
+        }
+    };
+
+    shared_ptr<build_stats> stats;
+    shared_ptr<hittable> root;
+    aabb bbox;
+
+    shared_ptr<hittable> split(std::vector<shared_ptr<hittable>> objects, int depth)
+    {
+        if (objects.size() == 1)
+            return objects.front();
+        if (objects.size() <= eager_leaf_size)
+        {
+            hittable_list leaf;
+            for (const auto &object : objects)
+                leaf.add(object);
+            return build_bvh(leaf, bvh_build_method::sah);
+        }
+        if (depth == 0)
+        {
+            stats->lazy_subtrees++;
+            stats->lazy_primitives += objects.size();
+            return make_shared<lazy_subtree>(objects, stats);
+        }
+
+        aabb centroids;
+        for (const auto &object : objects)
+        {
+            auto c = object->bounding_box().center();
+            centroids = aabb(centroids, aabb(c, c));
+        }
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            if (centroids.axis(a).size() > centroids.axis(axis).size())
+                axis = a;
+        }
+
+        auto mid = objects.begin() + objects.size() / 2;
+        std::nth_element(objects.begin(), mid, objects.end(),
+                         [axis](const shared_ptr<hittable> &a, const shared_ptr<hittable> &b) {
+                             return a->bounding_box().center()[axis] <
+                                    b->bounding_box().center()[axis];
+                         });
+
+        std::vector<shared_ptr<hittable>> upper(mid, objects.end());
+        objects.erase(mid, objects.end());
+        auto left = split(std::move(objects), depth - 1);
+        auto right = split(std::move(upper), depth - 1);
+        return make_shared<bvh_node>(left, right);
+    }
+};
+
+#endif
@@ -0,0 +1,792 @@
+#ifndef LINEAR_BVH_H
+#define LINEAR_BVH_H
+
+#include "rtweekend.h"
+
+#include "box.h"
+#include "bvh.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "quad.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+// Float bounds rounded outwards, so a float box always contains the double box it came from.
+inline float round_down_float(double x)
+{
+    auto f = static_cast<float>(x);
+    return f > x ? std::nextafter(f, -INFINITY) : f;
+}
+
+inline float round_up_float(double x)
+{
+    auto f = static_cast<float>(x);
+    return f < x ? std::nextafter(f, INFINITY) : f;
+}
+
+// Flattened BVH node. The first child of an inner node immediately follows it, so only the
+// second child's index is stored; children are always stored after their parent.
+struct linear_bvh_node
+{
+    // flags: the first child is the upper one along axis instead of the lower one.
+    static const uint8_t swapped = 1;
+
+    float bounds_min[3];
+    float bounds_max[3];
+    uint32_t offset; // leaf: first primitive; inner node: index of the second child
+    uint16_t count;  // primitives in a leaf, 0 for inner nodes
+    uint8_t axis;    // inner nodes: axis along which the children are ordered
+    uint8_t flags;
+};
+
+inline linear_bvh_node make_linear_bvh_node(const aabb &box)
+{
+    linear_bvh_node node;
+    node.bounds_min[0] = round_down_float(box.x.min);
+    node.bounds_min[1] = round_down_float(box.y.min);
+    node.bounds_min[2] = round_down_float(box.z.min);
+    node.bounds_max[0] = round_up_float(box.x.max);
+    node.bounds_max[1] = round_up_float(box.y.max);
+    node.bounds_max[2] = round_up_float(box.z.max);
+    node.offset = 0;
+    node.count = 0;
+    node.axis = 0;
+    node.flags = 0;
+    return node;
+}
+
+// Binned SAH builder for primitives that live in arrays of their own rather than as hittables
+// (triangle_mesh, sphere_set). It emits linear_bvh_node trees in depth-first order whose leaves
+// are ranges of the returned primitive order. Leaves are costed in groups of group_size
+// primitives, for leaf loops that test that many at once.
+class range_bvh_builder
+{
+public:
+    static const int bin_count = 16;
+    static const int max_depth = 256;
+
+    struct primitive
+    {
+        aabb box;
+        point3 centroid;
+        uint32_t index;
+    };
+
+    // Leaf sizes are capped at what linear_bvh_node::count holds.
+    range_bvh_builder(int _max_leaf_size, double _intersection_cost, int _group_size = 1)
+        : max_leaf_size(std::min(_max_leaf_size, static_cast<int>(UINT16_MAX))),
+          intersection_cost(_intersection_cost), group_size(_group_size) {}
+
+    // Builds over prims (reordering them) and returns in order the primitive index at each
+    // leaf position.
+    void build(std::vector<primitive> &prims, std::vector<linear_bvh_node> &nodes,
+               std::vector<uint32_t> &order) const
+    {
+        nodes.clear();
+        if (!prims.empty())
+            build_range(prims, nodes, 0, prims.size(), 0);
+        order.resize(prims.size());
+        for (size_t i = 0; i < prims.size(); i++)
+            order[i] = prims[i].index;
+    }
+
+private:
+    int max_leaf_size;
+    double intersection_cost;
+    int group_size;
+
+    size_t groups(size_t count) const
+    {
+        return (count + group_size - 1) / group_size * group_size;
+    }
+
+    void build_range(std::vector<primitive> &prims, std::vector<linear_bvh_node> &nodes,
+                     size_t start, size_t end, int depth) const
+    {
+        aabb box, centroids;
+        for (size_t i = start; i < end; i++)
+        {
+            box = aabb(box, prims[i].box);
+            centroids = aabb(centroids, aabb(prims[i].centroid, prims[i].centroid));
+        }
+
+        nodes.push_back(make_linear_bvh_node(box));
+        auto index = nodes.size() - 1;
+        auto n = end - start;
+        if (n == 1 || depth >= max_depth - 1)
+        {
+            make_leaf(nodes[index], start, end);
+            return;
+        }
+
+        int best_axis = -1, best_bin = 0;
+        double best_cost = infinity;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto lo = centroids.axis(axis).min;
+            auto extent = centroids.axis(axis).size();
+            if (extent <= 0)
+                continue;
+
+            aabb bin_box[bin_count];
+            size_t bin_size[bin_count] = {};
+            for (size_t i = start; i < end; i++)
+            {
+                auto b = bin_of(prims[i].centroid[axis], lo, extent);
+                bin_box[b] = aabb(bin_box[b], prims[i].box);
+                bin_size[b]++;
+            }
+
+            double right_cost[bin_count];
+            aabb acc;
+            size_t count = 0;
+            for (int i = bin_count - 1; i > 0; i--)
+            {
+                acc = aabb(acc, bin_box[i]);
+                count += bin_size[i];
+                right_cost[i] = groups(count) * acc.surface_area();
+            }
+
+            acc = aabb();
+            count = 0;
+            for (int i = 1; i < bin_count; i++)
+            {
+                acc = aabb(acc, bin_box[i - 1]);
+                count += bin_size[i - 1];
+                if (count == 0 || count == n)
+                    continue;
+                auto cost = groups(count) * acc.surface_area() + right_cost[i];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        auto area = box.surface_area();
+        auto leaf_cost = groups(n) * intersection_cost;
+        auto split_cost = area > 0 ? 1 + best_cost / area : infinity;
+        if (n <= static_cast<size_t>(max_leaf_size) && leaf_cost <= split_cost)
+        {
+            make_leaf(nodes[index], start, end);
+            return;
+        }
+
+        size_t mid;
+        if (best_axis < 0)
+        {
+            // All centroids coincide: split the range in half.
+            mid = start + n / 2;
+        }
+        else
+        {
+            auto lo = centroids.axis(best_axis).min;
+            auto extent = centroids.axis(best_axis).size();
+            auto middle = std::partition(prims.begin() + start, prims.begin() + end,
+                                         [&](const primitive &p) {
+                                             return bin_of(p.centroid[best_axis], lo, extent) <
+                                                    best_bin;
+                                         });
+            mid = middle - prims.begin();
+        }
+
+        build_range(prims, nodes, start, mid, depth + 1);
+        nodes[index].offset = static_cast<uint32_t>(nodes.size());
+        nodes[index].axis = static_cast<uint8_t>(best_axis < 0 ? 0 : best_axis);
+        build_range(prims, nodes, mid, end, depth + 1);
+    }
+
+    static void make_leaf(linear_bvh_node &node, size_t start, size_t end)
+    {
+        // Only a leaf forced by the depth limit can be this large.
+        if (end - start > UINT16_MAX)
+        {
+            std::cerr << "range_bvh_builder: leaf of " << end - start << " primitives at depth "
+                      << max_depth << "\n";
+            std::exit(1);
+        }
+
+        node.offset = static_cast<uint32_t>(start);
+        node.count = static_cast<uint16_t>(end - start);
+    }
+
+    static int bin_of(double x, double lo, double extent)
+    {
+        int b = static_cast<int>(bin_count * (x - lo) / extent);
+        return std::min(std::max(b, 0), bin_count - 1);
+    }
+};
+
+// Full-precision flattened BVH with 32-byte nodes, built by flattening a bvh_node tree.
+// Leaves reference ranges of a primitive index array, which in turn indexes the object array.
+// Node and index arrays are plain data and can also live outside the object (see
+// bvh_cache.h).
+//
+// The builders emit nodes in depth-first order; reorder_treelets() can cluster them into
+// page-sized treelets instead.
+//
+// Subtrees of up to max_leaf_size primitives are collapsed into one leaf wherever the SAH
+// says intersecting them all is cheaper than traversing them. Inside a leaf the references
+// are sorted by type, and spheres, quads and aligned boxes are copied into contiguous arrays of
+// their own, so the leaf loop intersects them with direct calls instead of virtual ones. The
+// copies are taken at build time; like the node bounds, they do not follow later edits to the
+// objects.
+class linear_bvh : public hittable
+{
+public:
+    static const int max_depth = 256;
+    static const int mailbox_size = 8;
+    static const int default_max_leaf_size = 4;
+    // Cost of one primitive test relative to a node visit, for the leaf collapse. This assumes
+    // a sphere or quad test through the direct calls below is a few times cheaper than a
+    // visit, which pops the stack and tests two child boxes; `benchmark leaves` does not
+    // separate the settings from each other beyond noise.
+    static constexpr double intersection_cost = 0.3;
+    // Nodes per treelet: one 4 KiB page. Subtrees up to small_subtree_nodes are not split.
+    static const size_t default_treelet_nodes = 4096 / sizeof(linear_bvh_node);
+    static const uint32_t small_subtree_nodes = 15;
+
+    // Builds over the objects of list. They stay leaves even if they are BVHs themselves, so
+    // every primitive index is an index into list.objects.
+    linear_bvh(const hittable_list &list, bvh_build_method method = bvh_build_method::sah,
+               int max_leaf_size = default_max_leaf_size)
+        : objects(list.objects)
+    {
+        std::unordered_map<const hittable *, uint32_t> index_of;
+        for (size_t i = 0; i < objects.size(); i++)
+            index_of[objects[i].get()] = static_cast<uint32_t>(i);
+
+        auto root = build_bvh(list, method);
+        flatten_node(*root, 0, &index_of);
+        bbox = root->bounding_box();
+        collapse_leaves(max_leaf_size);
+        finish_owned_arrays();
+    }
+
+    // Flattens a whole bvh_node tree, including nested bvh_nodes. By default every leaf of
+    // the bvh_node tree stays a leaf.
+    explicit linear_bvh(const bvh_node &root, int max_leaf_size = 1)
+    {
+        flatten_node(root, 0, nullptr);
+        bbox = root.bounding_box();
+        collapse_leaves(max_leaf_size);
+        finish_owned_arrays();
+    }
+
+    // Takes arrays produced by another builder (see sbvh.h). With mailboxing, leaves may share
+    // primitive indices and each ray skips objects it has already tested.
+    linear_bvh(const hittable_list &list, std::vector<linear_bvh_node> nodes,
+               std::vector<uint32_t> indices, bool _mailboxing)
+        : objects(list.objects), owned_nodes(std::move(nodes)), owned_indices(std::move(indices)),
+          mailboxing(_mailboxing)
+    {
+        bbox = list.bounding_box();
+        finish_owned_arrays();
+    }
+
+    // Uses node and primitive index arrays stored elsewhere, without copying them; storage
+    // keeps that memory alive. Indices refer to list.objects.
+    linear_bvh(const hittable_list &list, const linear_bvh_node *nodes, size_t node_count,
+               const uint32_t *indices, size_t index_count, shared_ptr<const void> _storage)
+        : objects(list.objects), storage(_storage), node_ptr(nodes), index_ptr(indices),
+          nodes_size(node_count), indices_size(index_count)
+    {
+        // The index array is read-only here, so leaves keep their stored order.
+        bbox = list.bounding_box();
+        build_typed_storage();
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return traverse(r, ray_t, &cand);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return traverse(r, ray_t, nullptr);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    // Reorders the nodes into treelets of about treelet_nodes nodes that rays tend to visit
+    // together, so that a traversal touches fewer cache lines and pages. Every inner node keeps
+    // its larger (more probable) child right behind it, so the likely paths down the tree are
+    // contiguous. A treelet grows from its root by adding the most probable of the paths
+    // hanging off it until it is full; the remaining paths root the treelets placed after it.
+    // Primitive references keep their depth-first order, which keeps the primitives of nearby
+    // leaves close in memory; renumbering them along with the nodes measured slower in
+    // `benchmark layout`. Only trees whose arrays this object owns can be reordered.
+    void reorder_treelets(size_t treelet_nodes = default_treelet_nodes)
+    {
+        if (owned_nodes.empty() || node_ptr != owned_nodes.data())
+            return;
+        layout_treelets(treelet_nodes);
+        node_ptr = owned_nodes.data();
+    }
+
+    const linear_bvh_node *node_data() const { return node_ptr; }
+    size_t node_count() const { return nodes_size; }
+    const uint32_t *primitive_indices() const { return index_ptr; }
+    size_t primitive_count() const { return indices_size; }
+    const std::vector<shared_ptr<hittable>> &object_array() const { return objects; }
+    bool uses_mailboxing() const { return mailboxing; }
+
+    size_t memory_bytes() const
+    {
+        return nodes_size * sizeof(linear_bvh_node) + indices_size * sizeof(uint32_t) +
+               objects.size() * sizeof(shared_ptr<hittable>) +
+               typed_refs.size() * sizeof(uint32_t) + spheres.size() * sizeof(sphere) +
+               quads.size() * sizeof(quad) + boxes.size() * sizeof(aligned_box);
+    }
+
+private:
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<linear_bvh_node> owned_nodes;
+    std::vector<uint32_t> owned_indices;
+    shared_ptr<const void> storage;
+
+    const linear_bvh_node *node_ptr = nullptr;
+    const uint32_t *index_ptr = nullptr;
+    size_t nodes_size = 0;
+    size_t indices_size = 0;
+    bool mailboxing = false;
+    aabb bbox;
+
+    // Per primitive reference: the kind in the top two bits, below it the position in spheres,
+    // quads or boxes, or for other kinds the object index.
+    enum primitive_kind : uint32_t
+    {
+        sphere_kind = 0,
+        quad_kind = 1,
+        box_kind = 2,
+        other_kind = 3
+    };
+    static const int kind_shift = 30;
+    static const uint32_t slot_mask = (1u << kind_shift) - 1;
+
+    std::vector<uint32_t> typed_refs;
+    std::vector<sphere> spheres;
+    std::vector<quad> quads;
+    std::vector<aligned_box> boxes;
+
+    void finish_owned_arrays()
+    {
+        // Sort each leaf by kind, so a leaf loop runs through one kind after another.
+        for (const auto &node : owned_nodes)
+        {
+            if (node.count > 1)
+            {
+                auto first = owned_indices.begin() + node.offset;
+                std::stable_sort(first, first + node.count, [this](uint32_t a, uint32_t b) {
+                    return kind_of(*objects[a]) < kind_of(*objects[b]);
+                });
+            }
+        }
+
+        node_ptr = owned_nodes.data();
+        nodes_size = owned_nodes.size();
+        index_ptr = owned_indices.data();
+        indices_size = owned_indices.size();
+        build_typed_storage();
+    }
+
+    static primitive_kind kind_of(const hittable &object)
+    {
+        // Exact types only: a subclass copied into one of the arrays would be sliced.
+        if (typeid(object) == typeid(sphere))
+            return sphere_kind;
+        if (typeid(object) == typeid(quad))
+            return quad_kind;
+        if (typeid(object) == typeid(aligned_box))
+            return box_kind;
+        return other_kind;
+    }
+
+    void build_typed_storage()
+    {
+        spheres.clear();
+        quads.clear();
+        boxes.clear();
+        typed_refs.resize(indices_size);
+        for (size_t i = 0; i < indices_size; i++)
+        {
+            const auto &object = *objects[index_ptr[i]];
+            auto kind = kind_of(object);
+            uint32_t slot = index_ptr[i];
+            if (kind == sphere_kind)
+            {
+                slot = static_cast<uint32_t>(spheres.size());
+                spheres.push_back(static_cast<const sphere &>(object));
+            }
+            else if (kind == quad_kind)
+            {
+                slot = static_cast<uint32_t>(quads.size());
+                quads.push_back(static_cast<const quad &>(object));
+            }
+            else if (kind == box_kind)
+            {
+                slot = static_cast<uint32_t>(boxes.size());
+                boxes.push_back(static_cast<const aligned_box &>(object));
+            }
+            typed_refs[i] = static_cast<uint32_t>(kind) << kind_shift | slot;
+        }
+    }
+
+    // Closest hit with cand, any hit without; direct calls for spheres, quads and boxes, which
+    // the compiler can inline into the leaf loop.
+    bool intersect_primitive(size_t i, const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        auto ref = typed_refs[i];
+        auto slot = ref & slot_mask;
+        switch (ref >> kind_shift)
+        {
+        case sphere_kind:
+            return cand ? spheres[slot].sphere::intersect(r, ray_t, *cand)
+                        : spheres[slot].sphere::occluded(r, ray_t);
+        case quad_kind:
+            return cand ? quads[slot].quad::intersect(r, ray_t, *cand)
+                        : quads[slot].quad::occluded(r, ray_t);
+        case box_kind:
+            return cand ? boxes[slot].aligned_box::intersect(r, ray_t, *cand)
+                        : boxes[slot].aligned_box::occluded(r, ray_t);
+        default:
+            return cand ? objects[slot]->intersect(r, ray_t, *cand)
+                        : objects[slot]->occluded(r, ray_t);
+        }
+    }
+
+    static double node_area(const linear_bvh_node &node)
+    {
+        double e[3];
+        for (int a = 0; a < 3; a++)
+            e[a] = fmax(0.0, static_cast<double>(node.bounds_max[a]) - node.bounds_min[a]);
+        return 2 * (e[0] * e[1] + e[1] * e[2] + e[2] * e[0]);
+    }
+
+    // Replaces every subtree of at most max_leaf_size references with a single leaf where
+    // the SAH favors it: n primitive tests against a node visit plus the children's cost.
+    void collapse_leaves(int max_leaf_size)
+    {
+        if (max_leaf_size <= 1 || owned_nodes.empty())
+            return;
+
+        // Collapsed leaves must fit linear_bvh_node::count, like every other leaf does.
+        auto leaf_limit = std::min<size_t>(max_leaf_size, UINT16_MAX);
+
+        // Children follow their parent in the array, so a backwards pass sees them first.
+        auto n = owned_nodes.size();
+        std::vector<double> cost(n);
+        std::vector<size_t> count(n);
+        std::vector<bool> collapse(n, false);
+        for (size_t i = n; i-- > 0;)
+        {
+            const auto &node = owned_nodes[i];
+            if (node.count > 0)
+            {
+                count[i] = node.count;
+                cost[i] = node.count * intersection_cost;
+                continue;
+            }
+
+            auto area = node_area(node);
+            auto second = node.offset;
+            count[i] = count[i + 1] + count[second];
+            auto children_cost = area > 0 ? (node_area(owned_nodes[i + 1]) * cost[i + 1] +
+                                             node_area(owned_nodes[second]) * cost[second]) / area
+                                          : cost[i + 1] + cost[second];
+            auto leaf_cost = count[i] * intersection_cost;
+            collapse[i] = count[i] <= leaf_limit && leaf_cost <= 1 + children_cost;
+            cost[i] = collapse[i] ? leaf_cost : 1 + children_cost;
+        }
+
+        std::vector<linear_bvh_node> nodes;
+        std::vector<uint32_t> indices;
+        rebuild_collapsed(0, collapse, nodes, indices);
+        owned_nodes.swap(nodes);
+        owned_indices.swap(indices);
+    }
+
+    void layout_treelets(size_t treelet_nodes)
+    {
+        struct path
+        {
+            double area;     // of its first node, proportional to the probability of a visit
+            uint32_t node;   // first node, in owned_nodes
+            uint32_t parent; // new index of the node whose offset points here
+        };
+        auto less_probable = [](const path &a, const path &b) { return a.area < b.area; };
+
+        // Small subtrees are kept whole, so sibling leaves at the bottom stay together.
+        std::vector<uint32_t> subtree_size(owned_nodes.size(), 1);
+        for (size_t i = owned_nodes.size(); i-- > 0;)
+        {
+            if (owned_nodes[i].count == 0)
+                subtree_size[i] += subtree_size[i + 1] + subtree_size[owned_nodes[i].offset];
+        }
+
+        std::vector<linear_bvh_node> nodes;
+        nodes.reserve(owned_nodes.size());
+
+        std::vector<path> roots = {{0, 0, UINT32_MAX}};
+        while (!roots.empty())
+        {
+            std::vector<path> frontier = {roots.back()};
+            roots.pop_back();
+
+            size_t size = 0;
+            while (!frontier.empty() && size < treelet_nodes)
+            {
+                std::pop_heap(frontier.begin(), frontier.end(), less_probable);
+                auto next = frontier.back();
+                frontier.pop_back();
+                if (next.parent != UINT32_MAX)
+                    nodes[next.parent].offset = static_cast<uint32_t>(nodes.size());
+
+                // Walk down the path, continuing with the larger child at every inner node.
+                auto index = next.node;
+                while (subtree_size[index] > small_subtree_nodes)
+                {
+                    uint32_t first, second;
+                    emit_heavy_first(index, nodes, first, second);
+                    frontier.push_back({node_area(owned_nodes[second]), second,
+                                        static_cast<uint32_t>(nodes.size() - 1)});
+                    std::push_heap(frontier.begin(), frontier.end(), less_probable);
+                    index = first;
+                    size++;
+                }
+                size += subtree_size[index];
+                emit_subtree(index, nodes);
+            }
+
+            // The most probable leftover path roots the next treelet.
+            std::sort(frontier.begin(), frontier.end(), less_probable);
+            roots.insert(roots.end(), frontier.begin(), frontier.end());
+        }
+
+        owned_nodes.swap(nodes);
+    }
+
+    // Appends inner node index with its larger child as the first one, and returns the
+    // children in their new order.
+    void emit_heavy_first(uint32_t index, std::vector<linear_bvh_node> &nodes, uint32_t &first,
+                          uint32_t &second) const
+    {
+        auto node = owned_nodes[index];
+        first = index + 1;
+        second = node.offset;
+        if (node_area(owned_nodes[second]) > node_area(owned_nodes[first]))
+        {
+            std::swap(first, second);
+            node.flags ^= linear_bvh_node::swapped;
+        }
+        nodes.push_back(node);
+    }
+
+    void emit_subtree(uint32_t index, std::vector<linear_bvh_node> &nodes) const
+    {
+        if (owned_nodes[index].count > 0)
+        {
+            nodes.push_back(owned_nodes[index]);
+            return;
+        }
+
+        uint32_t first, second;
+        emit_heavy_first(index, nodes, first, second);
+        auto position = nodes.size() - 1;
+        emit_subtree(first, nodes);
+        nodes[position].offset = static_cast<uint32_t>(nodes.size());
+        emit_subtree(second, nodes);
+    }
+
+    void gather_references(uint32_t index, std::vector<uint32_t> &out) const
+    {
+        const auto &node = owned_nodes[index];
+        if (node.count > 0)
+        {
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+            {
+                // Spatial splits can put the same object in sibling leaves; once is enough.
+                if (std::find(out.begin(), out.end(), owned_indices[i]) == out.end())
+                    out.push_back(owned_indices[i]);
+            }
+            return;
+        }
+        gather_references(index + 1, out);
+        gather_references(node.offset, out);
+    }
+
+    void rebuild_collapsed(uint32_t index, const std::vector<bool> &collapse,
+                           std::vector<linear_bvh_node> &nodes,
+                           std::vector<uint32_t> &indices) const
+    {
+        auto node = owned_nodes[index];
+        if (node.count > 0 || collapse[index])
+        {
+            std::vector<uint32_t> refs;
+            gather_references(index, refs);
+            node.offset = static_cast<uint32_t>(indices.size());
+            node.count = static_cast<uint16_t>(refs.size());
+            indices.insert(indices.end(), refs.begin(), refs.end());
+            nodes.push_back(node);
+            return;
+        }
+
+        auto position = nodes.size();
+        nodes.push_back(node);
+        rebuild_collapsed(index + 1, collapse, nodes, indices);
+        nodes[position].offset = static_cast<uint32_t>(nodes.size());
+        rebuild_collapsed(node.offset, collapse, nodes, indices);
+    }
+
+    // With cand == nullptr this is an any-hit query and returns on the first intersection.
+    bool traverse(const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        precomputed_ray pr(r);
+
+        bool hit_anything = false;
+        uint32_t mailbox[mailbox_size];
+        int mailbox_next = 0;
+        if (mailboxing)
+            std::fill(mailbox, mailbox + mailbox_size, UINT32_MAX);
+
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t index = 0;
+
+        while (true)
+        {
+            RT_STATS_COUNT(stat_nodes);
+            const auto &node = node_ptr[index];
+            double lo[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+            double hi[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+            double tnear;
+
+            if (slab_hit(lo, hi, pr, ray_t, tnear))
+            {
+                if (node.count > 0)
+                {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        auto object_index = index_ptr[i];
+                        if (mailboxing)
+                        {
+                            // A repeated test could only repeat the earlier result, since
+                            // ray_t never grows.
+                            if (std::find(mailbox, mailbox + mailbox_size, object_index) !=
+                                mailbox + mailbox_size)
+                                continue;
+                            mailbox[mailbox_next++ % mailbox_size] = object_index;
+                        }
+
+                        if (!intersect_primitive(i, r, ray_t, cand))
+                            continue;
+                        if (!cand)
+                            return true;
+                        hit_anything = true;
+                        ray_t.max = cand->t;
+                    }
+                }
+                else
+                {
+                    // Visit the child on the near side of the split axis first.
+                    if (pr.sign[node.axis] != ((node.flags & linear_bvh_node::swapped) != 0))
+                    {
+                        stack[stack_size++] = index + 1;
+                        index = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        index = index + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            index = stack[--stack_size];
+        }
+        return hit_anything;
+    }
+
+    uint32_t emit_node(const aabb &box)
+    {
+        owned_nodes.push_back(make_linear_bvh_node(box));
+        return static_cast<uint32_t>(owned_nodes.size() - 1);
+    }
+
+    using object_index_map = std::unordered_map<const hittable *, uint32_t>;
+
+    uint32_t flatten(const shared_ptr<hittable> &object, int depth, const object_index_map *leaves)
+    {
+        auto found = leaves ? leaves->find(object.get()) : object_index_map::const_iterator();
+        bool is_leaf = leaves && found != leaves->end();
+
+        if (!is_leaf)
+        {
+            if (auto node = dynamic_cast<const bvh_node *>(object.get()))
+                return flatten_node(*node, depth, leaves);
+        }
+
+        auto index = emit_node(object->bounding_box());
+        owned_nodes[index].offset = static_cast<uint32_t>(owned_indices.size());
+        owned_nodes[index].count = 1;
+        if (is_leaf)
+            owned_indices.push_back(found->second);
+        else
+        {
+            owned_indices.push_back(static_cast<uint32_t>(objects.size()));
+            objects.push_back(object);
+        }
+        return index;
+    }
+
+    uint32_t flatten_node(const bvh_node &node, int depth, const object_index_map *leaves)
+    {
+        if (node.left_child() == node.right_child())
+            return flatten(node.left_child(), depth, leaves);
+        if (depth >= max_depth - 1)
+        {
+            std::cerr << "linear_bvh: tree deeper than " << max_depth << " levels\n";
+            std::exit(1);
+        }
+
+        auto index = emit_node(node.bounding_box());
+
+        // Order the children along the axis that separates their centers the most.
+        auto delta = node.right_child()->bounding_box().center() -
+                     node.left_child()->bounding_box().center();
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+        {
+            if (fabs(delta[a]) > fabs(delta[axis]))
+                axis = a;
+        }
+        bool swapped = delta[axis] < 0;
+        const auto &first = swapped ? node.right_child() : node.left_child();
+        const auto &second = swapped ? node.left_child() : node.right_child();
+
+        flatten(first, depth + 1, leaves);
+        auto second_index = flatten(second, depth + 1, leaves);
+        owned_nodes[index].offset = second_index;
+        owned_nodes[index].axis = static_cast<uint8_t>(axis);
+        return index;
+    }
+};
+
+#endif
@@ -6,11 +6,46 @@
 #include "texture.h"
 #include "onb.h"
 
+#include <cstdint>
+
+// The materials below, for material_table (material_table.h), which shades them with a switch
+// on the kind instead of virtual calls. Any other material is compiled as other_material and
+// shaded through its own virtual functions.
+enum class material_kind : uint8_t
+{
+    lambertian_material,
+    metal_material,
+    dielectric_material,
+    diffuse_light_material,
+    isotropic_material,
+    other_material
+};
+
+// Parameters of a material in compiled form. A texture that is a solid color is stored as
+// that color; any other texture is referenced and evaluated through texture::value().
+struct compiled_material
+{
+    material_kind kind = material_kind::other_material;
+    color albedo;                            // reflectance, or radiance for diffuse_light
+    const texture *albedo_texture = nullptr; // set when the albedo varies over the surface
+    double fuzz = 0;
+    double ir = 1;
+
+    void set_albedo(const shared_ptr<texture> &tex)
+    {
+        if (!tex->constant(albedo))
+            albedo_texture = tex.get();
+    }
+};
+
 class material
 {
 public:
     virtual ~material() = default;
 
+    // Describes the material for material_table; by default as other_material.
+    virtual void compile(compiled_material &out) const {}
+
     virtual bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, double &pdf) const
     {
         return false;
@@ -30,6 +65,12 @@ public:
     {
         return color(0, 0, 0);
     }
+
+private:
+    // Where the material_table that added this material last keeps it, so that the table
+    // finds a hit's material without a hash lookup.
+    friend class material_table;
+    mutable uint32_t table_slot = UINT32_MAX;
 };
 
 class lambertian : public material
@@ -40,16 +81,31 @@ public:
 
     bool scatter(const ray &r_in, const hit_record &rec, color &alb, ray &scattered, double &pdf)
         const override
+    {
+        scatter_cosine(r_in, rec, scattered, pdf);
+        alb = albedo->value(rec.u, rec.v, rec.p);
+        return true;
+    }
+    double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override
+    {
+        return cosine_pdf(rec, scattered);
+    }
+    void compile(compiled_material &out) const override
+    {
+        out.kind = material_kind::lambertian_material;
+        out.set_albedo(albedo);
+    }
+
+    // The scattering itself, shared with material_table.
+    static void scatter_cosine(const ray &r_in, const hit_record &rec, ray &scattered, double &pdf)
     {
         onb uvw;
         uvw.build_from_w(rec.normal);
         auto direction = uvw.local(random_cosine_direction());
         scattered = ray(rec.p, unit_vector(direction), r_in.time());
-        alb = albedo->value(rec.u, rec.v, rec.p);
         pdf = dot(uvw.w(), scattered.direction()) / pi;
-        return true;
     }
-    double scattering_pdf(const ray &r_in, const hit_record &rec, const ray &scattered) const override
+    static double cosine_pdf(const hit_record &rec, const ray &scattered)
     {
         auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
         return cosine < 0 ? 0 : cosine / pi;
@@ -65,10 +121,21 @@ public:
 
     bool scatter(const ray &r_in, const hit_record &rec, color &attenuation, ray &scattered, double &pdf)
         const override
+    {
+        attenuation = albedo;
+        return scatter_fuzzed(r_in, rec, fuzz, scattered);
+    }
+    void compile(compiled_material &out) const override
+    {
+        out.kind = material_kind::metal_material;
+        out.albedo = albedo;
+        out.fuzz = fuzz;
+    }
+
+    static bool scatter_fuzzed(const ray &r_in, const hit_record &rec, double fuzz, ray &scattered)
     {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
         scattered = ray(rec.p, reflected + fuzz * random_unit_vector(), r_in.time());
-        attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
 
@@ -86,6 +153,17 @@ public:
         const override
     {
         attenuation = color(1.0, 1.0, 1.0);
+        scatter_refracted(r_in, rec, ir, scattered);
+        return true;
+    }
+    void compile(compiled_material &out) const override
+    {
+        out.kind = material_kind::dielectric_material;
+        out.ir = ir;
+    }
+
+    static void scatter_refracted(const ray &r_in, const hit_record &rec, double ir, ray &scattered)
+    {
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
         vec3 unit_direction = unit_vector(r_in.direction());
@@ -101,7 +179,6 @@ public:
             direction = refract(unit_direction, rec.normal, refraction_ratio);
 
         scattered = ray(rec.p, direction, r_in.time());
-        return true;
     }
 
 private:
@@ -131,6 +208,11 @@ public:
         else
             return emit->value(u, v, p);
     }
+    void compile(compiled_material &out) const override
+    {
+        out.kind = material_kind::diffuse_light_material;
+        out.set_albedo(emit);
+    }
 
 private:
     shared_ptr<texture> emit;
@@ -148,6 +230,11 @@ public:
         attenuation = albedo->value(rec.u, rec.v, rec.p);
         return true;
     }
+    void compile(compiled_material &out) const override
+    {
+        out.kind = material_kind::isotropic_material;
+        out.set_albedo(albedo);
+    }
 
 private:
     shared_ptr<texture> albedo;
@@ -0,0 +1,151 @@
+#ifndef MATERIAL_TABLE_H
+#define MATERIAL_TABLE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+
+#include <cstdint>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+
+// Compiled form of a scene's materials: one entry per material, with its kind and parameters
+// in separate arrays, and shading by a switch on the kind. The code of each kind is the
+// material's own (the static scatter functions in material.h) and can be inlined here, and
+// solid-color albedos are read straight from the table instead of through texture::value().
+// Sorting hits by material id lets a renderer shade all hits of one material together.
+//
+// The table refers to the materials and their textures without owning them; like
+// hit_record::mat, it is valid as long as the scene is.
+class material_table
+{
+public:
+    // Adds m, once; returns its id.
+    uint32_t add(const material *m)
+    {
+        auto found = ids.find(m);
+        if (found != ids.end())
+            return found->second;
+
+        compiled_material compiled;
+        m->compile(compiled);
+        // Exact types only: a subclass inherits compile() but may shade differently.
+        if (compiled.kind != material_kind::other_material &&
+            typeid(*m) != class_of(compiled.kind))
+            compiled = compiled_material();
+        auto id = static_cast<uint32_t>(sources.size());
+        kinds.push_back(compiled.kind);
+        albedos.push_back(compiled.albedo);
+        albedo_textures.push_back(compiled.albedo_texture);
+        fuzzes.push_back(compiled.fuzz);
+        irs.push_back(compiled.ir);
+        sources.push_back(m);
+        ids.emplace(m, id);
+        m->table_slot = id;
+        return id;
+    }
+
+    // Id of a material that has been added.
+    uint32_t index_of(const material *m) const
+    {
+        auto slot = m->table_slot;
+        if (slot < sources.size() && sources[slot] == m)
+            return slot;
+        return ids.at(m); // m was last added to another table
+    }
+
+    size_t size() const { return sources.size(); }
+    material_kind kind(uint32_t id) const { return kinds[id]; }
+
+    bool scatter(uint32_t id, const ray &r_in, const hit_record &rec, color &attenuation,
+                 ray &scattered, double &pdf) const
+    {
+        switch (kinds[id])
+        {
+        case material_kind::lambertian_material:
+            lambertian::scatter_cosine(r_in, rec, scattered, pdf);
+            attenuation = albedo_at(id, rec);
+            return true;
+        case material_kind::metal_material:
+            attenuation = albedos[id];
+            return metal::scatter_fuzzed(r_in, rec, fuzzes[id], scattered);
+        case material_kind::dielectric_material:
+            attenuation = color(1.0, 1.0, 1.0);
+            dielectric::scatter_refracted(r_in, rec, irs[id], scattered);
+            return true;
+        case material_kind::diffuse_light_material:
+            return false;
+        case material_kind::isotropic_material:
+            scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
+            attenuation = albedo_at(id, rec);
+            return true;
+        default:
+            return sources[id]->scatter(r_in, rec, attenuation, scattered, pdf);
+        }
+    }
+
+    double scattering_pdf(uint32_t id, const ray &r_in, const hit_record &rec,
+                          const ray &scattered) const
+    {
+        switch (kinds[id])
+        {
+        case material_kind::lambertian_material:
+            return lambertian::cosine_pdf(rec, scattered);
+        case material_kind::other_material:
+            return sources[id]->scattering_pdf(r_in, rec, scattered);
+        default:
+            return 0;
+        }
+    }
+
+    color emitted(uint32_t id, const ray &r_in, const hit_record &rec) const
+    {
+        switch (kinds[id])
+        {
+        case material_kind::diffuse_light_material:
+            return rec.front_face ? albedo_at(id, rec) : color(0, 0, 0);
+        case material_kind::other_material:
+            return sources[id]->emitted(r_in, rec, rec.u, rec.v, rec.p);
+        default:
+            return color(0, 0, 0);
+        }
+    }
+
+private:
+    std::vector<material_kind> kinds;
+    std::vector<color> albedos;
+    std::vector<const texture *> albedo_textures;
+    std::vector<double> fuzzes;
+    std::vector<double> irs;
+    std::vector<const material *> sources;
+    std::unordered_map<const material *, uint32_t> ids;
+
+    static const std::type_info &class_of(material_kind kind)
+    {
+        switch (kind)
+        {
+        case material_kind::lambertian_material:
+            return typeid(lambertian);
+        case material_kind::metal_material:
+            return typeid(metal);
+        case material_kind::dielectric_material:
+            return typeid(dielectric);
+        case material_kind::diffuse_light_material:
+            return typeid(diffuse_light);
+        case material_kind::isotropic_material:
+            return typeid(isotropic);
+        default:
+            return typeid(material);
+        }
+    }
+
+    color albedo_at(uint32_t id, const hit_record &rec) const
+    {
+        auto tex = albedo_textures[id];
+        return tex ? tex->value(rec.u, rec.v, rec.p) : albedos[id];
+    }
+};
+
+#endif
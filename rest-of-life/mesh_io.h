@@ -0,0 +1,978 @@
+#ifndef MESH_IO_H
+#define MESH_IO_H
+
+#include "rtweekend.h"
+
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Mesh loaders for large assets, both reading straight out of a read-only mapping of the file
+// into mesh_buffers that are sized once up front, with no per-face allocations.
+//
+//   load_ply - binary little-endian PLY. The vertex and face records have fixed offsets, so
+//              both are converted in parallel loops over the mapping. Faces that are not all
+//              triangles fall back to a serial walk that fan-triangulates them.
+//   load_obj - Wavefront OBJ. The file is cut into chunks at line breaks; a first parallel
+//              pass counts each chunk's vertices and triangles, a prefix sum gives every chunk
+//              its place in the buffers, and a second parallel pass parses into them.
+//
+// mesh_buffers holds one normal and uv per position. OBJ corners that pair a position with
+// different texture coordinates or normals, as at seams and hard edges, get a vertex for each
+// distinct (v, vt, vn) triple; positions that only ever appear with one keep their index.
+//
+// On failure the loaders print the reason to std::cerr and return nullptr.
+
+// Read-only mapping of a whole file, unmapped when destroyed.
+class mapped_file
+{
+public:
+    explicit mapped_file(const std::string &path)
+    {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            auto size = static_cast<size_t>(st.st_size);
+            void *base = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (base != MAP_FAILED)
+            {
+                // Start reading ahead right away; the parsers touch the whole file.
+                madvise(base, size, MADV_WILLNEED);
+                data = static_cast<const char *>(base);
+                length = size;
+            }
+        }
+        close(fd);
+    }
+
+    ~mapped_file()
+    {
+        if (data)
+            munmap(const_cast<char *>(data), length);
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    bool is_open() const { return data != nullptr; }
+    const char *begin() const { return data; }
+    const char *end() const { return data + length; }
+    size_t size() const { return length; }
+
+private:
+    const char *data = nullptr;
+    size_t length = 0;
+};
+
+inline int mesh_io_threads()
+{
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// PLY
+
+enum class ply_type
+{
+    int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid
+};
+
+inline ply_type ply_type_from_name(const std::string &name)
+{
+    if (name == "char" || name == "int8")
+        return ply_type::int8;
+    if (name == "uchar" || name == "uint8")
+        return ply_type::uint8;
+    if (name == "short" || name == "int16")
+        return ply_type::int16;
+    if (name == "ushort" || name == "uint16")
+        return ply_type::uint16;
+    if (name == "int" || name == "int32")
+        return ply_type::int32;
+    if (name == "uint" || name == "uint32")
+        return ply_type::uint32;
+    if (name == "float" || name == "float32")
+        return ply_type::float32;
+    if (name == "double" || name == "float64")
+        return ply_type::float64;
+    return ply_type::invalid;
+}
+
+inline size_t ply_type_size(ply_type type)
+{
+    switch (type)
+    {
+    case ply_type::int8:
+    case ply_type::uint8:
+        return 1;
+    case ply_type::int16:
+    case ply_type::uint16:
+        return 2;
+    case ply_type::int32:
+    case ply_type::uint32:
+    case ply_type::float32:
+        return 4;
+    case ply_type::float64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+// One little-endian scalar from unaligned memory. Only little-endian hosts are supported.
+template <typename T>
+inline T ply_load(const char *p)
+{
+    T value;
+    std::memcpy(&value, p, sizeof(T));
+    return value;
+}
+
+inline double ply_read(const char *p, ply_type type)
+{
+    switch (type)
+    {
+    case ply_type::int8:
+        return ply_load<int8_t>(p);
+    case ply_type::uint8:
+        return ply_load<uint8_t>(p);
+    case ply_type::int16:
+        return ply_load<int16_t>(p);
+    case ply_type::uint16:
+        return ply_load<uint16_t>(p);
+    case ply_type::int32:
+        return ply_load<int32_t>(p);
+    case ply_type::uint32:
+        return ply_load<uint32_t>(p);
+    case ply_type::float32:
+        return ply_load<float>(p);
+    case ply_type::float64:
+        return ply_load<double>(p);
+    default:
+        return 0;
+    }
+}
+
+inline int64_t ply_read_integer(const char *p, ply_type type)
+{
+    switch (type)
+    {
+    case ply_type::int8:
+        return ply_load<int8_t>(p);
+    case ply_type::uint8:
+        return ply_load<uint8_t>(p);
+    case ply_type::int16:
+        return ply_load<int16_t>(p);
+    case ply_type::uint16:
+        return ply_load<uint16_t>(p);
+    case ply_type::int32:
+        return ply_load<int32_t>(p);
+    case ply_type::uint32:
+        return ply_load<uint32_t>(p);
+    default:
+        return -1; // float indices are not valid
+    }
+}
+
+struct ply_property
+{
+    std::string name;
+    ply_type type;                           // the scalar, or the list entries
+    ply_type count_type = ply_type::invalid; // lists only
+    size_t offset = 0; // bytes of the scalar properties before it in a record
+};
+
+struct ply_element
+{
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+    int list_property = -1; // index of the one list property, if any
+    size_t scalar_size = 0; // bytes of all scalar properties
+
+    const ply_property *find(std::initializer_list<const char *> names) const
+    {
+        for (auto name : names)
+        {
+            for (const auto &property : properties)
+            {
+                if (property.name == name && property.count_type == ply_type::invalid)
+                    return &property;
+            }
+        }
+        return nullptr;
+    }
+};
+
+inline shared_ptr<mesh_buffers> ply_fail(const std::string &path, const char *reason)
+{
+    std::cerr << "ERROR: Could not load PLY file '" << path << "': " << reason << ".\n";
+    return nullptr;
+}
+
+inline bool ply_read_vertices(const ply_element &vertex, const char *data, mesh_buffers &mesh)
+{
+    auto x = vertex.find({"x"}), y = vertex.find({"y"}), z = vertex.find({"z"});
+    if (!x || !y || !z)
+        return false;
+    auto nx = vertex.find({"nx"}), ny = vertex.find({"ny"}), nz = vertex.find({"nz"});
+    auto u = vertex.find({"u", "s", "texture_u", "texture_s"});
+    auto v = vertex.find({"v", "t", "texture_v", "texture_t"});
+    bool normals = nx && ny && nz;
+    bool uvs = u && v;
+
+    auto n = static_cast<long>(vertex.count);
+    auto stride = vertex.scalar_size;
+    mesh.positions.resize(n);
+    if (normals)
+        mesh.normals.resize(n);
+    if (uvs)
+        mesh.uvs.resize(n);
+
+    #pragma omp parallel for schedule(static)
+    for (long i = 0; i < n; i++)
+    {
+        auto record = data + i * stride;
+        mesh.positions[i] = point3(ply_read(record + x->offset, x->type),
+                                   ply_read(record + y->offset, y->type),
+                                   ply_read(record + z->offset, z->type));
+        if (normals)
+            mesh.normals[i] = vec3(ply_read(record + nx->offset, nx->type),
+                                   ply_read(record + ny->offset, ny->type),
+                                   ply_read(record + nz->offset, nz->type));
+        if (uvs)
+            mesh.uvs[i] = vec3(ply_read(record + u->offset, u->type),
+                               ply_read(record + v->offset, v->type), 0);
+    }
+    return true;
+}
+
+// Reads the faces starting at data into mesh.indices and returns the end of the face records,
+// or nullptr if they run past end or reference missing vertices.
+inline const char *ply_read_faces(const ply_element &face, const char *data, const char *end,
+                                  mesh_buffers &mesh)
+{
+    const auto &list = face.properties[face.list_property];
+    auto count_size = ply_type_size(list.count_type);
+    auto index_size = ply_type_size(list.type);
+    auto before = list.offset;
+    auto after = face.scalar_size - before;
+    auto vertices = static_cast<int64_t>(mesh.positions.size());
+
+    // Fast path: all faces are triangles, so every record has the same size and offset.
+    auto n = static_cast<long>(face.count);
+    auto stride = before + count_size + 3 * index_size + after;
+    bool triangles = static_cast<size_t>(end - data) / stride >= face.count;
+    if (triangles)
+    {
+        #pragma omp parallel for schedule(static) reduction(&& : triangles)
+        for (long i = 0; i < n; i++)
+            triangles = triangles && ply_read_integer(data + i * stride + before,
+                                                      list.count_type) == 3;
+    }
+
+    bool bad = false;
+    if (triangles)
+    {
+        mesh.indices.resize(3 * face.count);
+        #pragma omp parallel for schedule(static) reduction(|| : bad)
+        for (long i = 0; i < n; i++)
+        {
+            auto entries = data + i * stride + before + count_size;
+            for (int k = 0; k < 3; k++)
+            {
+                auto index = ply_read_integer(entries + k * index_size, list.type);
+                bad = bad || index < 0 || index >= vertices;
+                mesh.indices[3 * i + k] = static_cast<uint32_t>(index);
+            }
+        }
+        return bad ? nullptr : data + face.count * stride;
+    }
+
+    // General faces: one serial walk to size the index buffer, one to fan-triangulate.
+    size_t triangle_count = 0;
+    auto p = data;
+    for (size_t i = 0; i < face.count; i++)
+    {
+        if (end - p < static_cast<ptrdiff_t>(before + count_size))
+            return nullptr;
+        auto corners = ply_read_integer(p + before, list.count_type);
+        auto size = before + count_size + corners * index_size + after;
+        if (corners < 0 || static_cast<size_t>(end - p) < size)
+            return nullptr;
+        triangle_count += corners > 2 ? corners - 2 : 0;
+        p += size;
+    }
+
+    mesh.indices.resize(3 * triangle_count);
+    size_t t = 0;
+    p = data;
+    for (size_t i = 0; i < face.count; i++)
+    {
+        auto corners = ply_read_integer(p + before, list.count_type);
+        auto entries = p + before + count_size;
+        for (int64_t k = 0; k < corners; k++)
+        {
+            auto index = ply_read_integer(entries + k * index_size, list.type);
+            if (index < 0 || index >= vertices)
+                return nullptr;
+            if (k >= 2)
+            {
+                mesh.indices[t++] = static_cast<uint32_t>(ply_read_integer(entries, list.type));
+                mesh.indices[t++] = static_cast<uint32_t>(
+                    ply_read_integer(entries + (k - 1) * index_size, list.type));
+                mesh.indices[t++] = static_cast<uint32_t>(index);
+            }
+        }
+        p = entries + corners * index_size + after;
+    }
+    return p;
+}
+
+inline shared_ptr<mesh_buffers> load_ply(const std::string &path)
+{
+    mapped_file file(path);
+    if (!file.is_open())
+        return ply_fail(path, "cannot map the file");
+
+    static const char end_header[] = "end_header";
+    auto header_end = std::search(file.begin(), file.end(), end_header,
+                                  end_header + sizeof(end_header) - 1);
+    if (header_end == file.end() || file.size() < 4 || std::memcmp(file.begin(), "ply", 3) != 0)
+        return ply_fail(path, "not a PLY file");
+    auto data = static_cast<const char *>(std::memchr(header_end, '\n', file.end() - header_end));
+    if (!data)
+        return ply_fail(path, "truncated header");
+    data++;
+
+    // The header is a few lines of text; parse it the easy way.
+    std::istringstream header(std::string(file.begin(), header_end));
+    std::vector<ply_element> elements;
+    bool binary_little_endian = false;
+    std::string line;
+    while (std::getline(header, line))
+    {
+        std::istringstream words(line);
+        std::string keyword;
+        words >> keyword;
+        if (keyword == "format")
+        {
+            std::string format;
+            words >> format;
+            uint16_t probe = 1;
+            binary_little_endian = format == "binary_little_endian" &&
+                                   *reinterpret_cast<char *>(&probe) == 1;
+        }
+        else if (keyword == "element")
+        {
+            elements.emplace_back();
+            words >> elements.back().name >> elements.back().count;
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            auto &element = elements.back();
+            ply_property property;
+            std::string type;
+            words >> type;
+            if (type == "list")
+            {
+                std::string count_type, entry_type;
+                words >> count_type >> entry_type;
+                property.count_type = ply_type_from_name(count_type);
+                property.type = ply_type_from_name(entry_type);
+                if (property.count_type == ply_type::invalid || element.list_property >= 0)
+                    return ply_fail(path, "unsupported list property");
+                element.list_property = static_cast<int>(element.properties.size());
+            }
+            else
+                property.type = ply_type_from_name(type);
+            words >> property.name;
+            if (property.type == ply_type::invalid)
+                return ply_fail(path, "unknown property type");
+
+            if (property.count_type == ply_type::invalid)
+            {
+                property.offset = element.scalar_size;
+                element.scalar_size += ply_type_size(property.type);
+            }
+            else
+                property.offset = element.scalar_size;
+            element.properties.push_back(property);
+        }
+    }
+
+    if (!binary_little_endian)
+        return ply_fail(path, "only binary_little_endian is supported");
+
+    auto mesh = make_shared<mesh_buffers>();
+    bool have_vertices = false;
+    for (const auto &element : elements)
+    {
+        if (element.name == "vertex")
+        {
+            // A vertex needs scalar x, y and z; without any scalar property the size check below
+            // would divide by zero.
+            if (element.list_property >= 0 || element.scalar_size == 0 ||
+                static_cast<size_t>(file.end() - data) / element.scalar_size < element.count)
+                return ply_fail(path, "bad vertex element");
+            if (!ply_read_vertices(element, data, *mesh))
+                return ply_fail(path, "vertices have no x, y and z");
+            data += element.count * element.scalar_size;
+            have_vertices = true;
+        }
+        else if (element.name == "face")
+        {
+            const auto &list = element.properties[std::max(element.list_property, 0)];
+            if (!have_vertices || element.list_property < 0 ||
+                (list.name != "vertex_indices" && list.name != "vertex_index"))
+                return ply_fail(path, "faces must list vertex_indices after the vertices");
+            data = ply_read_faces(element, data, file.end(), *mesh);
+            if (!data)
+                return ply_fail(path, "bad face data");
+        }
+        else if (element.list_property < 0)
+        {
+            if (static_cast<size_t>(file.end() - data) / std::max<size_t>(element.scalar_size, 1) <
+                element.count)
+                return ply_fail(path, "truncated data");
+            data += element.count * element.scalar_size;
+        }
+        else if (have_vertices && !mesh->indices.empty())
+            break; // variable-size elements after the mesh are not needed
+        else
+            return ply_fail(path, "unsupported list element before the faces");
+    }
+    return mesh;
+}
+
+// Binary little-endian PLY with float positions, normals and uvs when present, and triangle
+// faces as uchar counts with int indices.
+inline bool save_ply(const std::string &path, const mesh_buffers &mesh)
+{
+    FILE *file = std::fopen(path.c_str(), "wb");
+    if (file == NULL)
+        return false;
+
+    std::fprintf(file, "ply\nformat binary_little_endian 1.0\nelement vertex %zu\n"
+                       "property float x\nproperty float y\nproperty float z\n",
+                 mesh.positions.size());
+    if (!mesh.normals.empty())
+        std::fprintf(file, "property float nx\nproperty float ny\nproperty float nz\n");
+    if (!mesh.uvs.empty())
+        std::fprintf(file, "property float u\nproperty float v\n");
+    std::fprintf(file, "element face %zu\nproperty list uchar int vertex_indices\nend_header\n",
+                 mesh.triangle_count());
+
+    bool ok = true;
+    std::vector<char> buffer;
+    for (size_t i = 0; i < mesh.positions.size(); i++)
+    {
+        float values[8];
+        int n = 0;
+        for (int a = 0; a < 3; a++)
+            values[n++] = static_cast<float>(mesh.positions[i][a]);
+        for (int a = 0; a < 3 && !mesh.normals.empty(); a++)
+            values[n++] = static_cast<float>(mesh.normals[i][a]);
+        for (int a = 0; a < 2 && !mesh.uvs.empty(); a++)
+            values[n++] = static_cast<float>(mesh.uvs[i][a]);
+        ok = ok && std::fwrite(values, sizeof(float), n, file) == static_cast<size_t>(n);
+    }
+    for (size_t t = 0; t < mesh.triangle_count(); t++)
+    {
+        char record[13];
+        record[0] = 3;
+        for (int k = 0; k < 3; k++)
+        {
+            auto index = static_cast<int32_t>(mesh.indices[3 * t + k]);
+            std::memcpy(record + 1 + 4 * k, &index, 4);
+        }
+        ok = ok && std::fwrite(record, sizeof(record), 1, file) == 1;
+    }
+    return std::fclose(file) == 0 && ok;
+}
+
+// OBJ
+
+inline bool obj_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *obj_skip_blanks(const char *p, const char *end)
+{
+    while (p < end && obj_blank(*p))
+        p++;
+    return p;
+}
+
+// Decimal numbers as OBJ files write them (sign, digits, fraction, exponent), without the
+// locale lookups of strtod and without reading past end, since the mapping is not terminated.
+inline bool obj_parse_number(const char *&p, const char *end, double &x)
+{
+    static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const uint64_t digit_limit = 100000000000000000ull; // keeps the mantissa below 2^63
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool digits = false;
+    for (; p < end && *p >= '0' && *p <= '9'; p++, digits = true)
+    {
+        if (mantissa < digit_limit)
+            mantissa = 10 * mantissa + (*p - '0');
+        else
+            exponent++;
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits = true)
+        {
+            if (mantissa < digit_limit)
+            {
+                mantissa = 10 * mantissa + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (!digits)
+        return false;
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        auto q = p + 1;
+        bool negative_exponent = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            negative_exponent = *q++ == '-';
+        int e = 0;
+        bool exponent_digits = false;
+        for (; q < end && *q >= '0' && *q <= '9'; q++, exponent_digits = true)
+            e = std::min(10 * e + (*q - '0'), 10000);
+        if (exponent_digits)
+        {
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    x = static_cast<double>(mantissa);
+    if (exponent >= 0 && exponent <= 22)
+        x *= powers[exponent];
+    else if (exponent < 0 && exponent >= -22)
+        x /= powers[-exponent];
+    else
+        x *= std::pow(10.0, exponent);
+    if (negative)
+        x = -x;
+    return true;
+}
+
+inline bool obj_parse_integer(const char *&p, const char *end, int64_t &x)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    if (p == end || *p < '0' || *p > '9')
+        return false;
+    x = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+        x = 10 * x + (*p - '0');
+    if (negative)
+        x = -x;
+    return true;
+}
+
+// A piece of the file that starts at a line start and ends after a line break (or at the end
+// of the file), with its counts from the first pass and its offsets from the prefix sum.
+struct obj_chunk
+{
+    const char *begin, *end;
+    size_t positions = 0, uvs = 0, normals = 0, triangles = 0;
+    size_t position_offset = 0, uv_offset = 0, normal_offset = 0, triangle_offset = 0;
+    bool bad = false;
+};
+
+// Kind of the statement at p: 'v', 't' (vt), 'n' (vn), 'f', or 0 for anything else.
+inline char obj_statement(const char *&p, const char *line_end)
+{
+    p = obj_skip_blanks(p, line_end);
+    if (line_end - p < 2)
+        return 0;
+    if (p[0] == 'f' && obj_blank(p[1]))
+    {
+        p += 2;
+        return 'f';
+    }
+    if (p[0] != 'v')
+        return 0;
+    if (obj_blank(p[1]))
+    {
+        p += 2;
+        return 'v';
+    }
+    if (line_end - p >= 3 && (p[1] == 't' || p[1] == 'n') && obj_blank(p[2]))
+    {
+        p += 3;
+        return p[-2];
+    }
+    return 0;
+}
+
+inline void obj_count(obj_chunk &chunk)
+{
+    for (auto p = chunk.begin; p < chunk.end;)
+    {
+        auto line_end = static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+        if (!line_end)
+            line_end = chunk.end;
+
+        switch (obj_statement(p, line_end))
+        {
+        case 'v':
+            chunk.positions++;
+            break;
+        case 't':
+            chunk.uvs++;
+            break;
+        case 'n':
+            chunk.normals++;
+            break;
+        case 'f':
+        {
+            size_t corners = 0;
+            for (p = obj_skip_blanks(p, line_end); p < line_end; p = obj_skip_blanks(p, line_end))
+            {
+                while (p < line_end && !obj_blank(*p))
+                    p++;
+                corners++;
+            }
+            chunk.triangles += corners > 2 ? corners - 2 : 0;
+            break;
+        }
+        }
+        p = line_end + 1;
+    }
+}
+
+// Per-corner references to vt and vn entries, turned into vertices after parsing.
+struct obj_corner_attributes
+{
+    enum : uint32_t
+    {
+        none = UINT32_MAX
+    };
+    std::vector<uint32_t> uv, normal; // three per triangle, or empty if the file has none
+};
+
+// OBJ indices are 1-based, or negative to count back from the last entry so far.
+inline bool obj_resolve(int64_t index, size_t defined, size_t total, uint32_t &out)
+{
+    int64_t resolved = index > 0 ? index - 1 : static_cast<int64_t>(defined) + index;
+    if (index == 0 || resolved < 0 || resolved >= static_cast<int64_t>(total))
+        return false;
+    out = static_cast<uint32_t>(resolved);
+    return true;
+}
+
+inline void obj_parse(obj_chunk &chunk, mesh_buffers &mesh, std::vector<vec3> &uvs,
+                      std::vector<vec3> &normals, obj_corner_attributes &corners)
+{
+    auto position = chunk.position_offset, uv = chunk.uv_offset, normal = chunk.normal_offset;
+    auto triangle = chunk.triangle_offset;
+
+    for (auto p = chunk.begin; p < chunk.end && !chunk.bad;)
+    {
+        auto line_end = static_cast<const char *>(std::memchr(p, '\n', chunk.end - p));
+        if (!line_end)
+            line_end = chunk.end;
+
+        double x[3] = {0, 0, 0};
+        auto kind = obj_statement(p, line_end);
+        if (kind == 'v' || kind == 'n' || kind == 't')
+        {
+            // Extra values (w, vertex colors) are ignored.
+            for (int a = 0; a < (kind == 't' ? 2 : 3); a++)
+            {
+                p = obj_skip_blanks(p, line_end);
+                chunk.bad |= !obj_parse_number(p, line_end, x[a]);
+            }
+        }
+
+        switch (kind)
+        {
+        case 'v':
+            mesh.positions[position++] = point3(x[0], x[1], x[2]);
+            break;
+        case 'n':
+            normals[normal++] = vec3(x[0], x[1], x[2]);
+            break;
+        case 't':
+            uvs[uv++] = vec3(x[0], x[1], 0);
+            break;
+        case 'f':
+        {
+            // Fan triangulation: every corner after the second closes a triangle with the
+            // first and the previous corner.
+            uint32_t first[3], previous[3], current[3];
+            int count = 0;
+            for (p = obj_skip_blanks(p, line_end); p < line_end && !chunk.bad;
+                 p = obj_skip_blanks(p, line_end), count++)
+            {
+                int64_t index;
+                current[1] = current[2] = obj_corner_attributes::none;
+                chunk.bad |= !obj_parse_integer(p, line_end, index) ||
+                             !obj_resolve(index, position, mesh.positions.size(), current[0]);
+                if (p < line_end && *p == '/')
+                {
+                    p++;
+                    if (p < line_end && *p != '/')
+                        chunk.bad |= !obj_parse_integer(p, line_end, index) ||
+                                     !obj_resolve(index, uv, uvs.size(), current[1]);
+                    if (p < line_end && *p == '/')
+                    {
+                        p++;
+                        chunk.bad |= !obj_parse_integer(p, line_end, index) ||
+                                     !obj_resolve(index, normal, normals.size(), current[2]);
+                    }
+                }
+
+                if (count >= 2)
+                {
+                    const uint32_t *triangle_corners[3] = {first, previous, current};
+                    for (int k = 0; k < 3; k++)
+                    {
+                        auto c = 3 * triangle + k;
+                        mesh.indices[c] = triangle_corners[k][0];
+                        if (!corners.uv.empty())
+                            corners.uv[c] = triangle_corners[k][1];
+                        if (!corners.normal.empty())
+                            corners.normal[c] = triangle_corners[k][2];
+                    }
+                    triangle++;
+                }
+                std::copy(current, current + 3, count == 0 ? first : previous);
+            }
+            break;
+        }
+        }
+        p = line_end + 1;
+    }
+}
+
+struct obj_vertex_key
+{
+    uint32_t position, uv, normal;
+
+    bool operator==(const obj_vertex_key &other) const
+    {
+        return position == other.position && uv == other.uv && normal == other.normal;
+    }
+};
+
+struct obj_vertex_key_hash
+{
+    size_t operator()(const obj_vertex_key &key) const
+    {
+        auto bits = (static_cast<uint64_t>(key.position) << 32 | key.uv) ^
+                    static_cast<uint64_t>(key.normal) * 0x9e3779b97f4a7c15ull;
+        return std::hash<uint64_t>()(bits);
+    }
+};
+
+// Gives each distinct (v, vt, vn) triple of the corners a vertex of its own and fills in the
+// uvs and normals of the vertices. The first triple seen for a position keeps the position's
+// index; every other one gets a copy of the position appended, which the corners then use.
+inline void obj_make_vertices(mesh_buffers &mesh, const obj_corner_attributes &corners,
+                              const std::vector<vec3> &uvs, const std::vector<vec3> &normals)
+{
+    // The vt and vn of each vertex; unused positions have uv == unused.
+    struct attributes
+    {
+        uint32_t uv, normal;
+    };
+    const uint32_t none = obj_corner_attributes::none, unused = none - 1;
+    bool has_uvs = !corners.uv.empty(), has_normals = !corners.normal.empty();
+
+    std::vector<attributes> vertices(mesh.positions.size(), {unused, none});
+    std::unordered_map<obj_vertex_key, uint32_t, obj_vertex_key_hash> split;
+    for (size_t c = 0; c < mesh.indices.size(); c++)
+    {
+        auto p = mesh.indices[c];
+        attributes corner = {has_uvs ? corners.uv[c] : none,
+                             has_normals ? corners.normal[c] : none};
+        auto &vertex = vertices[p];
+        if (vertex.uv == unused)
+            vertex = corner;
+        else if (vertex.uv != corner.uv || vertex.normal != corner.normal)
+        {
+            auto index = static_cast<uint32_t>(vertices.size());
+            auto found = split.insert({{p, corner.uv, corner.normal}, index});
+            if (found.second)
+            {
+                auto position = mesh.positions[p];
+                mesh.positions.push_back(position);
+                vertices.push_back(corner);
+            }
+            mesh.indices[c] = found.first->second;
+        }
+    }
+
+    auto vertex_count = vertices.size();
+    if (has_uvs)
+    {
+        mesh.uvs.assign(vertex_count, vec3(0, 0, 0));
+        for (size_t v = 0; v < vertex_count; v++)
+        {
+            if (vertices[v].uv < unused)
+                mesh.uvs[v] = uvs[vertices[v].uv];
+        }
+    }
+    if (has_normals)
+    {
+        mesh.normals.assign(vertex_count, vec3(0, 0, 0));
+        for (size_t v = 0; v < vertex_count; v++)
+        {
+            if (vertices[v].normal != none)
+                mesh.normals[v] = normals[vertices[v].normal];
+        }
+    }
+}
+
+inline shared_ptr<mesh_buffers> load_obj(const std::string &path)
+{
+    mapped_file file(path);
+    if (!file.is_open())
+    {
+        std::cerr << "ERROR: Could not load OBJ file '" << path << "'.\n";
+        return nullptr;
+    }
+
+    // Several chunks per thread, of at least 1 MiB each, cut after a line break.
+    const size_t min_chunk = 1 << 20;
+    auto chunk_count = std::max<size_t>(
+        1, std::min<size_t>(8 * mesh_io_threads(), file.size() / min_chunk));
+    std::vector<obj_chunk> chunks(chunk_count);
+    auto cut = file.begin();
+    for (size_t c = 0; c < chunk_count; c++)
+    {
+        chunks[c].begin = cut;
+        if (c + 1 < chunk_count)
+        {
+            auto nominal = std::max(cut, file.begin() + file.size() * (c + 1) / chunk_count);
+            auto line_end = static_cast<const char *>(
+                std::memchr(nominal, '\n', file.end() - nominal));
+            cut = line_end ? line_end + 1 : file.end();
+        }
+        else
+            cut = file.end();
+        chunks[c].end = cut;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (long c = 0; c < static_cast<long>(chunk_count); c++)
+        obj_count(chunks[c]);
+
+    obj_chunk total;
+    for (auto &chunk : chunks)
+    {
+        chunk.position_offset = total.positions;
+        chunk.uv_offset = total.uvs;
+        chunk.normal_offset = total.normals;
+        chunk.triangle_offset = total.triangles;
+        total.positions += chunk.positions;
+        total.uvs += chunk.uvs;
+        total.normals += chunk.normals;
+        total.triangles += chunk.triangles;
+    }
+
+    auto mesh = make_shared<mesh_buffers>();
+    mesh->positions.resize(total.positions);
+    mesh->indices.resize(3 * total.triangles);
+    std::vector<vec3> uvs(total.uvs), normals(total.normals);
+    obj_corner_attributes corners;
+    if (total.uvs > 0)
+        corners.uv.assign(3 * total.triangles, obj_corner_attributes::none);
+    if (total.normals > 0)
+        corners.normal.assign(3 * total.triangles, obj_corner_attributes::none);
+
+    bool bad = false;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(|| : bad)
+    for (long c = 0; c < static_cast<long>(chunk_count); c++)
+    {
+        obj_parse(chunks[c], *mesh, uvs, normals, corners);
+        bad = bad || chunks[c].bad;
+    }
+    if (bad)
+    {
+        std::cerr << "ERROR: Could not load OBJ file '" << path << "': malformed statement.\n";
+        return nullptr;
+    }
+
+    if (!corners.uv.empty() || !corners.normal.empty())
+        obj_make_vertices(*mesh, corners, uvs, normals);
+    return mesh;
+}
+
+// OBJ with v, vt and vn lines as present and faces that use the same index for all three.
+inline bool save_obj(const std::string &path, const mesh_buffers &mesh)
+{
+    FILE *file = std::fopen(path.c_str(), "w");
+    if (file == NULL)
+        return false;
+
+    for (const auto &p : mesh.positions)
+        std::fprintf(file, "v %.7g %.7g %.7g\n", p.x(), p.y(), p.z());
+    for (const auto &uv : mesh.uvs)
+        std::fprintf(file, "vt %.7g %.7g\n", uv.x(), uv.y());
+    for (const auto &n : mesh.normals)
+        std::fprintf(file, "vn %.7g %.7g %.7g\n", n.x(), n.y(), n.z());
+
+    bool uvs = !mesh.uvs.empty(), normals = !mesh.normals.empty();
+    for (size_t t = 0; t < mesh.triangle_count(); t++)
+    {
+        std::fputc('f', file);
+        for (int k = 0; k < 3; k++)
+        {
+            auto i = mesh.indices[3 * t + k] + 1;
+            if (uvs && normals)
+                std::fprintf(file, " %u/%u/%u", i, i, i);
+            else if (uvs)
+                std::fprintf(file, " %u/%u", i, i);
+            else if (normals)
+                std::fprintf(file, " %u//%u", i, i);
+            else
+                std::fprintf(file, " %u", i);
+        }
+        std::fputc('\n', file);
+    }
+    return std::fclose(file) == 0;
+}
+
+#endif
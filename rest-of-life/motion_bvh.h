@@ -0,0 +1,344 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <typeinfo>
+#include <vector>
+
+// Flattened BVH node with bounds at both ends of the shutter interval. Traversal tests the box
+// interpolated at the ray's time, which always contains the primitives below it at that time
+// as long as they move linearly (the interpolation of a union contains the union of the
+// interpolations).
+struct motion_bvh_node
+{
+    float start_min[3];
+    float start_max[3];
+    float end_min[3];
+    float end_max[3];
+    uint32_t offset; // leaf: first primitive index; inner node: index of the second child
+    uint16_t count;  // primitives in a leaf, 0 for inner nodes
+    uint8_t axis;    // inner nodes: axis along which the children are ordered
+    uint8_t pad[9];
+};
+
+// BVH for scenes with moving primitives. A node's box at ray time t is the interpolation of
+// its boxes at times 0 and 1 (see hittable::bounding_box_at), instead of the union over the
+// whole interval that bvh_node and linear_bvh have to use. The builder is a binned SAH whose
+// cost uses each box's surface area averaged over the shutter interval. As in linear_bvh,
+// spheres are copied in leaf order into an array of their own and intersected directly.
+class motion_bvh : public hittable
+{
+public:
+    static const int bin_count = 16;
+    static const int max_depth = 256;
+
+    motion_bvh(const hittable_list &list, int max_leaf_size = linear_bvh::default_max_leaf_size)
+        : objects(list.objects), leaf_size(max_leaf_size)
+    {
+        prims.resize(objects.size());
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            prims[i].start = objects[i]->bounding_box_at(0);
+            prims[i].end = objects[i]->bounding_box_at(1);
+            prims[i].centroid = 0.5 * (prims[i].start.center() + prims[i].end.center());
+            prims[i].index = static_cast<uint32_t>(i);
+        }
+
+        bbox = list.bounding_box();
+        if (!prims.empty())
+            build(0, prims.size(), 0);
+        std::vector<build_primitive>().swap(prims);
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return traverse(r, ray_t, &cand);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return traverse(r, ray_t, nullptr);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    const std::vector<motion_bvh_node> &node_array() const { return nodes; }
+
+    // Surface area averaged over t in [0, 1] of the box interpolated between start and end.
+    // Every extent is linear in t, so the mean of each product of two extents is exact:
+    // integral of (a + da t)(b + db t) = ab + (a db + b da) / 2 + da db / 3.
+    static double mean_area(const aabb &start, const aabb &end)
+    {
+        if (start.surface_area() <= 0 && end.surface_area() <= 0)
+            return 0;
+
+        double e[3], d[3];
+        for (int a = 0; a < 3; a++)
+        {
+            e[a] = start.axis(a).size();
+            d[a] = end.axis(a).size() - e[a];
+        }
+
+        double sum = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            int b = (a + 1) % 3;
+            sum += e[a] * e[b] + (e[a] * d[b] + e[b] * d[a]) / 2 + d[a] * d[b] / 3;
+        }
+        return 2 * sum;
+    }
+
+private:
+    struct build_primitive
+    {
+        aabb start, end;
+        point3 centroid;
+        uint32_t index;
+    };
+
+    // Per primitive reference in leaf order: the top bit set for a position in spheres, clear
+    // for an index into objects.
+    static const uint32_t sphere_flag = 1u << 31;
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<motion_bvh_node> nodes;
+    std::vector<uint32_t> refs;
+    std::vector<sphere> spheres;
+    std::vector<build_primitive> prims;
+    int leaf_size;
+    aabb bbox;
+
+    bool traverse(const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        if (nodes.empty())
+            return false;
+
+        precomputed_ray pr(r);
+        auto time = r.time();
+
+        bool hit_anything = false;
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t index = 0;
+
+        while (true)
+        {
+            RT_STATS_COUNT(stat_nodes);
+            const auto &node = nodes[index];
+            double lo[3], hi[3];
+            for (int a = 0; a < 3; a++)
+            {
+                lo[a] = node.start_min[a] + time * (node.end_min[a] - node.start_min[a]);
+                hi[a] = node.start_max[a] + time * (node.end_max[a] - node.start_max[a]);
+            }
+            double tnear;
+
+            if (slab_hit(lo, hi, pr, ray_t, tnear))
+            {
+                if (node.count > 0)
+                {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        if (!intersect_primitive(refs[i], r, ray_t, cand))
+                            continue;
+                        if (!cand)
+                            return true;
+                        hit_anything = true;
+                        ray_t.max = cand->t;
+                    }
+                }
+                else
+                {
+                    // Visit the child on the near side of the split axis first.
+                    if (pr.sign[node.axis])
+                    {
+                        stack[stack_size++] = index + 1;
+                        index = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        index = index + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            index = stack[--stack_size];
+        }
+        return hit_anything;
+    }
+
+    bool intersect_primitive(uint32_t ref, const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        if (ref & sphere_flag)
+        {
+            const auto &s = spheres[ref & ~sphere_flag];
+            return cand ? s.sphere::intersect(r, ray_t, *cand) : s.sphere::occluded(r, ray_t);
+        }
+        return cand ? objects[ref]->intersect(r, ray_t, *cand) : objects[ref]->occluded(r, ray_t);
+    }
+
+    static void store_bounds(const aabb &box, float min[3], float max[3])
+    {
+        for (int a = 0; a < 3; a++)
+        {
+            min[a] = round_down_float(box.axis(a).min);
+            max[a] = round_up_float(box.axis(a).max);
+        }
+    }
+
+    uint32_t emit(const aabb &start, const aabb &end)
+    {
+        motion_bvh_node node;
+        std::fill(reinterpret_cast<char *>(&node), reinterpret_cast<char *>(&node + 1), 0);
+        store_bounds(start, node.start_min, node.start_max);
+        store_bounds(end, node.end_min, node.end_max);
+        nodes.push_back(node);
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    void make_leaf(uint32_t index, size_t start, size_t end)
+    {
+        nodes[index].offset = static_cast<uint32_t>(refs.size());
+        nodes[index].count = static_cast<uint16_t>(end - start);
+        for (size_t i = start; i < end; i++)
+        {
+            // Exact type only: a subclass copied into spheres would be sliced.
+            const auto &object = *objects[prims[i].index];
+            if (typeid(object) == typeid(sphere))
+            {
+                refs.push_back(static_cast<uint32_t>(spheres.size()) | sphere_flag);
+                spheres.push_back(static_cast<const sphere &>(object));
+            }
+            else
+                refs.push_back(prims[i].index);
+        }
+    }
+
+    void build(size_t start, size_t end, int depth)
+    {
+        aabb start_box, end_box, centroids;
+        for (size_t i = start; i < end; i++)
+        {
+            start_box = aabb(start_box, prims[i].start);
+            end_box = aabb(end_box, prims[i].end);
+            centroids = aabb(centroids, aabb(prims[i].centroid, prims[i].centroid));
+        }
+
+        auto index = emit(start_box, end_box);
+        auto n = end - start;
+        if (n == 1 || depth >= max_depth - 1)
+        {
+            make_leaf(index, start, end);
+            return;
+        }
+
+        // Binned SAH over the centroids at mid-shutter, costed with time-averaged areas.
+        int best_axis = -1, best_bin = 0;
+        double best_cost = infinity;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto lo = centroids.axis(axis).min;
+            auto extent = centroids.axis(axis).size();
+            if (extent <= 0)
+                continue;
+
+            aabb bin_start[bin_count], bin_end[bin_count];
+            size_t bin_size[bin_count] = {};
+            for (size_t i = start; i < end; i++)
+            {
+                auto b = bin_of(prims[i].centroid[axis], lo, extent);
+                bin_start[b] = aabb(bin_start[b], prims[i].start);
+                bin_end[b] = aabb(bin_end[b], prims[i].end);
+                bin_size[b]++;
+            }
+
+            double right_cost[bin_count];
+            aabb acc_start, acc_end;
+            size_t count = 0;
+            for (int i = bin_count - 1; i > 0; i--)
+            {
+                acc_start = aabb(acc_start, bin_start[i]);
+                acc_end = aabb(acc_end, bin_end[i]);
+                count += bin_size[i];
+                right_cost[i] = count * mean_area(acc_start, acc_end);
+            }
+
+            acc_start = aabb();
+            acc_end = aabb();
+            count = 0;
+            for (int i = 1; i < bin_count; i++)
+            {
+                acc_start = aabb(acc_start, bin_start[i - 1]);
+                acc_end = aabb(acc_end, bin_end[i - 1]);
+                count += bin_size[i - 1];
+                if (count == 0 || count == n)
+                    continue;
+                auto cost = count * mean_area(acc_start, acc_end) + right_cost[i];
+                if (cost < best_cost)
+                {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = i;
+                }
+            }
+        }
+
+        auto area = mean_area(start_box, end_box);
+        auto leaf_cost = n * linear_bvh::intersection_cost;
+        auto split_cost = area > 0 ? 1 + best_cost / area : infinity;
+        if (n <= static_cast<size_t>(leaf_size) && leaf_cost <= split_cost)
+        {
+            make_leaf(index, start, end);
+            return;
+        }
+
+        size_t mid;
+        if (best_axis < 0)
+        {
+            // All centroids coincide: split the range in half.
+            mid = start + n / 2;
+        }
+        else
+        {
+            auto lo = centroids.axis(best_axis).min;
+            auto extent = centroids.axis(best_axis).size();
+            auto middle = std::partition(prims.begin() + start, prims.begin() + end,
+                                         [&](const build_primitive &p) {
+                                             return bin_of(p.centroid[best_axis], lo, extent) <
+                                                    best_bin;
+                                         });
+            mid = middle - prims.begin();
+        }
+
+        build(start, mid, depth + 1);
+        nodes[index].offset = static_cast<uint32_t>(nodes.size());
+        nodes[index].axis = static_cast<uint8_t>(best_axis < 0 ? 0 : best_axis);
+        build(mid, end, depth + 1);
+    }
+
+    static int bin_of(double x, double lo, double extent)
+    {
+        int b = static_cast<int>(bin_count * (x - lo) / extent);
+        return std::min(std::max(b, 0), bin_count - 1);
+    }
+};
+
+#endif
@@ -3,6 +3,8 @@
 #include "rtweekend.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "instance.h"
+#include "scene_arena.h"
 
 class quad : public hittable
 {
@@ -21,7 +23,9 @@ public:
     }
     virtual void set_bounding_box()
     {
-        bbox = aabb(Q, Q + u + v);
+        // Both diagonals, so sheared or rotated quads are covered, padded so that an
+        // axis-aligned quad does not get a zero-thickness box.
+        bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).pad();
     }
     aabb bounding_box() const override
     {
@@ -29,27 +33,46 @@ public:
     }
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        auto denom = dot(normal, r.direction());
-        if (fabs(denom) < 1e-8)
-            return false;
-        auto t = (D - dot(normal, r.origin())) / denom;
-        if (!ray_t.contains(t))
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        double t, alpha, beta;
+        if (!intersect(r, ray_t, t, alpha, beta))
             return false;
-        auto intersection = r.at(t);
 
         // determine if the intersection is inside the quad
-        vec3 planar_hitpt_vector = intersection - Q;
-        auto alpha = dot(w, cross(planar_hitpt_vector, v));
-        auto beta = dot(w, cross(u, planar_hitpt_vector));
-        if (!is_interior(alpha, beta, rec))
+        hit_record scratch;
+        if (!is_interior(alpha, beta, scratch))
             return false;
 
-        rec.t = t;
-        rec.p = intersection;
-        rec.mat = mat;
+        RT_STATS_COUNT(stat_candidates);
+        cand.t = t;
+        cand.object = this;
+        cand.b1 = alpha;
+        cand.b2 = beta;
+        return true;
+    }
+
+    void surface(const ray &r, const hit_candidate &cand, hit_record &rec) const override
+    {
+        RT_STATS_COUNT(stat_surfaces);
+        is_interior(cand.b1, cand.b2, rec);
+        rec.t = cand.t;
+        rec.p = r.at(cand.t);
+        rec.mat = mat.get();
         rec.set_face_normal(r, normal);
+    }
 
-        return true;
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double t, alpha, beta;
+        if (!intersect(r, ray_t, t, alpha, beta))
+            return false;
+
+        hit_record scratch;
+        return is_interior(alpha, beta, scratch);
     }
 
     virtual bool is_interior(double a, double b, hit_record &rec) const
@@ -63,12 +86,15 @@ public:
     }
     double pdf_value(const point3 &origin, const vec3 &v) const override
     {
-        hit_record rec;
-        if (!this->hit(ray(origin, v), interval(0.001, infinity), rec))
+        // Only the distance is needed, so skip the shading data hit() would fill in.
+        double t, alpha, beta;
+        hit_record scratch;
+        if (!intersect(ray(origin, v), interval(0.001, infinity), t, alpha, beta) ||
+            !is_interior(alpha, beta, scratch))
             return 0;
 
-        auto distance_squared = rec.t * rec.t * v.length_squared();
-        auto cosine = fabs(dot(v, rec.normal) / v.length());
+        auto distance_squared = t * t * v.length_squared();
+        auto cosine = fabs(dot(v, normal) / v.length());
 
         return distance_squared / (cosine * area);
     }
@@ -79,6 +105,15 @@ public:
         return random_point - origin;
     }
 
+    shared_ptr<quad> transformed(const affine_transform &t) const
+    {
+        // This quad placed by t, with the same uvs. nullptr if t mirrors it: the copy's
+        // front face, cross(u, v), would then point the other way.
+        if (t.determinant() <= 0)
+            return nullptr;
+        return make_shared<quad>(t.point(Q), t.vector(u), t.vector(v), mat);
+    }
+
 private:
     point3 Q;
     vec3 u, v;
@@ -90,13 +125,32 @@ private:
 
     vec3 w;
     double area;
+
+    bool intersect(const ray &r, interval ray_t, double &t, double &alpha, double &beta) const
+    {
+        // Plane intersection plus the planar coordinates of the hit point in (u, v).
+        RT_STATS_COUNT(stat_quad_tests);
+        auto denom = dot(normal, r.direction());
+        if (fabs(denom) < 1e-8)
+            return false;
+        t = (D - dot(normal, r.origin())) / denom;
+        if (!ray_t.contains(t))
+            return false;
+
+        vec3 planar_hitpt_vector = r.at(t) - Q;
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
+        return true;
+    }
 };
 
-inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_ptr<material> mat)
+inline shared_ptr<hittable_list> box_quads(const point3 &a, const point3 &b,
+                                           shared_ptr<material> mat)
 {
-    // Returns the 3D box (six sides) that contains the two opposite vertices a & b.
+    // Returns the 3D box (six sides) that contains the two opposite vertices a & b, as six
+    // separate quads. box() in box.h returns the same box as a single primitive.
 
-    auto sides = make_shared<hittable_list>();
+    auto sides = make_scene_object<hittable_list>();
 
     // Construct the two opposite vertices with the minimum and maximum coordinates.
     auto min = point3(fmin(a.x(), b.x()), fmin(a.y(), b.y()), fmin(a.z(), b.z()));
@@ -106,12 +160,12 @@ inline shared_ptr<hittable_list> box(const point3 &a, const point3 &b, shared_pt
     auto dy = vec3(0, max.y() - min.y(), 0);
     auto dz = vec3(0, 0, max.z() - min.z());
 
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat));  // front
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
-    sides->add(make_shared<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat));  // left
-    sides->add(make_shared<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
-    sides->add(make_shared<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat));  // bottom
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), max.z()), dx, dy, mat));  // front
+    sides->add(make_scene_object<quad>(point3(max.x(), min.y(), max.z()), -dz, dy, mat)); // right
+    sides->add(make_scene_object<quad>(point3(max.x(), min.y(), min.z()), -dx, dy, mat)); // back
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), min.z()), dz, dy, mat));  // left
+    sides->add(make_scene_object<quad>(point3(min.x(), max.y(), max.z()), dx, -dz, mat)); // top
+    sides->add(make_scene_object<quad>(point3(min.x(), min.y(), min.z()), dx, dz, mat));  // bottom
 
     return sides;
 }
@@ -0,0 +1,321 @@
+#ifndef QUANTIZED_BVH_H
+#define QUANTIZED_BVH_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "bvh_build.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Compressed 4-wide node, one 64-byte cache line. Child bounds are stored as 8-bit offsets
+// from the node origin in units of a per-axis power of two:
+//
+//     child_min = origin + qmin * 2^exponent,    child_max = origin + qmax * 2^exponent
+//
+// Quantization rounds outwards, so a decoded box always contains the real child box.
+struct quantized_bvh_node
+{
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t child_count;
+    uint8_t qmin[3][4];
+    uint8_t qmax[3][4];
+    uint32_t child[4];      // inner child: node index; leaf child: first primitive
+    uint8_t leaf_count[4];  // primitives in a leaf child, 0 for inner children
+    uint8_t pad[4];
+};
+
+// Exact 2^e for the exponent range of quantized_bvh_node, without a libm call.
+inline double quantized_scale(int exponent)
+{
+    uint64_t bits = static_cast<uint64_t>(exponent + 1023) << 52;
+    double scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+// BVH with quantized nodes, built by collapsing a bvh_node tree into 4-wide nodes: each node
+// repeatedly opens its largest inner child until it has four children. Decoding the child
+// boxes costs a few multiply-adds per node, in exchange for a quarter of the node memory of
+// a full-precision linear_bvh and an order of magnitude less than a bvh_node tree.
+class quantized_bvh : public hittable
+{
+public:
+    static const int max_stack = 256;
+    // Traversal leaves at most three siblings on the stack per level above the node it pops,
+    // then pushes up to four children, so trees of up to this many levels fit in the stack.
+    static const int max_depth = (max_stack - 1) / 3;
+
+    quantized_bvh(const hittable_list &list, bvh_build_method method = bvh_build_method::sah)
+        : quantized_bvh(*build_bvh(list, method))
+    {
+    }
+
+    explicit quantized_bvh(const bvh_node &root)
+    {
+        bbox = root.bounding_box();
+        if (root.left_child() != root.right_child())
+            emit(root, 0);
+        else
+        {
+            auto top = unwrap(root.left_child());
+            if (auto node = inner(top))
+                emit(*node, 0);
+            else
+                primitives.push_back(top); // a single primitive needs no nodes at all
+        }
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        return traverse(r, ray_t, &cand);
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        return traverse(r, ray_t, nullptr);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    const std::vector<quantized_bvh_node> &node_array() const { return nodes; }
+
+    size_t memory_bytes() const
+    {
+        return nodes.size() * sizeof(quantized_bvh_node) +
+               primitives.size() * sizeof(shared_ptr<hittable>);
+    }
+
+private:
+    std::vector<quantized_bvh_node> nodes;
+    std::vector<shared_ptr<hittable>> primitives;
+    aabb bbox;
+
+    struct stack_entry
+    {
+        uint32_t node;
+        double tnear;
+    };
+
+    bool intersect_leaf(uint32_t first, uint32_t count, const ray &r, interval &ray_t,
+                        hit_candidate *cand, bool &hit_anything) const
+    {
+        // Returns true when an any-hit query can stop.
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            if (!cand)
+            {
+                if (primitives[i]->occluded(r, ray_t))
+                    return true;
+            }
+            else if (primitives[i]->intersect(r, ray_t, *cand))
+            {
+                hit_anything = true;
+                ray_t.max = cand->t;
+            }
+        }
+        return false;
+    }
+
+    bool traverse(const ray &r, interval ray_t, hit_candidate *cand) const
+    {
+        bool hit_anything = false;
+        if (nodes.empty())
+        {
+            if (primitives.empty())
+                return false;
+            return intersect_leaf(0, 1, r, ray_t, cand, hit_anything) || hit_anything;
+        }
+
+        precomputed_ray pr(r);
+
+        double tnear;
+        double root_lo[3] = {bbox.x.min, bbox.y.min, bbox.z.min};
+        double root_hi[3] = {bbox.x.max, bbox.y.max, bbox.z.max};
+        if (!slab_hit(root_lo, root_hi, pr, ray_t, tnear))
+            return false;
+
+        stack_entry stack[max_stack];
+        int stack_size = 0;
+        stack[stack_size++] = {0, tnear};
+
+        while (stack_size > 0)
+        {
+            auto entry = stack[--stack_size];
+            if (entry.tnear > ray_t.max)
+                continue;
+            RT_STATS_COUNT(stat_nodes);
+
+            const auto &node = nodes[entry.node];
+            double node_origin[3], scale[3];
+            for (int a = 0; a < 3; a++)
+            {
+                node_origin[a] = node.origin[a];
+                scale[a] = quantized_scale(node.exponent[a]);
+            }
+
+            // Decode and test all children; leaves are intersected right away, inner
+            // children are pushed far-to-near so the nearest is popped first.
+            stack_entry hits[4];
+            int hit_count = 0;
+            for (int c = 0; c < node.child_count; c++)
+            {
+                double lo[3], hi[3];
+                for (int a = 0; a < 3; a++)
+                {
+                    lo[a] = node_origin[a] + node.qmin[a][c] * scale[a];
+                    hi[a] = node_origin[a] + node.qmax[a][c] * scale[a];
+                }
+                if (!slab_hit(lo, hi, pr, ray_t, tnear))
+                    continue;
+
+                if (node.leaf_count[c] > 0)
+                {
+                    if (intersect_leaf(node.child[c], node.leaf_count[c], r, ray_t, cand,
+                                       hit_anything))
+                        return true;
+                }
+                else
+                    hits[hit_count++] = {node.child[c], tnear};
+            }
+
+            for (int i = 1; i < hit_count; i++)
+            {
+                for (int j = i; j > 0 && hits[j - 1].tnear < hits[j].tnear; j--)
+                    std::swap(hits[j - 1], hits[j]);
+            }
+            for (int i = 0; i < hit_count; i++)
+                stack[stack_size++] = hits[i];
+        }
+        return hit_anything;
+    }
+
+    static shared_ptr<hittable> unwrap(shared_ptr<hittable> object)
+    {
+        // bvh_nodes over a single object (left == right) are just that object.
+        while (true)
+        {
+            auto node = dynamic_cast<const bvh_node *>(object.get());
+            if (!node || node->left_child() != node->right_child())
+                return object;
+            object = node->left_child();
+        }
+    }
+
+    static const bvh_node *inner(const shared_ptr<hittable> &object)
+    {
+        return dynamic_cast<const bvh_node *>(object.get());
+    }
+
+    static void quantize_axis(double parent_lo, double parent_hi, float &origin, int8_t &exponent)
+    {
+        origin = round_down_float(parent_lo);
+        auto extent = parent_hi - origin;
+        int e = extent > 0 ? static_cast<int>(std::ceil(std::log2(extent / 255))) : -128;
+        e = std::max(e, -128);
+        while (e < 127 && origin + 255 * quantized_scale(e) < parent_hi)
+            e++;
+        exponent = static_cast<int8_t>(e);
+    }
+
+    uint32_t emit(const bvh_node &node, int depth)
+    {
+        if (depth >= max_depth)
+        {
+            std::cerr << "quantized_bvh: tree deeper than " << max_depth << " levels\n";
+            std::exit(1);
+        }
+
+        // Collapse: keep opening the inner child with the largest surface area.
+        std::vector<shared_ptr<hittable>> children = {unwrap(node.left_child()),
+                                                      unwrap(node.right_child())};
+        while (children.size() < 4)
+        {
+            int best = -1;
+            double best_area = -1;
+            for (size_t i = 0; i < children.size(); i++)
+            {
+                if (inner(children[i]) && children[i]->bounding_box().surface_area() > best_area)
+                {
+                    best = static_cast<int>(i);
+                    best_area = children[i]->bounding_box().surface_area();
+                }
+            }
+            if (best < 0)
+                break;
+
+            auto opened = inner(children[best]);
+            auto left = unwrap(opened->left_child());
+            auto right = unwrap(opened->right_child());
+            children[best] = left;
+            children.push_back(right);
+        }
+
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+
+        quantized_bvh_node q;
+        std::fill(reinterpret_cast<char *>(&q), reinterpret_cast<char *>(&q + 1), 0);
+        q.child_count = static_cast<uint8_t>(children.size());
+
+        auto parent = node.bounding_box();
+        for (int a = 0; a < 3; a++)
+        {
+            quantize_axis(parent.axis(a).min, parent.axis(a).max, q.origin[a], q.exponent[a]);
+            double origin = q.origin[a];
+            double scale = quantized_scale(q.exponent[a]);
+
+            for (size_t c = 0; c < children.size(); c++)
+            {
+                auto box = children[c]->bounding_box().axis(a);
+                auto lo = std::floor((box.min - origin) / scale);
+                auto hi = std::ceil((box.max - origin) / scale);
+                lo = std::min(std::max(lo, 0.0), 255.0);
+                hi = std::min(std::max(hi, 0.0), 255.0);
+
+                // Guard against rounding in the divisions: the decoded box, computed exactly
+                // as traversal does, must contain the child.
+                while (lo > 0 && origin + lo * scale > box.min)
+                    lo--;
+                while (hi < 255 && origin + hi * scale < box.max)
+                    hi++;
+
+                q.qmin[a][c] = static_cast<uint8_t>(lo);
+                q.qmax[a][c] = static_cast<uint8_t>(hi);
+            }
+        }
+
+        for (size_t c = 0; c < children.size(); c++)
+        {
+            if (auto child = inner(children[c]))
+            {
+                q.child[c] = emit(*child, depth + 1);
+                q.leaf_count[c] = 0;
+            }
+            else
+            {
+                q.child[c] = static_cast<uint32_t>(primitives.size());
+                q.leaf_count[c] = 1;
+                primitives.push_back(children[c]);
+            }
+        }
+
+        nodes[index] = q;
+        return index;
+    }
+};
+
+#endif
@@ -24,4 +24,26 @@ class ray {
     double tm;
 };
 
+// Per-ray constants of the slab test, computed once per traversal instead of at every box: the
+// reciprocal direction, origin * reciprocal, and which axes the ray runs backwards along. A
+// zero direction component gets a huge finite reciprocal instead of infinity, so that
+// bound * inv_dir - origin_inv never evaluates inf - inf.
+struct precomputed_ray {
+    vec3 inv_dir;
+    vec3 origin_inv;
+    int sign[3];
+
+    explicit precomputed_ray(const ray& r) {
+        for (int a = 0; a < 3; a++) {
+            auto d = r.direction()[a];
+            auto inv = 1 / d;
+            if (!(std::fabs(inv) < 1e30))
+                inv = std::copysign(1e30, d);
+            inv_dir[a] = inv;
+            origin_inv[a] = r.origin()[a] * inv;
+            sign[a] = inv < 0;
+        }
+    }
+};
+
 #endif
\ No newline at end of file
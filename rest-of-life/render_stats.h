@@ -0,0 +1,164 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include "image.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Optional work counters for finding out where a frame's time goes. They are compiled in only
+// with RT_STATS defined (cmake -DRT_STATS=ON); otherwise RT_STATS_COUNT expands to nothing and
+// the counters do not exist. Enabled, a count is one increment of a thread-local integer;
+// RT_STATS_ADD counts several at once, for code that does several tests in one go.
+
+enum stat_counter
+{
+    stat_nodes,         // acceleration structure nodes (or grid cells) visited
+    stat_box_tests,     // ray-AABB slab tests
+    stat_sphere_tests,  // ray-primitive tests, by primitive type
+    stat_quad_tests,
+    stat_triangle_tests,
+    stat_other_tests,
+    stat_candidates,    // primitive hits that were the closest so far when found
+    stat_surfaces,      // hit records (normal, uv, material) computed for such hits
+    stat_shading,       // hit points shaded by the camera
+    stat_counter_count
+};
+
+struct render_counters
+{
+    uint64_t value[stat_counter_count] = {};
+};
+
+#ifdef RT_STATS
+inline render_counters &thread_render_counters()
+{
+    static thread_local render_counters counters;
+    return counters;
+}
+
+#define RT_STATS_COUNT(counter) (++thread_render_counters().value[counter])
+#define RT_STATS_ADD(counter, n) (thread_render_counters().value[counter] += (n))
+#else
+#define RT_STATS_COUNT(counter) ((void)0)
+#define RT_STATS_ADD(counter, n) ((void)0)
+#endif
+
+// Per-pixel totals of the counters, written out as false-color heatmaps and summed up for the
+// whole frame. Pixels are bracketed with begin_pixel() and end_pixel() on the thread that
+// traces them.
+class render_stats
+{
+public:
+    render_stats(int _width, int _height)
+        : width(_width), height(_height),
+          pixels(static_cast<size_t>(_width) * _height * stat_counter_count, 0) {}
+
+    static const char *counter_name(int counter)
+    {
+        static const char *names[stat_counter_count] = {
+            "nodes",      "box_tests",   "sphere_tests", "quad_tests",
+            "triangle_tests", "other_tests", "candidates", "surfaces", "shading"};
+        return names[counter];
+    }
+
+#ifdef RT_STATS
+    void begin_pixel() { start = thread_render_counters(); }
+
+    void end_pixel(int i, int j)
+    {
+        const auto &now = thread_render_counters();
+        auto pixel = &pixels[(static_cast<size_t>(j) * width + i) * stat_counter_count];
+        for (int c = 0; c < stat_counter_count; c++)
+            pixel[c] += now.value[c] - start.value[c];
+    }
+#endif
+
+    uint64_t total(int counter) const
+    {
+        uint64_t sum = 0;
+        for (size_t p = counter; p < pixels.size(); p += stat_counter_count)
+            sum += pixels[p];
+        return sum;
+    }
+
+    void print_totals(std::ostream &out, int samples_per_pixel) const
+    {
+        auto pixel_count = static_cast<double>(width) * height;
+        out << std::left << std::setw(16) << "counter" << std::right << std::setw(16) << "total"
+            << std::setw(14) << "per pixel" << std::setw(14) << "per sample" << '\n';
+        for (int c = 0; c < stat_counter_count; c++)
+        {
+            auto sum = total(c);
+            out << std::left << std::setw(16) << counter_name(c) << std::right << std::setw(16)
+                << sum << std::fixed << std::setprecision(2) << std::setw(14)
+                << sum / pixel_count << std::setw(14)
+                << sum / (pixel_count * samples_per_pixel) << '\n';
+        }
+    }
+
+    // Writes one heatmap per counter, named after base_name ("image.bmp" gives
+    // "image_nodes.bmp" and so on). Colors run from black through blue, magenta and orange to
+    // white at the 99th percentile of the nonzero pixels, so a few outliers do not wash out
+    // the rest of the map.
+    void write_heatmaps(const std::string &base_name) const
+    {
+        auto dot = base_name.rfind('.');
+        auto stem = dot == std::string::npos ? base_name : base_name.substr(0, dot);
+
+        for (int c = 0; c < stat_counter_count; c++)
+        {
+            std::vector<uint64_t> values;
+            for (size_t p = c; p < pixels.size(); p += stat_counter_count)
+            {
+                if (pixels[p] > 0)
+                    values.push_back(pixels[p]);
+            }
+            double scale = 0;
+            if (!values.empty())
+            {
+                auto rank = values.begin() + (values.size() - 1) * 99 / 100;
+                std::nth_element(values.begin(), rank, values.end());
+                scale = 1.0 / *rank;
+            }
+
+            image heatmap(width, height);
+            for (int j = 0; j < height; j++)
+            {
+                for (int i = 0; i < width; i++)
+                {
+                    auto pixel = static_cast<size_t>(j) * width + i;
+                    auto value = pixels[pixel * stat_counter_count + c];
+                    // BMP rows run bottom-up.
+                    heatmap.set_pixel(i, height - 1 - j, ramp(value * scale));
+                }
+            }
+            heatmap.save_bmp((stem + "_" + counter_name(c) + ".bmp").c_str());
+        }
+    }
+
+private:
+    int width, height;
+    std::vector<uint64_t> pixels; // stat_counter_count counts per pixel, row by row
+#ifdef RT_STATS
+    render_counters start;
+#endif
+
+    static vec3 ramp(double x)
+    {
+        static const vec3 stops[] = {vec3(0, 0, 0), vec3(0.1, 0.1, 0.6), vec3(0.7, 0.1, 0.6),
+                                     vec3(1.0, 0.6, 0.1), vec3(1, 1, 1)};
+        const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+        x = std::min(std::max(x, 0.0), 1.0) * last;
+        auto k = std::min(static_cast<int>(x), last - 1);
+        auto f = x - k;
+        // image::save_bmp maps [0, 1) to 0..255.
+        return 0.999 * ((1 - f) * stops[k] + f * stops[k + 1]);
+    }
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef RTWEEKEND_H
 #define RTWEEKEND_H
 
+#include <atomic>
 #include <cmath>
 #include <limits>
 #include <memory>
@@ -26,9 +27,12 @@ inline double degrees_to_radians(double degrees)
 
 inline double random_double()
 {
-    // Returns a random real in [0,1).
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
+    // Returns a random real in [0,1). Each thread has its own generator, so threads neither race
+    // on nor share its state. The first thread to draw gets the default seed and with it the
+    // sequence that single-threaded scene setup has always used.
+    static std::atomic<unsigned> threads{0};
+    thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    thread_local std::mt19937 generator(std::mt19937::default_seed + threads++);
     return distribution(generator);
 }
 
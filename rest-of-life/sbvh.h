@@ -0,0 +1,365 @@
+#ifndef SBVH_H
+#define SBVH_H
+
+#include "rtweekend.h"
+
+#include "hittable_list.h"
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Spatial-split BVH builder (Stich et al., "Spatial Splits in Bounding Volume Hierarchies").
+// Besides the binned SAH object split, every node also tries spatial splits: planes that cut
+// primitives in two, so that a wall or floor quad spanning the whole scene ends up in both
+// children as two small references instead of one huge box that overlaps everything.
+//
+// Spatial splits are only tried where the best object split leaves overlapping children, and
+// the number of duplicated references is capped by duplication_budget. A reference is clipped
+// as a box, which is exact for the axis-aligned quads and boxes these scenes are made of and
+// conservative for anything else. The result is a linear_bvh whose leaves can share objects;
+// its traversal mailboxes them so a ray tests each object at most once.
+class sbvh_builder
+{
+public:
+    static const int bin_count = 16;
+    static const int max_leaf_size = 1;
+    static const int max_depth = 64;
+
+    double duplication_budget = 0.3; // extra references allowed, as a fraction of the input
+    double overlap_threshold = 1e-5; // child overlap, relative to the root area, that enables
+                                     // spatial splits
+    double traversal_cost = 1.0;     // relative to one primitive intersection
+    bool mailboxing = true;
+
+    shared_ptr<linear_bvh> build(const hittable_list &list)
+    {
+        nodes.clear();
+        indices.clear();
+
+        std::vector<reference> refs(list.objects.size());
+        aabb bounds;
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            refs[i].box = list.objects[i]->bounding_box();
+            refs[i].index = static_cast<uint32_t>(i);
+            bounds = aabb(bounds, refs[i].box);
+        }
+
+        root_area = bounds.surface_area();
+        reference_budget = static_cast<size_t>(refs.size() * (1 + duplication_budget));
+        reference_count = input_count = refs.size();
+
+        if (refs.empty())
+            nodes.push_back(make_linear_bvh_node(bounds));
+        else
+            build_node(refs, bounds, 0);
+
+        return make_shared<linear_bvh>(list, std::move(nodes), std::move(indices), mailboxing);
+    }
+
+    // References added by spatial splits in the last build.
+    size_t duplicated_references() const { return reference_count - input_count; }
+
+private:
+    struct reference
+    {
+        aabb box;
+        uint32_t index;
+    };
+
+    struct split
+    {
+        double cost = infinity;
+        int axis = -1;
+        int plane = 0; // bin boundary: bins [0, plane) go left
+        aabb left, right;
+    };
+
+    std::vector<linear_bvh_node> nodes;
+    std::vector<uint32_t> indices;
+    double root_area = 0;
+    size_t reference_budget = 0;
+    size_t reference_count = 0;
+    size_t input_count = 0;
+
+    static aabb clip(const aabb &box, int axis, double lo, double hi)
+    {
+        interval clipped[3] = {box.x, box.y, box.z};
+        clipped[axis] = interval(fmax(clipped[axis].min, lo), fmin(clipped[axis].max, hi));
+        return aabb(clipped[0], clipped[1], clipped[2]);
+    }
+
+    static aabb overlap(const aabb &a, const aabb &b)
+    {
+        return aabb(interval(fmax(a.x.min, b.x.min), fmin(a.x.max, b.x.max)),
+                    interval(fmax(a.y.min, b.y.min), fmin(a.y.max, b.y.max)),
+                    interval(fmax(a.z.min, b.z.min), fmin(a.z.max, b.z.max)));
+    }
+
+    static int bin_of(double x, double lo, double extent)
+    {
+        int b = static_cast<int>(bin_count * (x - lo) / extent);
+        return std::min(std::max(b, 0), bin_count - 1);
+    }
+
+    split find_object_split(const std::vector<reference> &refs) const
+    {
+        aabb cb;
+        for (const auto &r : refs)
+            cb = aabb(cb, aabb(r.box.center(), r.box.center()));
+
+        split best;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto extent = cb.axis(axis).size();
+            if (extent <= 0)
+                continue;
+
+            aabb boxes[bin_count];
+            size_t counts[bin_count] = {};
+            for (const auto &r : refs)
+            {
+                auto b = bin_of(r.box.center()[axis], cb.axis(axis).min, extent);
+                boxes[b] = aabb(boxes[b], r.box);
+                counts[b]++;
+            }
+            sweep(boxes, counts, counts, axis, best);
+        }
+        return best;
+    }
+
+    split find_spatial_split(const std::vector<reference> &refs, const aabb &bounds) const
+    {
+        split best;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            auto lo = bounds.axis(axis).min;
+            auto extent = bounds.axis(axis).size();
+            if (extent <= 0)
+                continue;
+            auto width = extent / bin_count;
+
+            // Every reference is clipped into each bin it spans; it enters at its first bin
+            // and exits at its last.
+            aabb boxes[bin_count];
+            size_t entries[bin_count] = {}, exits[bin_count] = {};
+            for (const auto &r : refs)
+            {
+                auto first = bin_of(r.box.axis(axis).min, lo, extent);
+                auto last = bin_of(r.box.axis(axis).max, lo, extent);
+                for (int b = first; b <= last; b++)
+                {
+                    auto part = clip(r.box, axis, lo + b * width, lo + (b + 1) * width);
+                    boxes[b] = aabb(boxes[b], part);
+                }
+                entries[first]++;
+                exits[last]++;
+            }
+            sweep(boxes, entries, exits, axis, best);
+        }
+        return best;
+    }
+
+    // Evaluates every bin boundary; the left side counts entries, the right side exits, which
+    // for object splits are the same array.
+    static void sweep(const aabb boxes[], const size_t left_counts[], const size_t right_counts[],
+                      int axis, split &best)
+    {
+        aabb right_box[bin_count];
+        size_t right_count[bin_count];
+        aabb acc;
+        size_t count = 0;
+        for (int i = bin_count - 1; i > 0; i--)
+        {
+            acc = aabb(acc, boxes[i]);
+            count += right_counts[i];
+            right_box[i] = acc;
+            right_count[i] = count;
+        }
+
+        acc = aabb();
+        count = 0;
+        for (int i = 1; i < bin_count; i++)
+        {
+            acc = aabb(acc, boxes[i - 1]);
+            count += left_counts[i - 1];
+            if (count == 0 || right_count[i] == 0)
+                continue;
+            auto cost = count * acc.surface_area() + right_count[i] * right_box[i].surface_area();
+            if (cost < best.cost)
+            {
+                best.cost = cost;
+                best.axis = axis;
+                best.plane = i;
+                best.left = acc;
+                best.right = right_box[i];
+            }
+        }
+    }
+
+    void make_leaf(const std::vector<reference> &refs, const aabb &bounds)
+    {
+        if (refs.size() > UINT16_MAX)
+        {
+            std::cerr << "sbvh: leaf of " << refs.size() << " references\n";
+            std::exit(1);
+        }
+
+        auto node = make_linear_bvh_node(bounds);
+        node.offset = static_cast<uint32_t>(indices.size());
+        node.count = static_cast<uint16_t>(refs.size());
+        for (const auto &r : refs)
+            indices.push_back(r.index);
+        nodes.push_back(node);
+    }
+
+    void build_node(std::vector<reference> &refs, const aabb &bounds, int depth)
+    {
+        auto n = refs.size();
+        if (n == 1 || depth >= max_depth)
+        {
+            make_leaf(refs, bounds);
+            return;
+        }
+
+        auto object = find_object_split(refs);
+
+        split spatial;
+        if (object.axis < 0 ||
+            overlap(object.left, object.right).surface_area() > overlap_threshold * root_area)
+        {
+            if (reference_count < reference_budget)
+                spatial = find_spatial_split(refs, bounds);
+        }
+
+        auto area = bounds.surface_area();
+        auto best_cost = fmin(object.cost, spatial.cost);
+        auto split_cost = area > 0 ? traversal_cost + best_cost / area : infinity;
+        if (n <= static_cast<size_t>(max_leaf_size) && n <= split_cost)
+        {
+            make_leaf(refs, bounds);
+            return;
+        }
+
+        std::vector<reference> left, right;
+        int axis = 0;
+        if (spatial.cost < object.cost)
+        {
+            axis = spatial.axis;
+            partition_spatial(refs, bounds, spatial, left, right);
+        }
+        if (left.empty() || right.empty() || left.size() == n || right.size() == n)
+        {
+            left.clear();
+            right.clear();
+            if (object.axis >= 0)
+            {
+                axis = object.axis;
+                partition_object(refs, object, left, right);
+            }
+            else
+            {
+                // All centroids coincide and nothing could be cut: split the list in half.
+                left.assign(refs.begin(), refs.begin() + n / 2);
+                right.assign(refs.begin() + n / 2, refs.end());
+            }
+        }
+        std::vector<reference>().swap(refs);
+
+        aabb left_bounds, right_bounds;
+        for (const auto &r : left)
+            left_bounds = aabb(left_bounds, r.box);
+        for (const auto &r : right)
+            right_bounds = aabb(right_bounds, r.box);
+
+        // Depth-first layout: the left child follows its parent directly.
+        auto index = nodes.size();
+        nodes.push_back(make_linear_bvh_node(bounds));
+        build_node(left, left_bounds, depth + 1);
+        nodes[index].offset = static_cast<uint32_t>(nodes.size());
+        nodes[index].axis = static_cast<uint8_t>(axis);
+        build_node(right, right_bounds, depth + 1);
+    }
+
+    void partition_object(const std::vector<reference> &refs, const split &s,
+                          std::vector<reference> &left, std::vector<reference> &right) const
+    {
+        aabb cb;
+        for (const auto &r : refs)
+            cb = aabb(cb, aabb(r.box.center(), r.box.center()));
+        auto lo = cb.axis(s.axis).min;
+        auto extent = cb.axis(s.axis).size();
+
+        for (const auto &r : refs)
+        {
+            if (bin_of(r.box.center()[s.axis], lo, extent) < s.plane)
+                left.push_back(r);
+            else
+                right.push_back(r);
+        }
+    }
+
+    void partition_spatial(const std::vector<reference> &refs, const aabb &bounds, const split &s,
+                           std::vector<reference> &left, std::vector<reference> &right)
+    {
+        auto axis = s.axis;
+        auto plane = bounds.axis(axis).min + s.plane * bounds.axis(axis).size() / bin_count;
+
+        std::vector<const reference *> straddling;
+        for (const auto &r : refs)
+        {
+            if (r.box.axis(axis).max <= plane)
+                left.push_back(r);
+            else if (r.box.axis(axis).min >= plane)
+                right.push_back(r);
+            else
+                straddling.push_back(&r);
+        }
+
+        aabb left_box = s.left, right_box = s.right;
+        auto left_count = left.size() + straddling.size();
+        auto right_count = right.size() + straddling.size();
+
+        for (auto r : straddling)
+        {
+            // Reference unsplitting: keep the whole reference on one side when that is
+            // cheaper than paying for it in both children.
+            auto split_cost = left_box.surface_area() * left_count +
+                              right_box.surface_area() * right_count;
+            auto only_left = aabb(left_box, r->box).surface_area() * left_count +
+                             right_box.surface_area() * (right_count - 1);
+            auto only_right = left_box.surface_area() * (left_count - 1) +
+                              aabb(right_box, r->box).surface_area() * right_count;
+
+            bool over_budget = reference_count >= reference_budget;
+            if (over_budget)
+                split_cost = infinity;
+
+            if (only_left < split_cost && only_left <= only_right)
+            {
+                left.push_back(*r);
+                left_box = aabb(left_box, r->box);
+                right_count--;
+            }
+            else if (only_right < split_cost)
+            {
+                right.push_back(*r);
+                right_box = aabb(right_box, r->box);
+                left_count--;
+            }
+            else
+            {
+                reference lo = *r, hi = *r;
+                lo.box = clip(r->box, axis, -infinity, plane);
+                hi.box = clip(r->box, axis, plane, infinity);
+                left.push_back(lo);
+                right.push_back(hi);
+                reference_count++;
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,170 @@
+#ifndef SCENE_ARENA_H
+#define SCENE_ARENA_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bulk storage for the objects of one scene. make<T>() constructs a T in place in a block of
+// objects of the same type, so the spheres, quads, bvh_nodes and materials of a scene each lie
+// next to each other instead of scattered over the heap, and without a control block apiece.
+// The returned shared_ptr aliases an empty owner: it points at the object but owns nothing, so
+// copying and dropping it touch no reference count. Everything is destroyed at once, in reverse
+// order of construction, when the arena is.
+//
+// The arena has to outlive every pointer it handed out, including those held by objects built
+// outside it (a camera's world, a frozen scene, ...). Built with RT_ARENA_CHECK defined (cmake
+// -DRT_ARENA_CHECK=ON), the pointers share one counted owner instead and the arena aborts when
+// one is still held as it dies; that count is contended, so the check is off by default.
+//
+// Arena objects may in turn hold ordinary shared_ptrs to heap objects; their destructors
+// release them. Nothing is freed before the arena goes, so fill it while authoring a scene (see
+// author_in()) and not from code that rebuilds as it runs. Not thread safe: an arena is filled
+// from the thread that opened its scope, and objects made on other threads (the tasks of a
+// parallel BVH build) come from the heap.
+class scene_arena
+{
+public:
+    static const size_t block_bytes = 64 * 1024;
+
+    scene_arena() {}
+    scene_arena(const scene_arena &) = delete;
+    scene_arena &operator=(const scene_arena &) = delete;
+
+    ~scene_arena()
+    {
+        for (auto i = destructors.rbegin(); i != destructors.rend(); ++i)
+            i->destroy(i->object);
+#ifdef RT_ARENA_CHECK
+        // The arena's own objects are gone, so any owner left holds a pointer into the blocks.
+        std::weak_ptr<void> held = owner;
+        owner.reset();
+        if (!held.expired())
+        {
+            std::cerr << "ERROR: scene_arena destroyed while " << held.use_count()
+                      << " pointers to its objects are still held\n";
+            std::abort();
+        }
+#endif
+        for (auto &entry : pools)
+        {
+            for (auto block : entry.second.blocks)
+                ::operator delete(block);
+        }
+    }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args &&...args)
+    {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "over-aligned scene object");
+        auto &p = pools[std::type_index(typeid(T))];
+        if (p.free == 0)
+        {
+            auto count = std::max<size_t>(1, block_bytes / sizeof(T));
+            p.blocks.push_back(::operator new(count * sizeof(T)));
+            p.next = static_cast<char *>(p.blocks.back());
+            p.free = count;
+        }
+
+        auto object = new (p.next) T(std::forward<Args>(args)...);
+        p.next += sizeof(T);
+        p.free--;
+        if (!std::is_trivially_destructible<T>::value)
+            destructors.push_back({object, &destroy<T>});
+        objects++;
+        bytes += sizeof(T);
+#ifdef RT_ARENA_CHECK
+        return shared_ptr<T>(owner, object);
+#else
+        return shared_ptr<T>(shared_ptr<T>(), object);
+#endif
+    }
+
+    size_t object_count() const { return objects; }
+    size_t object_bytes() const { return bytes; }
+
+    // While a scope is alive, make_scene_object() on its thread allocates from the arena.
+    class scope
+    {
+    public:
+        explicit scope(scene_arena &arena) : previous(current())
+        {
+            current() = &arena;
+        }
+        ~scope() { current() = previous; }
+
+        scope(const scope &) = delete;
+        scope &operator=(const scope &) = delete;
+
+    private:
+        scene_arena *previous;
+    };
+
+    static scene_arena *&current()
+    {
+        static thread_local scene_arena *arena = nullptr;
+        return arena;
+    }
+
+private:
+    // Consecutive objects of one type; the last block has free slots starting at next.
+    struct pool
+    {
+        std::vector<void *> blocks;
+        char *next = nullptr;
+        size_t free = 0;
+    };
+
+    struct destructor
+    {
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    template <typename T>
+    static void destroy(void *object)
+    {
+        static_cast<T *>(object)->~T();
+    }
+
+    std::unordered_map<std::type_index, pool> pools;
+    std::vector<destructor> destructors;
+    size_t objects = 0;
+    size_t bytes = 0;
+#ifdef RT_ARENA_CHECK
+    // Shared by every pointer handed out, so that they can be counted when the arena dies.
+    shared_ptr<void> owner = make_shared<char>(0);
+#endif
+};
+
+// Calls author() inside a scope of arena and returns what it built. Objects made later on this
+// thread, such as BVH rebuilds or lazy subtrees built during a render, then come from the heap
+// and are freed as usual.
+template <typename F>
+auto author_in(scene_arena &arena, F author) -> decltype(author())
+{
+    scene_arena::scope scope(arena);
+    return author();
+}
+
+// make_shared for scene authoring: takes the object from the arena of the enclosing
+// scene_arena::scope if there is one, and from the heap otherwise.
+template <typename T, typename... Args>
+shared_ptr<T> make_scene_object(Args &&...args)
+{
+    if (auto arena = scene_arena::current())
+        return arena->make<T>(std::forward<Args>(args)...);
+    return make_shared<T>(std::forward<Args>(args)...);
+}
+
+#endif
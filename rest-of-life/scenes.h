@@ -0,0 +1,400 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "box.h"
+#include "bvh_build.h"
+#include "constant_medium.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "material.h"
+#include "quad.h"
+#include "scene_arena.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "texture.h"
+#include "triangle_mesh.h"
+
+// Scene geometry shared by main.cpp and the benchmark/inspection tools. Each function only
+// builds the world; cameras and render settings stay with the caller.
+
+hittable_list random_spheres_world()
+{
+    hittable_list world;
+
+    auto checker = make_scene_object<checker_texture>(0.5, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(make_scene_object<sphere>(point3(0, -1000, 0), 1000,
+                                        make_scene_object<lambertian>(checker)));
+
+    for (int a = -11; a < 11; a++)
+    {
+        for (int b = -11; b < 11; b++)
+        {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+            if ((center - point3(4, 0.2, 0)).length() > 0.9)
+            {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8)
+                {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = make_scene_object<lambertian>(albedo);
+                    auto center2 = center + vec3(0, random_double(0, .5), 0);
+                    world.add(make_scene_object<sphere>(center, center2, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95)
+                {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = make_scene_object<metal>(albedo, fuzz);
+                    world.add(make_scene_object<sphere>(center, 0.2, sphere_material));
+                }
+                else
+                {
+                    // glass
+                    sphere_material = make_scene_object<dielectric>(1.5);
+                    world.add(make_scene_object<sphere>(center, 0.2, sphere_material));
+                }
+            }
+        }
+    }
+
+    auto material1 = make_scene_object<dielectric>(1.5);
+    world.add(make_scene_object<sphere>(point3(0, 1, 0), 1.0, material1));
+
+    auto material2 = make_scene_object<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(make_scene_object<sphere>(point3(-4, 1, 0), 1.0, material2));
+
+    auto material3 = make_scene_object<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(make_scene_object<sphere>(point3(4, 1, 0), 1.0, material3));
+
+    return world;
+}
+
+hittable_list two_spheres_world()
+{
+    hittable_list world;
+
+    auto checker = make_scene_object<checker_texture>(0.8, color(.2, .3, .1), color(.9, .9, .9));
+
+    world.add(make_scene_object<sphere>(point3(0, -10, 0), 10,
+                                        make_scene_object<lambertian>(checker)));
+    world.add(make_scene_object<sphere>(point3(0, 10, 0), 10,
+                                        make_scene_object<lambertian>(checker)));
+
+    return world;
+}
+
+hittable_list earth_world()
+{
+    auto earth_texture = make_scene_object<image_texture>("earthmap.jpg");
+    auto earth_surface = make_scene_object<lambertian>(earth_texture);
+    auto globe = make_scene_object<sphere>(point3(0, 0, 0), 2, earth_surface);
+
+    return hittable_list(globe);
+}
+
+hittable_list two_perlin_spheres_world()
+{
+    hittable_list world;
+
+    auto pertext = make_scene_object<noise_texture>(4);
+    world.add(make_scene_object<sphere>(point3(0,-1000,0), 1000,
+                                        make_scene_object<lambertian>(pertext)));
+    world.add(make_scene_object<sphere>(point3(0,2,0), 2, make_scene_object<lambertian>(pertext)));
+
+    return world;
+}
+
+hittable_list quads_world()
+{
+    hittable_list world;
+
+    // Materials
+    auto left_red     = make_scene_object<lambertian>(color(1.0, 0.2, 0.2));
+    auto back_green   = make_scene_object<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue   = make_scene_object<lambertian>(color(0.2, 0.2, 1.0));
+    auto upper_orange = make_scene_object<lambertian>(color(1.0, 0.5, 0.0));
+    auto lower_teal   = make_scene_object<lambertian>(color(0.2, 0.8, 0.8));
+
+    // Quads
+    world.add(make_scene_object<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
+    world.add(make_scene_object<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(make_scene_object<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(make_scene_object<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4),
+                                      upper_orange));
+    world.add(make_scene_object<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
+
+    return world;
+}
+
+hittable_list simple_light_world()
+{
+    hittable_list world;
+
+    auto pertext = make_scene_object<noise_texture>(4);
+    world.add(make_scene_object<sphere>(point3(0,-1000,0), 1000,
+                                        make_scene_object<lambertian>(pertext)));
+    world.add(make_scene_object<sphere>(point3(0,2,0), 2, make_scene_object<lambertian>(pertext)));
+
+    auto difflight = make_scene_object<diffuse_light>(color(4,4,4));
+    world.add(make_scene_object<sphere>(point3(0,7,0), 2, difflight));
+    world.add(make_scene_object<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
+
+    return world;
+}
+
+// A box for the scenes below: one aligned_box, or with quad_boxes the six-quad box the book
+// built, in a BVH of its own. The quad_boxes variants of the scenes exist for benchmarks.
+shared_ptr<hittable> scene_box(const point3 &a, const point3 &b, shared_ptr<material> mat,
+                               bool quad_boxes)
+{
+    if (quad_boxes)
+        return build_bvh(*box_quads(a, b, mat), bvh_build_method::sah);
+    return box(a, b, mat);
+}
+
+hittable_list cornell_box_world(bool quad_boxes)
+{
+    hittable_list world;
+
+    auto red   = make_scene_object<lambertian>(color(.65, .05, .05));
+    auto white = make_scene_object<lambertian>(color(.73, .73, .73));
+    auto green = make_scene_object<lambertian>(color(.12, .45, .15));
+    auto light = make_scene_object<diffuse_light>(color(15, 15, 15));
+
+    world.add(make_scene_object<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_scene_object<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_scene_object<quad>(point3(343, 554, 332), vec3(-130,0,0), vec3(0,0,-105),
+                                      light));
+    world.add(make_scene_object<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_scene_object<quad>(point3(555,555,555), vec3(-555,0,0), vec3(0,0,-555), white));
+    world.add(make_scene_object<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    auto box1 = scene_box(point3(0,0,0), point3(165,330,165), white, quad_boxes);
+    world.add(make_scene_object<instance>(box1, affine_transform::translation(vec3(265,0,295))
+                                              * affine_transform::rotation_y(15)));
+
+    auto box2 = scene_box(point3(0,0,0), point3(165,165,165), white, quad_boxes);
+    world.add(make_scene_object<instance>(box2, affine_transform::translation(vec3(130,0,65))
+                                              * affine_transform::rotation_y(-18)));
+
+    return world;
+}
+
+hittable_list cornell_box_world() { return cornell_box_world(false); }
+
+hittable_list cornell_box_lights()
+{
+    hittable_list lights;
+    auto m = shared_ptr<material>();
+    lights.add(make_scene_object<quad>(point3(343,554,332), vec3(-130,0,0), vec3(0,0,-105), m));
+    return lights;
+}
+
+hittable_list cornell_smoke_world()
+{
+    hittable_list world;
+
+    auto red   = make_scene_object<lambertian>(color(.65, .05, .05));
+    auto white = make_scene_object<lambertian>(color(.73, .73, .73));
+    auto green = make_scene_object<lambertian>(color(.12, .45, .15));
+    auto light = make_scene_object<diffuse_light>(color(7, 7, 7));
+
+    world.add(make_scene_object<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_scene_object<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_scene_object<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(make_scene_object<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_scene_object<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_scene_object<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    shared_ptr<hittable> box1 = box(point3(0,0,0), point3(165,330,165), white);
+    box1 = make_scene_object<rotate_y>(box1, 15);
+    box1 = make_scene_object<translate>(box1, vec3(265,0,295));
+
+    shared_ptr<hittable> box2 = box(point3(0,0,0), point3(165,165,165), white);
+    box2 = make_scene_object<rotate_y>(box2, -18);
+    box2 = make_scene_object<translate>(box2, vec3(130,0,65));
+
+    world.add(make_scene_object<constant_medium>(box1, 0.01, color(0,0,0)));
+    world.add(make_scene_object<constant_medium>(box2, 0.01, color(1,1,1)));
+
+    return world;
+}
+
+hittable_list final_scene_world(bool quad_boxes)
+{
+    hittable_list boxes1;
+    auto ground = make_scene_object<lambertian>(color(0.48, 0.83, 0.53));
+
+    // All floor boxes instance one unit box; only the 3x4 placement differs per box.
+    auto unit_box = scene_box(point3(0,0,0), point3(1,1,1), ground, quad_boxes);
+
+    int boxes_per_side = 20;
+    for (int i = 0; i < boxes_per_side; i++) {
+        for (int j = 0; j < boxes_per_side; j++) {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i*w;
+            auto z0 = -1000.0 + j*w;
+            auto y0 = 0.0;
+            auto x1 = x0 + w;
+            auto y1 = random_double(1,101);
+            auto z1 = z0 + w;
+
+            boxes1.add(make_scene_object<instance>(unit_box,
+                affine_transform::translation(vec3(x0,y0,z0))
+                * affine_transform::scaling(vec3(x1-x0, y1-y0, z1-z0))));
+        }
+    }
+
+    hittable_list world;
+
+    world.add(make_scene_object<bvh_node>(boxes1));
+
+    auto light = make_scene_object<diffuse_light>(color(7, 7, 7));
+    world.add(make_scene_object<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
+
+    auto center1 = point3(400, 400, 200);
+    auto center2 = center1 + vec3(30,0,0);
+    auto sphere_material = make_scene_object<lambertian>(color(0.7, 0.3, 0.1));
+    world.add(make_scene_object<sphere>(center1, center2, 50, sphere_material));
+
+    world.add(make_scene_object<sphere>(point3(260, 150, 45), 50,
+                                        make_scene_object<dielectric>(1.5)));
+    world.add(make_scene_object<sphere>(
+        point3(0, 150, 145), 50, make_scene_object<metal>(color(0.8, 0.8, 0.9), 1.0)
+    ));
+
+    auto boundary = make_scene_object<sphere>(point3(360,150,145), 70,
+                                              make_scene_object<dielectric>(1.5));
+    world.add(boundary);
+    world.add(make_scene_object<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    boundary = make_scene_object<sphere>(point3(0,0,0), 5000, make_scene_object<dielectric>(1.5));
+    world.add(make_scene_object<constant_medium>(boundary, .0001, color(1,1,1)));
+
+    auto emat = make_scene_object<lambertian>(make_scene_object<image_texture>("earthmap.jpg"));
+    world.add(make_scene_object<sphere>(point3(400,200,400), 100, emat));
+    auto pertext = make_scene_object<noise_texture>(0.1);
+    world.add(make_scene_object<sphere>(point3(220,280,300), 80,
+                                        make_scene_object<lambertian>(pertext)));
+
+    std::vector<sphere_set::sphere_data> boxes2;
+    auto white = make_scene_object<lambertian>(color(.73, .73, .73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++) {
+        boxes2.push_back({point3::random(0,165), 10, white});
+    }
+
+    world.add(make_scene_object<instance>(
+        make_scene_object<sphere_set>(boxes2),
+        affine_transform::translation(vec3(-100,270,395)) * affine_transform::rotation_y(15)));
+
+    return world;
+}
+
+hittable_list final_scene_world() { return final_scene_world(false); }
+
+std::vector<sphere_set::sphere_data> sphere_cloud_spheres(int count)
+{
+    // Procedural stress scene: count small spheres scattered through a cube whose volume grows
+    // with count, so the density (and the per-ray work) stays roughly constant.
+    std::vector<sphere_set::sphere_data> spheres;
+    auto white = make_scene_object<lambertian>(color(.73, .73, .73));
+    auto extent = 10.0 * std::cbrt(static_cast<double>(count));
+
+    for (int i = 0; i < count; i++)
+    {
+        auto center = point3::random(0, extent);
+        spheres.push_back({center, random_double(0.5, 2.0), white});
+    }
+    return spheres;
+}
+
+// The spheres of sphere_cloud_spheres as separate sphere objects.
+hittable_list sphere_cloud_world(int count)
+{
+    hittable_list world;
+    for (const auto &s : sphere_cloud_spheres(count))
+        world.add(make_scene_object<sphere>(s.center, s.radius, s.mat));
+    return world;
+}
+
+// Buffers of count tessellated spheres scattered like sphere_cloud_world. Each is a latitude-
+// longitude grid of rings by 2 * rings cells, two triangles per cell and one at the poles, so
+// 4 * rings * (rings - 1) triangles, with per-vertex normals and uvs.
+shared_ptr<mesh_buffers> sphere_mesh_cloud(int count, int rings)
+{
+    auto mesh = make_scene_object<mesh_buffers>();
+    auto extent = 10.0 * std::cbrt(static_cast<double>(count));
+    auto segments = 2 * rings;
+
+    for (int s = 0; s < count; s++)
+    {
+        auto center = point3::random(0, extent);
+        auto radius = random_double(0.5, 2.0);
+        auto base = static_cast<uint32_t>(mesh->positions.size());
+
+        for (int i = 0; i <= rings; i++)
+        {
+            auto theta = pi * i / rings;
+            for (int j = 0; j <= segments; j++)
+            {
+                auto phi = 2 * pi * j / segments;
+                vec3 n(std::sin(theta) * std::cos(phi), std::cos(theta),
+                       std::sin(theta) * std::sin(phi));
+                mesh->positions.push_back(center + radius * n);
+                mesh->normals.push_back(n);
+                mesh->uvs.push_back(vec3(static_cast<double>(j) / segments,
+                                         1 - static_cast<double>(i) / rings, 0));
+            }
+        }
+
+        for (int i = 0; i < rings; i++)
+        {
+            for (int j = 0; j < segments; j++)
+            {
+                uint32_t a = base + i * (segments + 1) + j;
+                uint32_t c = a + segments + 1;
+                if (i > 0)
+                    mesh->indices.insert(mesh->indices.end(), {a, c, a + 1});
+                if (i < rings - 1)
+                    mesh->indices.insert(mesh->indices.end(), {a + 1, c, c + 1});
+            }
+        }
+    }
+    return mesh;
+}
+
+// Random rays with origins inside region and uniformly distributed directions, from a fixed
+// seed and an RNG of their own, so tools can compare structures on the same ray set.
+std::vector<ray> random_rays(const aabb &region, size_t count, unsigned seed = 7)
+{
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::vector<ray> rays;
+    rays.reserve(count);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        point3 origin(region.x.min + unit(gen) * region.x.size(),
+                      region.y.min + unit(gen) * region.y.size(),
+                      region.z.min + unit(gen) * region.z.size());
+        vec3 direction;
+        do
+        {
+            direction = vec3(2 * unit(gen) - 1, 2 * unit(gen) - 1, 2 * unit(gen) - 1);
+        } while (direction.length_squared() > 1 || direction.length_squared() < 1e-6);
+
+        rays.push_back(ray(origin, unit_vector(direction), unit(gen)));
+    }
+    return rays;
+}
+
+#endif
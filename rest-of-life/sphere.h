@@ -2,6 +2,7 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "instance.h"
 #include "vec3.h"
 
 class sphere : public hittable
@@ -29,38 +30,67 @@ public:
 
     bool hit(const ray &r, interval ray_t, hit_record &rec) const override
     {
-        point3 center = is_moving? sphere_center(r.time()) : center1;
-        vec3 oc = r.origin() - center;
-        auto a = r.direction().length_squared();
-        auto half_b = dot(oc, r.direction());
-        auto c = oc.length_squared() - radius * radius;
-
-        auto discriminant = half_b * half_b - a * c;
-        if (discriminant < 0)
+        return resolve_hit(r, ray_t, rec);
+    }
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        double root;
+        if (!intersect(r, is_moving ? sphere_center(r.time()) : center1, ray_t, root))
             return false;
-        auto sqrtd = sqrt(discriminant);
-
-        // Find the nearest root that lies in the acceptable range.
-        auto root = (-half_b - sqrtd) / a;
-        if(!ray_t.surrounds(root))
-        {
-            root = (-half_b + sqrtd) / a;
-            if(!ray_t.surrounds(root))
-            {
-                return false;
-            }
-        }
 
-        rec.t = root;
+        RT_STATS_COUNT(stat_candidates);
+        cand.t = root;
+        cand.object = this;
+        return true;
+    }
+    void surface(const ray &r, const hit_candidate &cand, hit_record &rec) const override
+    {
+        // The normal, and with it the acos and atan2 of the uv, only for the closest hit.
+        RT_STATS_COUNT(stat_surfaces);
+        point3 center = is_moving ? sphere_center(r.time()) : center1;
+        rec.t = cand.t;
         rec.p = r.at(rec.t);
         vec3 outward_normal = (rec.p - center) / radius;
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
-
-        return true;
+        rec.mat = mat.get();
+    }
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        double root;
+        return intersect(r, is_moving ? sphere_center(r.time()) : center1, ray_t, root);
     }
     aabb bounding_box() const override { return bbox; }
+    aabb bounding_box_at(double time) const override
+    {
+        if (!is_moving)
+            return bbox;
+        auto rvec = vec3(radius, radius, radius);
+        auto center = sphere_center(time);
+        return aabb(center - rvec, center + rvec);
+    }
+
+    shared_ptr<sphere> transformed(const affine_transform &t) const
+    {
+        // This sphere placed by t, or nullptr unless t only scales it uniformly and moves it:
+        // a rotated or mirrored copy would map its texture differently than instance does.
+        vec3 scale;
+        if (!t.axis_scaling(scale) || scale.x() <= 0 || scale.y() != scale.x() ||
+            scale.z() != scale.x())
+            return nullptr;
+        if (!is_moving)
+            return make_shared<sphere>(t.point(center1), radius * scale.x(), mat);
+        return make_shared<sphere>(t.point(center1), t.point(center1 + center_vec),
+                                   radius * scale.x(), mat);
+    }
+
+    void move(const vec3 &offset)
+    {
+        // Shifts the whole shutter path of the sphere. BVHs containing it need a refit.
+        center1 += offset;
+        bbox = bbox + offset;
+    }
+
     static void get_sphere_uv(const point3& p, double& u, double& v)
     {
         // p: a given point on the sphere of radius one, centered at the origin.
@@ -89,6 +119,32 @@ private:
     {
         return center1 + time * center_vec;
     }
+
+    bool intersect(const ray &r, const point3 &center, interval ray_t, double &root) const
+    {
+        RT_STATS_COUNT(stat_sphere_tests);
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius * radius;
+
+        auto discriminant = half_b * half_b - a * c;
+        if (discriminant < 0)
+            return false;
+        auto sqrtd = sqrt(discriminant);
+
+        // Find the nearest root that lies in the acceptable range.
+        root = (-half_b - sqrtd) / a;
+        if(!ray_t.surrounds(root))
+        {
+            root = (-half_b + sqrtd) / a;
+            if(!ray_t.surrounds(root))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 #endif
\ No newline at end of file
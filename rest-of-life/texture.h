@@ -11,6 +11,9 @@ public:
     virtual ~texture() = default;
 
     virtual color value(double u, double v, const point3 &p) const = 0;
+
+    // True, with the color, for a texture that is the same everywhere.
+    virtual bool constant(color &c) const { return false; }
 };
 
 class solid_color : public texture
@@ -25,6 +28,12 @@ public:
         return color_value;
     }
 
+    bool constant(color &c) const override
+    {
+        c = color_value;
+        return true;
+    }
+
 private:
     color color_value;
 };
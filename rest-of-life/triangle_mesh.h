@@ -0,0 +1,290 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "linear_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Vertex and index buffers of a triangle mesh, shared by every triangle_mesh built over them
+// (the same model with different materials or under different instance transforms). normals
+// and uvs are optional: either empty or one entry per position; a uv is stored as (u, v, 0).
+struct mesh_buffers
+{
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    std::vector<vec3> uvs;
+    std::vector<uint32_t> indices; // three per triangle
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    size_t memory_bytes() const
+    {
+        return positions.size() * sizeof(point3) + normals.size() * sizeof(vec3) +
+               uvs.size() * sizeof(vec3) + indices.size() * sizeof(uint32_t);
+    }
+};
+
+// A ray set up for the watertight ray-triangle test (Woop, Benthin and Wald, "Watertight
+// Ray/Triangle Intersection", JCGT 2013). The axes are permuted so that kz is the dominant
+// axis of the direction, and the shear that turns the ray into the +z axis is precomputed.
+struct watertight_ray
+{
+    point3 origin;
+    int kx, ky, kz;
+    double sx, sy, sz;
+
+    explicit watertight_ray(const ray &r) : origin(r.origin())
+    {
+        auto d = r.direction();
+        kz = std::fabs(d.x()) > std::fabs(d.y()) ? (std::fabs(d.x()) > std::fabs(d.z()) ? 0 : 2)
+                                                 : (std::fabs(d.y()) > std::fabs(d.z()) ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // Keep the winding of the sheared triangle independent of the sign of the direction.
+        if (d[kz] < 0)
+            std::swap(kx, ky);
+        sx = d[kx] / d[kz];
+        sy = d[ky] / d[kz];
+        sz = 1.0 / d[kz];
+    }
+};
+
+// Ray-triangle test that has no cracks: in the sheared space the edge functions of an edge
+// shared by two triangles are computed from the same two vertices in the same way, so a ray
+// through the edge hits at least one of them. Both windings are accepted. On a hit inside
+// ray_t, sets t and the barycentric weights of the three vertices.
+inline bool intersect_triangle(const watertight_ray &wr, const point3 &p0, const point3 &p1,
+                               const point3 &p2, interval ray_t, double &t, double weight[3])
+{
+    RT_STATS_COUNT(stat_triangle_tests);
+    auto a = p0 - wr.origin;
+    auto b = p1 - wr.origin;
+    auto c = p2 - wr.origin;
+
+    auto ax = a[wr.kx] - wr.sx * a[wr.kz];
+    auto ay = a[wr.ky] - wr.sy * a[wr.kz];
+    auto bx = b[wr.kx] - wr.sx * b[wr.kz];
+    auto by = b[wr.ky] - wr.sy * b[wr.kz];
+    auto cx = c[wr.kx] - wr.sx * c[wr.kz];
+    auto cy = c[wr.ky] - wr.sy * c[wr.kz];
+
+    // Edge functions: each is twice the signed area seen from the ray of the edge opposite
+    // one vertex, so they are also that vertex's unnormalized barycentric weight.
+    auto u = cx * by - cy * bx;
+    auto v = ax * cy - ay * cx;
+    auto w = bx * ay - by * ax;
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+        return false;
+
+    auto det = u + v + w;
+    if (det == 0)
+        return false;
+
+    auto scaled_t = u * wr.sz * a[wr.kz] + v * wr.sz * b[wr.kz] + w * wr.sz * c[wr.kz];
+    t = scaled_t / det;
+    if (!ray_t.surrounds(t))
+        return false;
+
+    weight[0] = u / det;
+    weight[1] = v / det;
+    weight[2] = w / det;
+    return true;
+}
+
+// Indexed triangle mesh with one material. The triangles are not hittables of their own: the
+// mesh keeps an internal flattened BVH (linear_bvh_node layout) whose leaves are ranges of a
+// triangle order array, so the scene BVH sees the mesh as one primitive and a triangle costs
+// its share of the shared buffers plus about 4 bytes of order and the node array. Shading data
+// is computed once, for the closest triangle, in surface().
+class triangle_mesh : public hittable
+{
+public:
+    static const int max_depth = range_bvh_builder::max_depth;
+    static const int default_max_leaf_size = 4;
+
+    triangle_mesh(shared_ptr<const mesh_buffers> _mesh, shared_ptr<material> _mat,
+                  int max_leaf_size = default_max_leaf_size)
+        : mesh(_mesh), mat(_mat)
+    {
+        const auto &positions = mesh->positions;
+        const auto &indices = mesh->indices;
+        std::vector<range_bvh_builder::primitive> prims(mesh->triangle_count());
+        for (size_t i = 0; i < prims.size(); i++)
+        {
+            const auto &p0 = positions[indices[3 * i]];
+            const auto &p1 = positions[indices[3 * i + 1]];
+            const auto &p2 = positions[indices[3 * i + 2]];
+            prims[i].box = aabb(aabb(p0, p1), aabb(p2, p2)).pad();
+            prims[i].centroid = prims[i].box.center();
+            prims[i].index = static_cast<uint32_t>(i);
+        }
+
+        range_bvh_builder(max_leaf_size, linear_bvh::intersection_cost).build(prims, nodes, order);
+        if (!nodes.empty())
+            bbox = aabb(interval(nodes[0].bounds_min[0], nodes[0].bounds_max[0]),
+                        interval(nodes[0].bounds_min[1], nodes[0].bounds_max[1]),
+                        interval(nodes[0].bounds_min[2], nodes[0].bounds_max[2]));
+    }
+
+    bool hit(const ray &r, interval ray_t, hit_record &rec) const override
+    {
+        return resolve_hit(r, ray_t, rec);
+    }
+
+    bool intersect(const ray &r, interval ray_t, hit_candidate &cand) const override
+    {
+        uint32_t triangle;
+        double t, weight[3];
+        if (!traverse(r, ray_t, false, triangle, t, weight))
+            return false;
+
+        cand.t = t;
+        cand.object = this;
+        cand.primitive = triangle;
+        cand.b1 = weight[1];
+        cand.b2 = weight[2];
+        return true;
+    }
+
+    void surface(const ray &r, const hit_candidate &cand, hit_record &rec) const override
+    {
+        RT_STATS_COUNT(stat_surfaces);
+        const auto &positions = mesh->positions;
+        const auto *vertex = &mesh->indices[3 * cand.primitive];
+        const auto &p0 = positions[vertex[0]];
+        double weight[3] = {1 - cand.b1 - cand.b2, cand.b1, cand.b2};
+
+        rec.t = cand.t;
+        rec.p = r.at(cand.t);
+        rec.mat = mat.get();
+        rec.set_face_normal(r, unit_vector(cross(positions[vertex[1]] - p0,
+                                                 positions[vertex[2]] - p0)));
+
+        if (!mesh->normals.empty())
+        {
+            // Interpolated shading normal, on the same side as the geometric one.
+            const auto &normals = mesh->normals;
+            auto shading = unit_vector(weight[0] * normals[vertex[0]] +
+                                       weight[1] * normals[vertex[1]] +
+                                       weight[2] * normals[vertex[2]]);
+            rec.normal = rec.front_face ? shading : -shading;
+        }
+
+        if (!mesh->uvs.empty())
+        {
+            const auto &uvs = mesh->uvs;
+            auto uv = weight[0] * uvs[vertex[0]] + weight[1] * uvs[vertex[1]] +
+                      weight[2] * uvs[vertex[2]];
+            rec.u = uv.x();
+            rec.v = uv.y();
+        }
+        else
+        {
+            rec.u = weight[1];
+            rec.v = weight[2];
+        }
+    }
+
+    bool occluded(const ray &r, interval ray_t) const override
+    {
+        uint32_t triangle;
+        double t, weight[3];
+        return traverse(r, ray_t, true, triangle, t, weight);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    size_t triangle_count() const { return order.size(); }
+    const mesh_buffers &buffers() const { return *mesh; }
+    const std::vector<linear_bvh_node> &node_array() const { return nodes; }
+
+    // Bytes of this mesh's own arrays; the shared buffers are counted by mesh_buffers.
+    size_t memory_bytes() const
+    {
+        return nodes.size() * sizeof(linear_bvh_node) + order.size() * sizeof(uint32_t);
+    }
+
+private:
+    shared_ptr<const mesh_buffers> mesh;
+    shared_ptr<material> mat;
+    std::vector<linear_bvh_node> nodes;
+    std::vector<uint32_t> order; // triangle indices in leaf order
+    aabb bbox;
+
+    // Finds the closest triangle in ray_t, or with any_hit the first one found.
+    bool traverse(const ray &r, interval ray_t, bool any_hit, uint32_t &triangle, double &t,
+                  double weight[3]) const
+    {
+        if (nodes.empty())
+            return false;
+
+        precomputed_ray pr(r);
+        watertight_ray wr(r);
+        const auto &positions = mesh->positions;
+        const auto &indices = mesh->indices;
+
+        bool hit_anything = false;
+        uint32_t stack[max_depth];
+        int stack_size = 0;
+        uint32_t index = 0;
+
+        while (true)
+        {
+            RT_STATS_COUNT(stat_nodes);
+            const auto &node = nodes[index];
+            double lo[3] = {node.bounds_min[0], node.bounds_min[1], node.bounds_min[2]};
+            double hi[3] = {node.bounds_max[0], node.bounds_max[1], node.bounds_max[2]};
+            double tnear;
+
+            if (slab_hit(lo, hi, pr, ray_t, tnear))
+            {
+                if (node.count > 0)
+                {
+                    for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                    {
+                        const auto *vertex = &indices[3 * order[i]];
+                        double hit_t, hit_weight[3];
+                        if (!intersect_triangle(wr, positions[vertex[0]], positions[vertex[1]],
+                                                positions[vertex[2]], ray_t, hit_t, hit_weight))
+                            continue;
+                        triangle = order[i];
+                        if (any_hit)
+                            return true;
+                        RT_STATS_COUNT(stat_candidates);
+                        hit_anything = true;
+                        ray_t.max = t = hit_t;
+                        std::copy(hit_weight, hit_weight + 3, weight);
+                    }
+                }
+                else
+                {
+                    // Visit the child on the near side of the split axis first.
+                    if (pr.sign[node.axis])
+                    {
+                        stack[stack_size++] = index + 1;
+                        index = node.offset;
+                    }
+                    else
+                    {
+                        stack[stack_size++] = node.offset;
+                        index = index + 1;
+                    }
+                    continue;
+                }
+            }
+
+            if (stack_size == 0)
+                break;
+            index = stack[--stack_size];
+        }
+        return hit_anything;
+    }
+};
+
+#endif